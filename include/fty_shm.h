@@ -35,10 +35,16 @@ extern "C" {
 // Stores a single metric in shm. The metric name must be a valid filename
 // (must not contain slashes and must fit within the OS limit for filename
 // length). TTL is the number of seconds for which this metric is valid,
-// where 0 means infinity
+// where 0 means infinity. Values can be up to 1 MiB long, the segment
+// backend fails with EMSGSIZE for those of more than about 600 bytes. Units
+// can be up to 255 characters long, those of more than 10 are kept in a
+// dictionary of the storage directory
 // Returns 0 on success. On error, returns -1 and sets errno accordingly
 int fty_shm_write_metric(const char* asset, const char* metric, const char* value, const char* unit, int ttl);
 
+// Store the value of a NUT variable under its fty metric type and unit, see
+// fty::shm::write_nut_metric()
+// Returns 0 on success. On error, returns -1 and sets errno accordingly
 int fty_shm_write_nut_metric(const char* asset, const char* metric, const char* value, int ttl);
 
 // Retrieve a metric from shm. Caller must free the returned values.
@@ -63,8 +69,13 @@ void init_default_dir();
 // requires the caller to provide a container for the results instead of
 // relying on RVO -- but it should be good enough for now.
 
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdint.h>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <fty_proto.h>
 
@@ -91,15 +102,137 @@ namespace shm {
             std::vector<fty_proto_t*> m_metricsVector;
     };
 
+    // Selects the metrics of a family whose asset and metric type match the
+    // given regular expressions. The family "*" selects all families.
+    // Patterns without regex metacharacters (escape dots as "\\.") and such
+    // strings followed by ".*" are matched without std::regex, and a query
+    // where both are plain strings opens the metric directly instead of
+    // scanning the family. If aux_key is set, only metrics whose fty_proto
+    // aux attribute aux_key equals aux_value are selected, which is looked up
+    // in the family's inverted index if the key is indexed (see
+    // add_aux_index())
+    struct Query {
+        Query(const std::string& family_, const std::string& asset_ = ".*", const std::string& type_ = ".*")
+            : family(family_), asset(asset_), type(type_)
+        {
+        }
+        std::string family;
+        std::string asset;
+        std::string type;
+        std::string aux_key;
+        std::string aux_value;
+    };
+
+    // Numeric metrics stored as a structure of arrays. Row i is the metric
+    // type_names[types[i]] of the asset asset_names[assets[i]], with the value
+    // values[i] written at timestamps[i] (seconds since the epoch). The
+    // reads only clear the rows and keep the name dictionaries, so ids stay
+    // stable when the same object is reused for periodic reads. clear()
+    // drops the dictionaries too
+    class ColumnarResult
+    {
+        public :
+            void clear();
+            void clear_rows();
+            void add(const char* asset, const char* type, size_t type_len, double value, int64_t timestamp);
+            size_t size() const { return values.size(); }
+
+            std::vector<uint32_t> assets;
+            std::vector<uint32_t> types;
+            std::vector<double> values;
+            std::vector<int64_t> timestamps;
+            std::vector<std::string> asset_names;
+            std::vector<std::string> type_names;
+        private :
+            uint32_t intern(std::unordered_map<std::string, uint32_t>& ids, std::vector<std::string>& names);
+            std::unordered_map<std::string, uint32_t> m_assetIds;
+            std::unordered_map<std::string, uint32_t> m_typeIds;
+            std::string m_key;
+    };
+
+    // Summary of the numeric values matched by aggregate(). min, max and avg()
+    // are NaN if no value has been matched
+    struct Aggregate {
+        Aggregate()
+            : count(0), sum(0), min(std::numeric_limits<double>::quiet_NaN()), max(min)
+        {
+        }
+        void add(double value)
+        {
+            if (!count++) {
+                min = max = value;
+            } else {
+                min = value < min ? value : min;
+                max = value > max ? value : max;
+            }
+            sum += value;
+        }
+        double avg() const
+        {
+            return count ? sum / count : std::numeric_limits<double>::quiet_NaN();
+        }
+        size_t count;
+        double sum;
+        double min;
+        double max;
+    };
+
+    // How a query has been run, as reported by explain(). Costs are counted
+    // in directory entries examined plus files looked up directly
+    struct QueryPlan {
+        enum AccessPath {
+            POINT_READ,  // Open the only file that can match in each family
+            SCAN,        // Read the family directories and match every entry
+            CACHED,      // Read the entries cached by a PreparedQuery
+            INDEX_RANGE, // Match only the range of a sorted index of the names
+                         // with the literal or prefix of the asset or type
+            AUX_INDEX    // Read the metrics listed in the inverted index for
+                         // the aux attribute of the query
+        };
+        QueryPlan()
+            : path(SCAN), estimated_cost(0), actual_cost(0), rows(0), elapsed_ns(0)
+        {
+        }
+        AccessPath path;
+        std::string description;
+        size_t estimated_cost;
+        size_t actual_cost;
+        // Number of metrics read
+        size_t rows;
+        uint64_t elapsed_ns;
+    };
+
+    enum SortOrder {
+        SORT_DESCENDING, // Highest values first
+        SORT_ASCENDING   // Lowest values first
+    };
+
     typedef std::vector<std::string> Assets;
     struct Metric {
         std::string value;
         std::string unit;
     };
     typedef std::unordered_map<std::string, Metric> Metrics;
+    typedef std::unordered_map<std::string, Metrics> AssetsMetrics;
     
+    // Store the value of a NUT variable under its fty metric type and unit,
+    // from a table built into the library. Variables without a mapping are
+    // stored under their NUT name, without a unit. A variable that shares
+    // its metric with a more precise one, such as input.voltage with
+    // input.L1-N.voltage, is stored all the same: only write_nut_metrics()
+    // sees both and keeps the more precise one.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly
     int write_nut_metric(std::string asset, std::string metric, std::string value, int ttl);
 
+    // Store the NUT variables of a device, by name, which have a mapping to
+    // an fty metric, as write_nut_metric() does. The others, such as the
+    // model or the serial number, are skipped. When two variables map to the
+    // same metric, such as input.voltage and input.L1-N.voltage, only the
+    // more precise one, the per-phase one, is stored.
+    // Returns 0 on success. On error, returns -1 and sets errno as for the
+    // last variable that could not be stored, after trying the others
+    int write_nut_metrics(const std::string& asset, const std::map<std::string, std::string>& variables, int ttl);
+
     // C++ versions of fty_shm_write_metric()
     int write_metric(fty_proto_t* metric);
     int write_metric(const std::string& asset, const std::string& metric, const std::string& value, const std::string& unit, int ttl);
@@ -119,31 +252,351 @@ namespace shm {
     // C++ version of fty_shm_read_metric()
     int read_metric(const std::string& asset, const std::string& metric, std::string& value);
     int read_metric(const std::string& asset, const std::string& metric, std::string& value, std::string& unit);
+    // Returns the unit interned, see intern_unit()
+    int read_metric(const std::string& asset, const std::string& metric, std::string& value, const char*& unit);
+    // Also returns the time of the write in nanoseconds since the epoch
+    int read_metric(const std::string& asset, const std::string& metric, std::string& value, std::string& unit,
+        int64_t& time_ns);
     inline int read_metric(const std::string& asset, const std::string& metric, Metric& result)
     {
         return read_metric(asset, metric, result.value, result.unit);
     }
 
+    // The unique copy of unit in the process, which stays valid for as long
+    // as the process runs. Equal units get the same pointer
+    const char* intern_unit(const std::string& unit);
+
     // C++ wrapper for fty_shm_delete_asset()
     inline int delete_asset(const std::string& asset)
     {
         return fty_shm_delete_asset(asset.c_str());
     }
 
+    // Maintain an inverted index of the metrics written by
+    // write_metric(fty_proto_t*) by the value of their aux attribute key, so
+    // that queries with this aux_key only read the matching metrics. The
+    // index is built from the existing metrics and kept up to date by the
+    // writers of every process from then on.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly
+    int add_aux_index(const std::string& key);
+
+    // Shard the family: move its metrics from the flat directory to fanout
+    // (2 to 256) subdirectories picked by a hash of the metric name, so that
+    // very large families do not end up in one huge directory. Can be run
+    // while the family is in use, readers and writers switch to the sharded
+    // layout transparently. The metrics written to the flat layout by the
+    // processes that have not noticed yet are moved by fty_shm_cleanup(), or
+    // by running this again, a couple of seconds later. Also finishes an
+    // interrupted migration.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly
+    int shard_family(const std::string& family, unsigned fanout);
+
+    // Select where this process keeps the metrics: "file" (the default), a
+    // file per metric in the storage directory, "segment", a single shared
+    // memory segment in the storage directory, "packed", a file per asset
+    // in the storage directory, or "heap", the memory of this process only,
+    // for unit tests and embedding. The FTY_SHM_BACKEND
+    // environment variable selects the backend of processes that do not
+    // call this. Processes that share metrics have to use the same backend
+    // and metrics are not moved between backends. Indexes and sharding are
+    // specific to the files, queries scan the other backends. The packed
+    // backend limits metric types to 41 bytes, longer ones fail with
+    // ENAMETOOLONG, and records to 192 bytes, longer ones fail with
+    // EMSGSIZE.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly
+    int set_backend(const std::string& name);
+
+    // Name of the backend in use
+    const char* backend_name();
+
+    // Names of the available backends
+    std::vector<std::string> backend_names();
+
+    // Cache the values returned by read_metric() and fty_shm_read_metric()
+    // in this process, for up to entries metrics, or stop caching if entries
+    // is 0 (the default). A cached value is only checked for changes, with
+    // an fstat() of the metric file, which stays open while the metric is
+    // cached, or with the write counter of the other backends. Past a
+    // quarter of RLIMIT_NOFILE open files, the other metric files are
+    // checked with a stat() of their path. Ttls are enforced as without the
+    // cache.
+    void set_read_cache(size_t entries);
+
+    // Reads answered from the read cache and reads that went to the storage
+    // while the cache was enabled
+    struct ReadCacheStats {
+        uint64_t hits;
+        uint64_t misses;
+    };
+    ReadCacheStats read_cache_stats();
+
+    // Make the writes of metrics compare the record they would write, ttl
+    // included, with the stored one first, and when they are the same, only
+    // refresh the time of the last write, which the ttl counts from. The
+    // metric file is then not written, so its watchers do not wake up. Off
+    // by default.
+    void set_write_suppression(bool enabled);
+
+    // Writes skipped and writes done while the write suppression was enabled
+    struct WriteSuppressionStats {
+        uint64_t suppressed;
+        uint64_t written;
+    };
+    WriteSuppressionStats write_suppression_stats();
+
     // Fill the passed vector with assets known to the storage. Note that for
     // optimization purposes, the result can also include assets with expired
-    // metrics. If there are no assets in the storage but the storage is
-    // accessible, returns an empty list.
+    // metrics: the assets come from the catalog below, which counts the
+    // metrics until fty_shm_cleanup() deletes them, so read_asset_metrics()
+    // can fail with ENOENT for an asset listed here. If there are no assets
+    // in the storage but the storage is accessible, returns an empty list.
     // Returns 0 on success. On error, returns -1 sets errno accordingly and leaves
     // the vector intact
-    //int find_assets(Assets& assets);
+    int find_assets(Assets& assets);
+
+    // Number of metrics by family, asset or metric type
+    typedef std::map<std::string, size_t> CatalogCounts;
+
+    // Catalog of the storage: its families, and the assets and metric types
+    // of a family, or of all families if it is "*", with their number of
+    // metrics, expired ones included. With the file backend, the catalog
+    // is only built again for the directories where metrics were created or
+    // deleted since the last call in this process; otherwise it costs an
+    // fstat() per directory.
+    // All return 0 on success. On error, they return -1, set errno
+    // accordingly and leave the passed map intact
+    int list_families(CatalogCounts& families);
+    int find_assets(const std::string& family, CatalogCounts& assets);
+    int list_types(const std::string& family, CatalogCounts& types);
 
     // Fill the passed map with metrics stored for this asset. Returns an error
     // only if there is no valid metric for this asset.
     // Returns 0 on success. On error, returns -1 and sets errno accordingly
     int read_asset_metrics(const std::string& asset, Metrics& metrics);
 
+    // Fill the passed map with the metrics of every asset of the set that
+    // has at least one valid metric, in a single pass over the storage.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly
+    int read_assets_metrics(const std::unordered_set<std::string>& assets, AssetsMetrics& result);
+
     int read_metrics(const std::string& familly, const std::string& asset, const std::string& type, shmMetrics& result);
+    int read_metrics(const Query& query, shmMetrics& result);
+
+    // Run read_metrics() for the query, discarding the result, and report the
+    // access path that was chosen together with its estimated and actual
+    // cost.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly
+    int explain(const Query& query, QueryPlan& plan);
+
+    // Fill the passed result with the metrics matching the query whose value
+    // is a number. Expired and non-numeric metrics are skipped.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly
+    int read_metrics_columnar(const Query& query, ColumnarResult& result);
+
+    // Frames of fty_proto metrics, as fty_proto_encode() makes them
+    typedef std::vector<std::string> Frames;
+
+    // Make write_metric(fty_proto_t*) also store the fty_proto_encode()
+    // frame of the metric, for read_metric_frames(). Processes that
+    // forward the metrics to the broker then send them as they were
+    // written, without parsing and encoding them again. The frame is kept
+    // after the text of the metric, where the readers of the text do not
+    // see it. The segment and packed backends store a metric without its
+    // frame if both do not fit their slot. Off by default.
+    void set_store_frames(bool enabled);
+
+    // Fill the passed vector with the frames of the metrics matching the
+    // query, in no particular order. Metrics stored with a frame return it
+    // as written, time included, the others are read like read_metrics()
+    // does and encoded. Expired metrics are skipped.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly
+    int read_metric_frames(const Query& query, Frames& frames);
+
+    // How a consistent read went: its validation rounds, the metrics read,
+    // those read again because they changed meanwhile, those compared with
+    // their file because it was written too recently for its timestamps to
+    // tell, and its duration
+    struct ConsistentReadStats {
+        ConsistentReadStats()
+            : rounds(0), reads(0), rereads(0), compares(0), elapsed_ns(0)
+        {
+        }
+        unsigned rounds;
+        size_t reads;
+        size_t rereads;
+        size_t compares;
+        uint64_t elapsed_ns;
+    };
+
+    // read_metrics() as of one instant: every metric is returned with the
+    // value it had when the read ended, and metrics deleted meanwhile are
+    // left out. Writers are not blocked; the read checks the timestamps, or
+    // the write counters, of all the metrics after reading them and reads
+    // the ones that changed again, until none did. The query is then run
+    // again, and the metrics created meanwhile are read and checked with the
+    // others. Metric files written too recently for their timestamps to tell
+    // are compared with what was read instead.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly,
+    // EAGAIN if the metrics kept changing, and leaves result intact
+    int read_metrics_consistent(const Query& query, shmMetrics& result, ConsistentReadStats* stats = NULL);
+
+    // Compute the count, sum, min, max and average of the numeric metrics
+    // matching the query in a single pass, without creating per-metric
+    // objects. Expired and non-numeric metrics are skipped.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly
+    int aggregate(const Query& query, Aggregate& result);
+
+    // Append to result the k metrics matching the query with the highest
+    // (SORT_DESCENDING) or lowest (SORT_ASCENDING) numeric values, best first.
+    // Only the winners are read as fty_proto messages; a winner that expires
+    // between the scan and its read is dropped.
+    // Returns 0 on success. On error, returns -1 and sets errno accordingly
+    int top_k(const Query& query, size_t k, SortOrder order, shmMetrics& result);
+
+    // A query executed repeatedly, e.g. on every poll. The names of the
+    // matching metrics are cached and only re-read when the family directory
+    // changes, i.e. when metrics are created or deleted, which costs one
+    // fstat() per family instead of a directory scan. The object keeps the
+    // family directories open.
+    // All methods return 0 on success. On error, they return -1 and set errno
+    // accordingly
+    class PreparedQuery
+    {
+        public :
+            PreparedQuery(const Query& query);
+            ~PreparedQuery();
+            int read_metrics(shmMetrics& result);
+            int read_metrics_columnar(ColumnarResult& result);
+            int aggregate(Aggregate& result);
+            // Run read_metrics() and report how it went
+            int explain(QueryPlan& plan);
+        private :
+            struct Impl;
+            std::unique_ptr<Impl> m_impl;
+    };
+
+    // Incremental version of read_metrics() for event loops. fd() stays
+    // readable as long as the scan is not finished, so the scanner can be
+    // registered in a zloop or zpoller; each readiness event then calls
+    // step() to examine at most budget directory entries and append the
+    // matching metrics to result.
+    // step() returns 1 if there is more work to do, 0 once the scan is
+    // finished (fd() is then no longer readable), and -1 with errno set on
+    // error
+    class Scanner
+    {
+        public :
+            Scanner(const Query& query);
+            ~Scanner();
+            int fd() const;
+            int step(size_t budget, shmMetrics& result);
+            bool done() const;
+        private :
+            struct Impl;
+            std::unique_ptr<Impl> m_impl;
+    };
+
+    // State of a WriteBehind: the writes waiting in its queue, the writes
+    // queued, written, coalesced with a later write of the same metric or
+    // failed since it was created, and the age of the oldest write of the
+    // last flush and of all flushes when they were written
+    struct WriteBehindStats {
+        size_t depth;
+        uint64_t queued;
+        uint64_t written;
+        uint64_t coalesced;
+        uint64_t failed;
+        uint64_t lag_ns;
+        uint64_t max_lag_ns;
+    };
+
+    // Writer for producers that must not wait for the storage. write_metric()
+    // only checks its arguments and queues the write without taking a lock;
+    // a thread of the writer writes the queue every max_delay_ms, keeping
+    // only the last write of every metric. flush() writes the queue in the
+    // calling thread, and so does the destructor once the thread stopped.
+    // write_metric() and flush() return 0 on success. On error, they return
+    // -1 and set errno accordingly; errors of the queued writes are only
+    // counted, flush() reports the last one
+    class WriteBehind
+    {
+        public :
+            WriteBehind(unsigned max_delay_ms = 100);
+            ~WriteBehind();
+            int write_metric(const std::string& asset, const std::string& metric, const std::string& value,
+                const std::string& unit, int ttl);
+            int flush();
+            WriteBehindStats stats() const;
+        private :
+            struct Impl;
+            std::unique_ptr<Impl> m_impl;
+    };
+
+    // A metric of a Snapshot. The strings point into the snapshot and stay
+    // valid until it is refreshed or destroyed. aux holds aux_count pairs of
+    // NUL-terminated keys and values, one after the other
+    struct SnapshotMetric {
+        const char* family;
+        const char* type;
+        const char* asset;
+        const char* value;
+        const char* unit;
+        const char* aux;
+        uint32_t aux_count;
+        int ttl;
+        int64_t time;
+    };
+
+    // Keeps every live metric of the storage in one file of the storage
+    // directory, for Snapshot readers, so that the programs that read the
+    // whole storage do not all scan it. publish() writes a new generation of
+    // the file, if anything changed, and replaces the previous one, which
+    // stays valid for the readers that still map it. With the file backend,
+    // the publisher watches the storage directory with inotify and only
+    // re-reads the metrics that changed; fd() is readable when there are
+    // changes, so the publisher can be registered in a zloop or zpoller.
+    // The other backends are scanned by every publish() and fd() is -1.
+    // publish() returns 0 on success. On error, it returns -1 and sets errno
+    // accordingly
+    class SnapshotPublisher
+    {
+        public :
+            SnapshotPublisher();
+            ~SnapshotPublisher();
+            int fd() const;
+            int publish();
+            // Generation of the last published snapshot
+            uint64_t generation() const;
+        private :
+            struct Impl;
+            std::unique_ptr<Impl> m_impl;
+    };
+
+    // Read-only mapping of the snapshot of a SnapshotPublisher. refresh()
+    // maps the latest generation, at the cost of an open() and an fstat()
+    // when there is none, and returns 1 if it mapped a new one, 0 if not.
+    // The metrics are then read without system calls. They are sorted by
+    // family, type and asset; at() also returns the metrics that expired
+    // since the snapshot was published, find() and read_metrics() skip them.
+    // refresh() and read_metrics() return -1 on error and set errno
+    // accordingly, ENOENT if nothing has been published yet
+    class Snapshot
+    {
+        public :
+            Snapshot();
+            ~Snapshot();
+            int refresh();
+            uint64_t generation() const;
+            size_t size() const;
+            SnapshotMetric at(size_t i) const;
+            bool find(const std::string& family, const std::string& asset, const std::string& type,
+                SnapshotMetric& metric) const;
+            // read_metrics() of the metrics in the snapshot
+            int read_metrics(const Query& query, shmMetrics& result) const;
+        private :
+            struct Impl;
+            std::unique_ptr<Impl> m_impl;
+    };
 }
 }
 
@@ -33,11 +33,13 @@
 #include <string.h>
 #include <sys/time.h>
 #include <map>
+#include <vector>
 
 #include <algorithm>
 #include <assert.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <limits.h>
 #include <linux/fs.h>
 #include <random>
@@ -56,6 +58,7 @@ static const char help_text[]
       "  -r, --write           only benchmark writes\n"
       "  -r, --read            only benchmark reads\n"
       "  -b, --benchmark=NAME  select benchmark to run (use -b help for a list)\n"
+      "  -B, --backend=NAME    select storage backend (use -B help for a list)\n"
       "  -h, --help            display this help text and exit\n";
 
 #define NUM_METRICS 10000
@@ -66,6 +69,9 @@ static const char help_text[]
 #define VALUE_LEN 10
 #define VALUE_FMT "v%08d"
 
+// Where the metrics are, to measure what they take
+static std::string storage_dir = "/run/fty-shm-1";
+
 class Benchmark {
     public:
         Benchmark() :
@@ -76,6 +82,12 @@ class Benchmark {
         typedef void(Benchmark::*benchmark_fn)();
         void c_api_bench();
         void cpp_api_bench();
+        void write_behind_bench();
+        void snapshot_bench();
+        void long_value_bench();
+        void footprint_bench();
+        void forward_bench();
+        void nut_bench();
         bool do_read, do_write;
     private:
         struct timeval tv_start, tv_last;
@@ -188,32 +200,242 @@ void Benchmark::cpp_api_bench()
     timestamp("re-reawSds");
 }
 
+void Benchmark::write_behind_bench()
+{
+    std::vector<std::string> names, values;
+    int i;
+
+    names.reserve(NUM_METRICS);
+    values.reserve(NUM_METRICS);
+    for (i = 0; i < NUM_METRICS; i++) {
+        char buf[METRIC_LEN];
+        sprintf(buf, METRIC_FMT, i);
+        names.push_back(buf);
+        sprintf(buf, VALUE_FMT, i);
+        values.push_back(buf);
+    }
+    timestamp("setup");
+    if (do_write) {
+        fty::shm::WriteBehind writer;
+        for (i = 0; i < NUM_METRICS; i++)
+            writer.write_metric("bench_asset", names[i], values[i], "unit", 300);
+        timestamp("queued");
+        writer.flush();
+        timestamp("flushed");
+        fty::shm::WriteBehindStats stats = writer.stats();
+        std::cout << "     lag: " << stats.max_lag_ns / 1000 << "us, " << stats.coalesced << " coalesced"
+                  << std::endl;
+    }
+}
+
+void Benchmark::snapshot_bench()
+{
+    char name[METRIC_LEN], value[VALUE_LEN];
+    fty::shm::shmMetrics swept, read;
+    fty::shm::SnapshotPublisher publisher;
+    fty::shm::Snapshot snapshot;
+    int i;
+
+    timestamp("setup");
+    if (do_write) {
+        for (i = 0; i < NUM_METRICS; i++) {
+            sprintf(name, METRIC_FMT, i);
+            sprintf(value, VALUE_FMT, i);
+            fty::shm::write_metric("bench_asset", name, value, "unit", 300);
+        }
+        timestamp("writes");
+    }
+    publisher.publish();
+    timestamp("publish");
+    if (do_read) {
+        fty::shm::read_metrics("*", ".*", ".*", swept);
+        timestamp("sweep");
+        snapshot.refresh();
+        snapshot.read_metrics(fty::shm::Query("*"), read);
+        timestamp("snapshot");
+    }
+}
+
+// Ten metrics per asset, like a small device
+#define NUM_FOOTPRINT_ASSETS 1000
+
+static size_t footprint_files, footprint_bytes;
+
+static int footprint_add(const char*, const struct stat* st, int flag, struct FTW*)
+{
+    if (flag == FTW_F) {
+        footprint_files++;
+        footprint_bytes += st->st_blocks * 512;
+    }
+    return 0;
+}
+
+void Benchmark::footprint_bench()
+{
+    char name[METRIC_LEN], value[VALUE_LEN];
+    std::vector<std::string> assets;
+    int i;
+
+    for (i = 0; i < NUM_FOOTPRINT_ASSETS; i++)
+        assets.push_back("bench_fp_" + std::to_string(i));
+    timestamp("setup");
+    if (do_write) {
+        for (i = 0; i < NUM_METRICS; i++) {
+            sprintf(name, METRIC_FMT, i / NUM_FOOTPRINT_ASSETS);
+            sprintf(value, VALUE_FMT, i);
+            fty::shm::write_metric(assets[i % NUM_FOOTPRINT_ASSETS], name, value, "unit", 300);
+        }
+        timestamp("writes");
+    }
+    if (do_read) {
+        fty::shm::Metrics metrics;
+        for (i = 0; i < NUM_FOOTPRINT_ASSETS; i++)
+            fty::shm::read_asset_metrics(assets[i], metrics);
+        timestamp("assets");
+    }
+    // Everything under the storage directory, other benchmarks included
+    footprint_files = footprint_bytes = 0;
+    nftw(storage_dir.c_str(), footprint_add, 16, FTW_PHYS);
+    std::cout << "   files: " << footprint_files << ", " << footprint_bytes / 1024 << " KiB" << std::endl;
+}
+
+void Benchmark::forward_bench()
+{
+    char name[METRIC_LEN], value[VALUE_LEN];
+    int i;
+
+    timestamp("setup");
+    if (do_write) {
+        fty::shm::set_store_frames(true);
+        for (i = 0; i < NUM_METRICS; i++) {
+            sprintf(name, METRIC_FMT, i);
+            sprintf(value, VALUE_FMT, i);
+            fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+            fty_proto_set_name(metric, "bench_forward");
+            fty_proto_set_type(metric, "%s", name);
+            fty_proto_set_value(metric, "%s", value);
+            fty_proto_set_unit(metric, "unit");
+            fty_proto_set_ttl(metric, 300);
+            fty::shm::write_metric(metric);
+            fty_proto_destroy(&metric);
+        }
+        fty::shm::set_store_frames(false);
+        timestamp("writes");
+    }
+    if (do_read) {
+        fty::shm::Query query("metric", "bench_forward");
+        fty::shm::shmMetrics metrics;
+        size_t encoded = 0, stored = 0;
+        // What a forwarder does without the frames
+        fty::shm::read_metrics(query, metrics);
+        for (i = 0; i < int(metrics.size()); i++) {
+            fty_proto_t* metric = metrics.getDup(i);
+            zmsg_t* msg = fty_proto_encode(&metric);
+            encoded += zmsg_content_size(msg);
+            zmsg_destroy(&msg);
+        }
+        timestamp("encoded");
+        fty::shm::Frames frames;
+        fty::shm::read_metric_frames(query, frames);
+        for (const std::string& frame : frames)
+            stored += frame.size();
+        timestamp("frames");
+        std::cout << "   bytes: " << encoded << " encoded, " << stored << " stored" << std::endl;
+    }
+}
+
+// NUM_METRICS variables in all, of which 11 per device are metrics
+#define NUM_NUT_DEVICES 100
+
+void Benchmark::nut_bench()
+{
+    static const char* metrics[] = { "battery.charge", "battery.runtime", "input.L1-N.voltage",
+        "input.L1.current", "input.frequency", "output.L1-N.voltage", "output.L1.current", "output.L1.realpower",
+        "ups.load", "ups.realpower", "ups.temperature" };
+    std::map<std::string, std::string> variables;
+    // Room for the format of any int, not only the ones below NUM_METRICS
+    char name[sizeof(METRIC_FMT) + 10], value[sizeof(VALUE_FMT) + 10];
+    int i;
+
+    for (const char* metric : metrics)
+        variables[metric] = "1";
+    for (i = 0; variables.size() < NUM_METRICS / NUM_NUT_DEVICES; i++) {
+        sprintf(name, METRIC_FMT, i);
+        sprintf(value, VALUE_FMT, i);
+        variables[std::string("device.") + name] = value;
+    }
+    timestamp("setup");
+    if (do_write) {
+        for (i = 0; i < NUM_NUT_DEVICES; i++)
+            fty::shm::write_nut_metrics("bench_nut_" + std::to_string(i), variables, 300);
+        timestamp("writes");
+    }
+}
+
 struct BenchmarkDesc {
     Benchmark::benchmark_fn func;
     const char* desc;
 };
 
+// Fewer metrics, the values are up to 256 KiB
+#define NUM_LONG_METRICS 1000
+
+void Benchmark::long_value_bench()
+{
+    std::vector<std::string> names;
+    int i;
+
+    for (i = 0; i < NUM_LONG_METRICS; i++) {
+        char buf[METRIC_LEN];
+        sprintf(buf, METRIC_FMT, i);
+        names.push_back(buf);
+    }
+    timestamp("setup");
+    for (size_t len : { 100, 1024, 16384, 262144 }) {
+        std::string value(len, 'v'), res_value, res_unit;
+        std::cout << "   value: " << len << " bytes" << std::endl;
+        if (do_write) {
+            for (i = 0; i < NUM_LONG_METRICS; i++)
+                fty::shm::write_metric("bench_long", names[i], value, "unit", 300);
+            timestamp("writes");
+        }
+        if (do_read) {
+            for (i = 0; i < NUM_LONG_METRICS; i++)
+                fty::shm::read_metric("bench_long", names[i], res_value, res_unit);
+            timestamp("reads");
+        }
+    }
+}
+
 std::map<std::string, BenchmarkDesc> benchmarks = {
     { "c", { &Benchmark::c_api_bench, "Benchmark fty_shm_{read,write}_metric" } },
-    { "cpp", { &Benchmark::cpp_api_bench, "Benchmark fty::shm::{read,write}_metric" } }
+    { "cpp", { &Benchmark::cpp_api_bench, "Benchmark fty::shm::{read,write}_metric" } },
+    { "behind", { &Benchmark::write_behind_bench, "Benchmark fty::shm::WriteBehind" } },
+    { "snapshot", { &Benchmark::snapshot_bench, "Benchmark fty::shm::Snapshot against read_metrics" } },
+    { "long", { &Benchmark::long_value_bench, "Benchmark values longer than the fixed record" } },
+    { "footprint", { &Benchmark::footprint_bench, "Measure the files and space taken by 1000 assets" } },
+    { "forward", { &Benchmark::forward_bench, "Benchmark read_metric_frames against read_metrics and encoding" } },
+    { "nut", { &Benchmark::nut_bench, "Benchmark fty::shm::write_nut_metrics" } }
 };
 
 int main(int argc, char **argv)
 {
-    Benchmark benchmark;
-    Benchmark::benchmark_fn func = &Benchmark::c_api_bench;
+    bool do_read = true, do_write = true;
+    std::vector<std::string> selected, backends = fty::shm::backend_names();
 
     static struct option long_opts[] = {
         { "help", no_argument, 0, 'h' },
         { "directory", required_argument, 0, 'd' },
         { "write", no_argument, 0, 'w' },
         { "read", no_argument, 0, 'r' },
-        { "benchmark", required_argument, 0, 'b' }
+        { "benchmark", required_argument, 0, 'b' },
+        { "backend", required_argument, 0, 'B' },
+        { 0, 0, 0, 0 }
     };
 
     int c = 0;
     while (c >= 0) {
-        c = getopt_long(argc, argv, "hd:rwb:", long_opts, 0);
+        c = getopt_long(argc, argv, "hd:rwb:B:", long_opts, 0);
 
         switch (c) {
         case 'h':
@@ -221,12 +443,13 @@ int main(int argc, char **argv)
             return 0;
         case 'd':
             fty_shm_set_test_dir(optarg);
+            storage_dir = optarg;
             break;
         case 'r':
-            benchmark.do_write = false;
+            do_write = false;
             break;
         case 'w':
-            benchmark.do_read = false;
+            do_read = false;
             break;
         case 'b':
             {
@@ -242,7 +465,23 @@ int main(int argc, char **argv)
                     std::cerr << "Use -b help for a list of possible benchmark names" << std::endl;
                     return 1;
                 }
-                func = it->second.func;
+                selected.push_back(it->first);
+                break;
+            }
+        case 'B':
+            {
+                if (strcmp(optarg, "help") == 0) {
+                    std::cout << "Valid options are: " << std::endl;
+                    for (const std::string& b : fty::shm::backend_names())
+                        std::cout << b << std::endl;
+                    return 0;
+                }
+                if (fty::shm::set_backend(optarg) < 0) {
+                    std::cerr << "Unknown backend: " << optarg << std::endl;
+                    std::cerr << "Use -B help for a list of possible backend names" << std::endl;
+                    return 1;
+                }
+                backends.assign(1, optarg);
                 break;
             }
         case '?':
@@ -254,8 +493,20 @@ int main(int argc, char **argv)
         }
     }
 
-    (benchmark.*func)();
+    // Every benchmark runs against every backend unless selected
+    if (selected.empty())
+        for (auto b : benchmarks)
+            selected.push_back(b.first);
+    for (const std::string& backend : backends) {
+        fty::shm::set_backend(backend);
+        for (const std::string& name : selected) {
+            Benchmark benchmark;
+            benchmark.do_read = do_read;
+            benchmark.do_write = do_write;
+            std::cout << name << " on " << backend << ":" << std::endl;
+            (benchmark.*benchmarks[name].func)();
+        }
+    }
 
     return 0;
 }
-
@@ -28,19 +28,39 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <condition_variable>
 #include <dirent.h>
 #include <fcntl.h>
+#include <functional>
 #include <limits.h>
+#include <math.h>
 #include <linux/fs.h>
+#include <poll.h>
 #include <random>
 #include <string.h>
-#include <sys/syscall.h>
+#include <linux/magic.h>
+#include <mutex>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <thread>
 #include <unistd.h>
 #include <unordered_set>
 #include <regex>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <iostream>
 #include <map>
+#include <set>
 
 #include "fty_shm.h"
 #include "internal.h"
@@ -50,24 +70,162 @@
 #define SEPARATOR '@'
 #define SEPARATOR_LEN 1
 
-// The first 11 bytes of each file are the ttl in 10 decimal digits, followed
-// by \n.  This is a compromise between machine and human readability
+// The ttl and unit lines of the records, the printf() form of the header
+// of Record below. The records of write_metric_data() have the ttl line
+// and an unpadded unit line
 #define TTL_FMT "%010d\n"
-#define TTL_LEN 11
-
-// The next 11 bytes specify the unit of the metric, right-padded with spaces
-// and followed by \n
 #define UNIT_FMT "%-10.10s\n"
-#define UNIT_LEN 11
 
-#define HEADER_LEN (TTL_LEN + UNIT_LEN)
-#define PAYLOAD_LEN (128 - HEADER_LEN)
+// Longer units, and the ones that look like references, are kept in the
+// UNITS_FILE of the storage directory, one per line, and the record holds a
+// reference "#<line number>" instead
+#define UNITS_FILE ".units"
+#define UNIT_REF '#'
+#define UNIT_MAX_LEN 255
+
+// Records end with the time of their write in nanoseconds since the epoch,
+// between two '\0' so that readers of the text do not see it. Its bytes
+// hold 7 bits each and have the high bit set, they are neither '\0' nor
+// '\n'. Without it, as in the records of older writers or of writers with
+// write suppression, the time of the write is the modification time
+#define STAMP_LEN 9
+#define STAMP_TAIL_LEN (STAMP_LEN + 2)
+
+// A longer value fills the payload with its beginning and follows the
+// record whole, between a LongTrailer and the version again. Readers of
+// the first record_len bytes see a truncated value
+#define VALUE_MAX_LEN (1024 * 1024)
+// "lng\0", the '\0' cannot appear in the text of write_metric_data()
+#define LONG_MAGIC 0x00676e6cu
+// A long value spans more than a single atomic read, readers retry this
+// many times while it is torn by a write
+#define LONG_READ_RETRIES 100
+// First read of a record of unknown length
+#define LONG_READ_LEN 4096
+// The ttl line of the head of a long value starts with this sign instead
+// of its first digit, which no other record has. Readers that parse the
+// ttl with strtol() still see it, with at most 9 digits
+#define LONG_SIGN '+'
+#define LONG_TTL_MAX 999999999
 
 // This is only changed by the selftest code
 static const char* shm_dir = DEFAULT_SHM_DIR;
 static size_t shm_dir_len = strlen(DEFAULT_SHM_DIR);
 
-static int prepare_filename(char* buf, const char* asset, size_t a_len, const char* metric, size_t m_len, const char* type)
+// A family can be sharded to keep its directories small. Its SHARDS_FILE
+// then holds the number of shards (the fanout) and each metric lives in the
+// subdirectory named after the hash of the metric name modulo the fanout,
+// as two hex digits. The fanout is followed by SHARDS_MIGRATING until the
+// metrics written to the flat layout by the processes that had not noticed
+// have been moved too
+#define SHARDS_FILE ".shards"
+#define SHARDS_MIGRATING " migrating"
+#define MAX_FANOUT 256
+#define SHARD_NAME_LEN 2
+
+// Layouts are cached for this long. The metrics of a family being sharded
+// are moved a last time once its layout has been published for twice as
+// long, until then readers pick the newer of the flat and shard copies
+#define LAYOUT_CACHE_NS 1000000000LL
+
+// FNV-1a, which must never change as it places the metrics in the shards
+// and in the slots of the segment backend
+static uint32_t fnv1a(const char* name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ static_cast<unsigned char>(name[i])) * 16777619u;
+    return hash;
+}
+
+static unsigned shard_of(const char* name, size_t len, unsigned fanout)
+{
+    return fnv1a(name, len) % fanout;
+}
+
+static void shard_name(unsigned shard, char* buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    buf[0] = hex[shard >> 4];
+    buf[1] = hex[shard & 0xf];
+    buf[2] = '\0';
+}
+
+// Read the fanout of the family directory, 0 if it is flat. Sets migrating,
+// if not NULL, if the metrics may still be in the flat layout, and
+// published to the time the layout was published
+static unsigned read_fanout(const std::string& family_dir, bool* migrating = NULL, struct timespec* published = NULL)
+{
+    char buf[32];
+    struct stat st;
+    ssize_t len;
+    int fd;
+
+    if (migrating)
+        *migrating = false;
+    if ((fd = open((family_dir + "/" SHARDS_FILE).c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    if (published && fstat(fd, &st) == 0)
+        *published = st.st_mtim;
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+    char* end;
+    unsigned long fanout = strtoul(buf, &end, 10);
+    if (migrating)
+        *migrating = !strncmp(end, SHARDS_MIGRATING, strlen(SHARDS_MIGRATING));
+    return fanout <= MAX_FANOUT ? fanout : 0;
+}
+
+struct FamilyLayout {
+    unsigned fanout;
+    bool migrating;
+    int64_t expires;
+};
+
+static std::mutex layouts_mutex;
+static std::unordered_map<std::string, FamilyLayout> layouts;
+
+// Return the fanout of the family directory, 0 if it is flat. Sets
+// migrating, if not NULL, as read_fanout()
+static unsigned family_fanout(const std::string& family_dir, bool* migrating = NULL)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    int64_t now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    std::lock_guard<std::mutex> lock(layouts_mutex);
+    FamilyLayout& layout = layouts[family_dir];
+    if (layout.expires <= now_ns) {
+        layout.fanout = read_fanout(family_dir, &layout.migrating);
+        layout.expires = now_ns + LAYOUT_CACHE_NS;
+    }
+    if (migrating)
+        *migrating = layout.migrating;
+    return layout.fanout;
+}
+
+// Whether the metric file a was written after b
+static bool newer_file(const struct stat& a, const struct stat& b)
+{
+    return a.st_mtime > b.st_mtime || (a.st_mtime == b.st_mtime && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+}
+
+// Whether the flat copy of a metric of a family being sharded is newer
+// than the copy in its shard, if any
+static bool newer_flat_copy(const char* shard_path, const char* flat_path)
+{
+    struct stat flat_st, shard_st;
+
+    if (stat(flat_path, &flat_st) < 0)
+        return false;
+    return stat(shard_path, &shard_st) < 0 || newer_file(flat_st, shard_st);
+}
+
+// Check that asset and metric make a valid metric name
+static int check_names(const char* asset, size_t a_len, const char* metric, size_t m_len)
 {
     if (m_len + SEPARATOR_LEN + a_len  > NAME_MAX) {
         errno = ENAMETOOLONG;
@@ -78,6 +236,19 @@ static int prepare_filename(char* buf, const char* asset, size_t a_len, const ch
         errno = EINVAL;
         return -1;
     }
+    return 0;
+}
+
+// Build the path of a metric of the family type. Unless flat is set,
+// returns 1 if the path goes through a shard, 2 if the family is still
+// being sharded and the flat path may hold a newer copy
+static int prepare_filename(char* buf, const char* asset, size_t a_len, const char* metric, size_t m_len, const char* type,
+        bool flat = false)
+{
+    int sharded = 0;
+
+    if (check_names(asset, a_len, metric, m_len) < 0)
+        return -1;
     char* p = buf;
     memcpy(p, shm_dir, shm_dir_len);
     p += shm_dir_len;
@@ -86,6 +257,13 @@ static int prepare_filename(char* buf, const char* asset, size_t a_len, const ch
     memcpy(p, type, strlen(type));
     p += strlen(type);
 
+    bool migrating = false;
+    unsigned fanout = flat ? 0 : family_fanout(std::string(buf, p - buf), &migrating);
+    char* shard = p;
+    if (fanout) {
+        p += 1 + SHARD_NAME_LEN;
+        sharded = migrating ? 2 : 1;
+    }
     *p++ = '/';
     memcpy(p, metric, m_len);
     p += m_len;
@@ -93,12 +271,18 @@ static int prepare_filename(char* buf, const char* asset, size_t a_len, const ch
     memcpy(p, asset, a_len);
     p += a_len;
     *p++ = '\0';
-    return 0;
+    if (fanout) {
+        const char* name = shard + 1 + SHARD_NAME_LEN + 1;
+        *shard = '/';
+        shard_name(shard_of(name, p - 1 - name, fanout), shard + 1);
+        shard[1 + SHARD_NAME_LEN] = '/';
+    }
+    return sharded;
 }
 
-static int prepare_filename(char* buf, const char* asset, size_t a_len, const char* metric, size_t m_len)
+static int prepare_filename(char* buf, const char* asset, size_t a_len, const char* metric, size_t m_len, bool flat = false)
 {
-  return prepare_filename(buf, asset, a_len, metric, m_len, "metric");
+  return prepare_filename(buf, asset, a_len, metric, m_len, "metric", flat);
 }
 
 // Assumes len is small enough for the read to be atomic (i.e. <= 4k)
@@ -112,533 +296,5993 @@ static ssize_t read_buf(int fd, char* buf, size_t len)
     return ret;
 }
 
-int fty_write_nut_metric(std::string asset, std::string metric, std::string value, int ttl) {
-  return fty::shm::write_nut_metric(asset, metric, value, ttl);
+// Size of the buffer for getdents64(), enough for about a thousand metrics
+#define DIR_BUF_SIZE 32768
+
+// Return the length of a directory entry name and set delim to its first
+// SEPARATOR, or NULL. Reads up to 15 bytes past the terminating '\0'
+static inline size_t scan_name(const char* name, const char*& delim)
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i sep = _mm_set1_epi8(SEPARATOR);
+
+    delim = NULL;
+    for (const char* p = name;; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned nul = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+        unsigned sep_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, sep));
+        if (nul)
+            // Ignore whatever follows the name
+            sep_mask &= (nul & -nul) - 1;
+        if (sep_mask && !delim)
+            delim = p + __builtin_ctz(sep_mask);
+        if (nul)
+            return p - name + __builtin_ctz(nul);
+    }
+#else
+    size_t len = strlen(name);
+    delim = static_cast<const char*>(memchr(name, SEPARATOR, len));
+    return len;
+#endif
 }
 
-int fty::shm::write_nut_metric(std::string asset, std::string metric, std::string value, int ttl) {
-  //TODO : convert nut metric name to fty metric name and select the right unit.
-  return write_metric(asset, metric, value, "NULL", ttl);
+// Layout of the records returned by getdents64()
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// A directory entry, pointing into the buffer of a DirReader
+struct DirEntry {
+    const char* name;
+    size_t len;
+    // First SEPARATOR of the name, or NULL
+    const char* delim;
+    unsigned char type;
+};
+
+// Reads directories with large getdents64() calls and hands out the entries
+// in place. Unlike readdir(), the name length and the separator are found
+// in a single pass over the name
+class DirReader {
+    public:
+        explicit DirReader(int fd)
+            : m_fd(fd), m_pos(0), m_len(0)
+        {
+            // The slack after the records is read by scan_name()
+            memset(m_buf, 0, sizeof(m_buf));
+        }
+        // Returns 1 and fills entry, 0 at the end of the directory, or -1 on
+        // error
+        int next(DirEntry& entry)
+        {
+            while (m_pos >= m_len) {
+                long ret = syscall(SYS_getdents64, m_fd, m_buf, DIR_BUF_SIZE);
+                if (ret <= 0)
+                    return ret < 0 ? -1 : 0;
+                m_len = ret;
+                m_pos = 0;
+            }
+            const linux_dirent64* de = reinterpret_cast<const linux_dirent64*>(m_buf + m_pos);
+            m_pos += de->d_reclen;
+            entry.name = de->d_name;
+            entry.len = scan_name(de->d_name, entry.delim);
+            entry.type = de->d_type;
+            return 1;
+        }
+        // Read the directory again from its beginning
+        int rewind()
+        {
+            m_pos = m_len = 0;
+            return lseek(m_fd, 0, SEEK_SET) < 0 ? -1 : 0;
+        }
+    private:
+        int m_fd;
+        size_t m_pos;
+        size_t m_len;
+        alignas(8) char m_buf[DIR_BUF_SIZE + 16];
+};
+
+// Entries that can hold a metric. Not every file system fills d_type
+static inline bool is_file(const DirEntry& entry)
+{
+    return entry.type == DT_REG || entry.type == DT_UNKNOWN;
 }
 
-// Write ttl and value to filename
-static int write_value(const char* filename, const char* value, const char* unit, int ttl)
+// Entries that can be a family directory
+static inline bool is_family(const DirEntry& entry)
 {
-    int fd;
-    char buf[HEADER_LEN + PAYLOAD_LEN];
-    size_t value_len;
-    int err = 0;
+    return (entry.type == DT_DIR || entry.type == DT_UNKNOWN) && entry.name[0] != '.';
+}
 
-    value_len = strlen(value);
-    if (value_len > PAYLOAD_LEN) {
-        errno = EINVAL;
-        return -1;
-    }
-    if ((fd = open(filename, O_CREAT | O_RDWR | O_CLOEXEC, 0666)) < 0)
-        return -1;
-    if (ttl < 0)
-        ttl = 0;
-    sprintf(buf, TTL_FMT, ttl);
-    sprintf(buf + TTL_LEN, UNIT_FMT, unit);
-    memcpy(buf + HEADER_LEN, value, value_len);
-    memset(buf + HEADER_LEN + value_len, 0, sizeof(buf) - HEADER_LEN - value_len);
-    if (pwrite(fd, buf, sizeof(buf), 0) < 0)
-        err = -1;
-    if (close(fd) < 0)
-        err = -1;
-    return err;
+// Metric type and unit of the NUT variables that are metrics. A few
+// variables share their type with a more precise one, such as the total
+// input voltage of a device with the voltage of its first phase, and are
+// only stored in its absence
+struct NutMapping {
+    const char* nut;
+    const char* type;
+    const char* unit;
+    // The variable that takes precedence, or NULL
+    const char* preferred;
+};
+
+static constexpr NutMapping nut_mappings[] = {
+    { "ambient.humidity", "humidity.default", "%", NULL },
+    { "ambient.temperature", "temperature.default", "C", NULL },
+    { "battery.charge", "charge.battery", "%", NULL },
+    { "battery.current", "current.battery", "A", NULL },
+    { "battery.runtime", "runtime.battery", "s", NULL },
+    { "battery.temperature", "temperature.battery", "C", NULL },
+    { "battery.voltage", "voltage.battery", "V", NULL },
+    { "input.current", "current.input.L1", "A", "input.L1.current" },
+    { "input.frequency", "frequency.input", "Hz", NULL },
+    { "input.load", "load.input.L1", "%", "input.L1.load" },
+    { "input.realpower", "realpower.input.L1", "W", "input.L1.realpower" },
+    { "input.voltage", "voltage.input.L1-N", "V", "input.L1-N.voltage" },
+    { "input.L1-N.voltage", "voltage.input.L1-N", "V", NULL },
+    { "input.L2-N.voltage", "voltage.input.L2-N", "V", NULL },
+    { "input.L3-N.voltage", "voltage.input.L3-N", "V", NULL },
+    { "input.L1-L2.voltage", "voltage.input.L1-L2", "V", NULL },
+    { "input.L2-L3.voltage", "voltage.input.L2-L3", "V", NULL },
+    { "input.L3-L1.voltage", "voltage.input.L3-L1", "V", NULL },
+    { "input.L1.current", "current.input.L1", "A", NULL },
+    { "input.L2.current", "current.input.L2", "A", NULL },
+    { "input.L3.current", "current.input.L3", "A", NULL },
+    { "input.L1.load", "load.input.L1", "%", NULL },
+    { "input.L2.load", "load.input.L2", "%", NULL },
+    { "input.L3.load", "load.input.L3", "%", NULL },
+    { "input.L1.realpower", "realpower.input.L1", "W", NULL },
+    { "input.L2.realpower", "realpower.input.L2", "W", NULL },
+    { "input.L3.realpower", "realpower.input.L3", "W", NULL },
+    { "output.current", "current.output.L1", "A", "output.L1.current" },
+    { "output.frequency", "frequency.output", "Hz", NULL },
+    { "output.realpower", "realpower.output.L1", "W", "output.L1.realpower" },
+    { "output.voltage", "voltage.output.L1-N", "V", "output.L1-N.voltage" },
+    { "output.L1-N.voltage", "voltage.output.L1-N", "V", NULL },
+    { "output.L2-N.voltage", "voltage.output.L2-N", "V", NULL },
+    { "output.L3-N.voltage", "voltage.output.L3-N", "V", NULL },
+    { "output.L1.current", "current.output.L1", "A", NULL },
+    { "output.L2.current", "current.output.L2", "A", NULL },
+    { "output.L3.current", "current.output.L3", "A", NULL },
+    { "output.L1.power", "power.output.L1", "VA", NULL },
+    { "output.L2.power", "power.output.L2", "VA", NULL },
+    { "output.L3.power", "power.output.L3", "VA", NULL },
+    { "output.L1.realpower", "realpower.output.L1", "W", NULL },
+    { "output.L2.realpower", "realpower.output.L2", "W", NULL },
+    { "output.L3.realpower", "realpower.output.L3", "W", NULL },
+    { "ups.load", "load.default", "%", NULL },
+    { "ups.power", "power.default", "VA", NULL },
+    { "ups.realpower", "realpower.default", "W", NULL },
+    { "ups.temperature", "temperature.internal", "C", NULL },
+};
+
+#define NUT_MAPPINGS (sizeof(nut_mappings) / sizeof(nut_mappings[0]))
+
+// The NUT variables are looked up in a perfect hash table, which the
+// compiler builds: the first seed of the hash under which the names fall
+// in distinct slots, and the index of the mapping of each slot, -1 if
+// empty. Few enough slots for a lookup to stay in a few cache lines, many
+// enough for a seed to be found after a few tries
+#define NUT_SLOTS 512
+
+// FNV-1a of the string s, from hash
+static constexpr uint32_t nut_hash(const char* s, uint32_t hash)
+{
+    return *s ? nut_hash(s + 1, (hash ^ uint8_t(*s)) * 16777619u) : hash;
 }
 
-static char* dup_str(char *str, char*)
+static constexpr uint32_t nut_slot(size_t i, uint32_t seed)
 {
-    return strdup(str);
+    return nut_hash(nut_mappings[i].nut, 2166136261u ^ seed) % NUT_SLOTS;
 }
 
-// When working with std::string, we do not want to call strdup
-static char* dup_str(char *str, std::string)
+// Whether the mappings from j on are in another slot than mapping i
+static constexpr bool nut_alone(size_t i, size_t j, uint32_t seed)
 {
-    return str;
+    return j == NUT_MAPPINGS || (nut_slot(i, seed) != nut_slot(j, seed) && nut_alone(i, j + 1, seed));
 }
 
-static int parse_ttl(char* ttl_str, time_t& ttl)
+// Whether the mappings from i on are in distinct slots
+static constexpr bool nut_distinct(size_t i, uint32_t seed)
 {
-    char *err;
-    int res;
+    return i == NUT_MAPPINGS || (nut_alone(i, i + 1, seed) && nut_distinct(i + 1, seed));
+}
 
-    // Delete the '\n'
-    int len = strlen(ttl_str) -1;
-    if(ttl_str[len] == '\n')
-      ttl_str[len] = '\0';
-    res = strtol(ttl_str, &err, 10);
-    if (err != ttl_str + TTL_LEN - 1) {
-        errno = ERANGE;
-        return -1;
-    }
-    ttl = res;
-    return 0;
+static constexpr uint32_t nut_find_seed(uint32_t seed)
+{
+    return nut_distinct(0, seed) ? seed : nut_find_seed(seed + 1);
 }
 
-// XXX: The error codes are somewhat arbitrary
-template <typename T>
-static int read_value(const char* filename, T& value, T& unit, bool need_unit = true)
+static constexpr uint32_t nut_seed = nut_find_seed(0);
+
+
+template <size_t... Is>
+struct IndexList {
+};
+
+template <class A, class B>
+struct JoinIndexLists;
+
+template <size_t... As, size_t... Bs>
+struct JoinIndexLists<IndexList<As...>, IndexList<Bs...>> {
+    typedef IndexList<As..., (sizeof...(As) + Bs)...> type;
+};
+
+// IndexList<0, ..., N - 1>, in log(N) steps
+template <size_t N>
+struct MakeIndexList
+    : JoinIndexLists<typename MakeIndexList<N / 2>::type, typename MakeIndexList<N - N / 2>::type> {
+};
+
+template <>
+struct MakeIndexList<0> {
+    typedef IndexList<> type;
+};
+
+template <>
+struct MakeIndexList<1> {
+    typedef IndexList<0> type;
+};
+
+// The slot of each mapping, hashed once
+struct NutMappingSlots {
+    uint16_t slot[NUT_MAPPINGS];
+};
+
+template <size_t... Is>
+static constexpr NutMappingSlots make_nut_mapping_slots(IndexList<Is...>)
 {
-    int fd;
-    struct stat st;
-    char buf[HEADER_LEN + PAYLOAD_LEN];
-    time_t now, ttl;
-    int ret = -1;
+    return NutMappingSlots { { uint16_t(nut_slot(Is, nut_seed))... } };
+}
 
-    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
-        return ret;
-    if (fstat(fd, &st) < 0)
-        goto out_fd;
-    if (read_buf(fd, buf, sizeof(buf)) < 0)
-        goto out_fd;
+static constexpr NutMappingSlots nut_mapping_slots = make_nut_mapping_slots(MakeIndexList<NUT_MAPPINGS>::type());
 
-    buf[TTL_LEN - 1] = '\0';
-    if (parse_ttl(buf, ttl) < 0)
-        goto out_fd;
-    if (ttl) {
-        now = time(NULL);
-        if (now - st.st_mtime > ttl) {
-            errno = ESTALE;
-            goto out_fd;
-        }
-    }
-    if (need_unit) {
-        char *unit_buf = buf + TTL_LEN;
-        // Trim the padding spaces
-        int i = UNIT_LEN - 1;
-        while (unit_buf[i] == ' ' || unit_buf[i] == '\n')
-            --i;
-        unit_buf[i + 1] = '\0';
-        unit = dup_str(unit_buf, T());
-    }
-    value = dup_str(buf + HEADER_LEN, T());
-    ret = 0;
+static constexpr int nut_entry(size_t slot, size_t i = 0)
+{
+    return i == NUT_MAPPINGS ? -1 : nut_mapping_slots.slot[i] == slot ? int(i) : nut_entry(slot, i + 1);
+}
 
-out_fd:
-    close(fd);
-    return ret;
+struct NutSlots {
+    int8_t entry[NUT_SLOTS];
+};
+
+template <size_t... Is>
+static constexpr NutSlots make_nut_slots(IndexList<Is...>)
+{
+    return NutSlots { { int8_t(nut_entry(Is))... } };
 }
 
-int read_data_metric(const char* filename, fty_proto_t *proto_metric) {
-  int ret = -1;
-  struct stat st;
-  FILE* file = NULL;
-  char buf[128];
-  char bufVal[128];
-  time_t now, ttl;
-  int len;
+static_assert(NUT_MAPPINGS < 128, "the slots hold the index of a mapping in an int8_t");
+static constexpr NutSlots nut_slots = make_nut_slots(MakeIndexList<NUT_SLOTS>::type());
 
-  file = fopen(filename, "r");
-  if(file == NULL)
-    goto shm_out_fd;
-  if(fstat(fileno(file), &st) < 0)
-    goto shm_out_fd;
+// The mapping of the NUT variable name, or NULL if it is no metric
+static const NutMapping* find_nut_mapping(const char* name)
+{
+    int entry = nut_slots.entry[nut_hash(name, 2166136261u ^ nut_seed) % NUT_SLOTS];
+    return entry >= 0 && !strcmp(nut_mappings[entry].nut, name) ? &nut_mappings[entry] : NULL;
+}
 
-  //get ttl
-  fgets(buf, sizeof(buf), file);
-  
-  if (parse_ttl(buf, ttl) < 0)
-    goto shm_out_fd;
+int fty_write_nut_metric(std::string asset, std::string metric, std::string value, int ttl) {
+  return fty::shm::write_nut_metric(asset, metric, value, ttl);
+}
 
-  //data still valid ?
-  if (ttl) {
-        now = time(NULL);
-        if (now - st.st_mtime > ttl) {
-            errno = ESTALE;
-            goto shm_out_fd;
+int fty_shm_write_nut_metric(const char* asset, const char* metric, const char* value, int ttl)
+{
+    return fty::shm::write_nut_metric(asset, metric, value, ttl);
+}
+
+int fty::shm::write_nut_metric(std::string asset, std::string metric, std::string value, int ttl)
+{
+    const NutMapping* mapping = find_nut_mapping(metric.c_str());
+
+    // Variables without a mapping keep their NUT name. A variable that gives
+    // way to another one is stored all the same, only write_nut_metrics()
+    // sees both
+    if (!mapping)
+        return write_metric(asset, metric, value, "", ttl);
+    return write_metric(asset, mapping->type, value, mapping->unit, ttl);
+}
+
+int fty::shm::write_nut_metrics(const std::string& asset, const std::map<std::string, std::string>& variables, int ttl)
+{
+    int ret = 0, err = 0;
+
+    for (const auto& variable : variables) {
+        const NutMapping* mapping = find_nut_mapping(variable.first.c_str());
+        if (!mapping || (mapping->preferred && variables.count(mapping->preferred)))
+            continue;
+        if (write_metric(asset, mapping->type, variable.second, mapping->unit, ttl) < 0) {
+            err = errno;
+            ret = -1;
         }
     }
+    if (ret < 0)
+        errno = err;
+    return ret;
+}
 
-  //set ttl
-  fty_proto_set_ttl(proto_metric,ttl);
-  //set timestamp
-  fty_proto_set_time(proto_metric, st.st_mtim.tv_sec);
+static int64_t now_ns()
+{
+    struct timespec ts;
 
-  //get unit
-  fgets(buf, sizeof(buf), file);
-  // Delete the '\n'
-  len = strlen(buf) -1;
-  if(buf[len] == '\n')
-    buf[len] = '\0';
-  fty_proto_set_unit(proto_metric, buf);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-  //get value
-  fgets(buf, sizeof(buf), file);
-  // Delete the '\n'
-  len = strlen(buf) -1;
-  if(buf[len] == '\n')
-    buf[len] = '\0';
+// Interned units, which are never freed so that their pointers stay valid
+static std::mutex units_mutex;
+static std::unordered_set<std::string> unit_pool;
+// The UNITS_FILE of units_dir, as far as read, and which file it was, as
+// it could be removed and created again
+static std::string units_dir;
+static dev_t units_dev;
+static ino_t units_ino;
+static std::vector<const char*> units_by_id;
+static std::unordered_map<std::string, unsigned> unit_ids;
+static size_t units_read;
 
-  fty_proto_set_value(proto_metric, buf);
+// Per thread cache of the interned units of records, so that readers do
+// not take units_mutex for the units they have seen. Indexed by the hash of
+// the unit
+#define UNIT_CACHE_SLOTS 16
 
-  while(fgets(buf, sizeof(buf), file) != NULL) {
-    if(fgets(bufVal, sizeof(bufVal), file) == NULL) {
-      break;
-    }
+struct UnitCacheSlot {
+    const char* unit;
+    size_t len;
+};
 
-    // Delete the '\n'
-    len = strlen(buf) -1;
-    if(buf[len] == '\n')
-      buf[len] = '\0';
+static thread_local UnitCacheSlot unit_cache[UNIT_CACHE_SLOTS];
 
-    len = strlen(bufVal) -1;
-    if(bufVal[len] == '\n')
-      bufVal[len] = '\0';
+static bool is_unit_ref(const char* unit, size_t len)
+{
+    if (len < 2 || unit[0] != UNIT_REF)
+        return false;
+    for (size_t i = 1; i < len; i++) {
+        if (unit[i] < '0' || unit[i] > '9')
+            return false;
+    }
+    return true;
+}
 
-    fty_proto_aux_insert(proto_metric, buf, "%s", bufVal);
-  }
-  fclose(file);
-  return 0;
+// Forget the references of the UNITS_FILE read so far, the interned units
+// stay
+static void forget_units_locked()
+{
+    units_by_id.clear();
+    unit_ids.clear();
+    units_read = 0;
+    units_dev = 0;
+    units_ino = 0;
+}
 
-shm_out_fd:
-    fclose(file);
-    return ret;
+// Read what was added to the UNITS_FILE of shm_dir since the last call,
+// from the start if it is another file
+static void load_units_locked()
+{
+    std::string path = std::string(shm_dir) + "/" UNITS_FILE;
+    char buf[4096];
+    struct stat st;
+    ssize_t len;
+    int fd;
+
+    if (units_dir != shm_dir) {
+        units_dir = shm_dir;
+        forget_units_locked();
+    }
+    if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno == ENOENT)
+            forget_units_locked();
+        return;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return;
+    }
+    if (st.st_dev != units_dev || st.st_ino != units_ino) {
+        forget_units_locked();
+        units_dev = st.st_dev;
+        units_ino = st.st_ino;
+    }
+    std::string data;
+    while ((len = pread(fd, buf, sizeof(buf), units_read + data.size())) > 0)
+        data.append(buf, len);
+    close(fd);
+    // Only whole lines, a writer could be appending
+    size_t start = 0, end;
+    while ((end = data.find('\n', start)) != std::string::npos) {
+        const char* unit = unit_pool.emplace(data, start, end - start).first->c_str();
+        unit_ids.emplace(unit, units_by_id.size());
+        units_by_id.push_back(unit);
+        start = end + 1;
+    }
+    units_read += start;
 }
 
-int fty_shm_write_metric(const char* asset, const char* metric, const char* value, const char* unit, int ttl)
+// Format the reference to unit in the UNITS_FILE into buf, adding it to the
+// file if needed
+static int unit_ref(const char* unit, char* buf)
 {
-    char filename[PATH_MAX];
+    std::lock_guard<std::mutex> lock(units_mutex);
+    int fd, err = 0;
 
-    if (prepare_filename(filename, asset, strlen(asset), metric, strlen(metric)) < 0)
+    if (strlen(unit) > UNIT_MAX_LEN || strchr(unit, '\n')) {
+        errno = EINVAL;
         return -1;
-    return write_value(filename, value, unit, ttl);
+    }
+    load_units_locked();
+    auto it = unit_ids.find(unit);
+    if (it == unit_ids.end()) {
+        // Under the lock of the file, other processes could be adding it
+        std::string path = std::string(shm_dir) + "/" UNITS_FILE, line = std::string(unit) + "\n";
+        if ((fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666)) < 0)
+            return -1;
+        if (flock(fd, LOCK_EX) < 0) {
+            close(fd);
+            return -1;
+        }
+        load_units_locked();
+        if (!unit_ids.count(unit) && write(fd, line.data(), line.size()) != ssize_t(line.size()))
+            err = -1;
+        close(fd);
+        if (err < 0)
+            return -1;
+        load_units_locked();
+        if ((it = unit_ids.find(unit)) == unit_ids.end()) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    sprintf(buf, "%c%u", UNIT_REF, it->second);
+    return 0;
 }
 
-int fty_shm_read_metric(const char* asset, const char* metric, char** value, char** unit)
+// The interned unit of the padded unit field of a record, len bytes long,
+// resolving references. Fails with EIO for a reference to an unknown unit
+static const char* resolve_unit(const char* field, size_t len)
 {
-    char filename[PATH_MAX];
+    while (len && (field[len - 1] == ' ' || field[len - 1] == '\n'))
+        --len;
+    if (!is_unit_ref(field, len)) {
+        UnitCacheSlot& cached = unit_cache[fnv1a(field, len) % UNIT_CACHE_SLOTS];
+        if (cached.unit && cached.len == len && !memcmp(cached.unit, field, len))
+            return cached.unit;
+        // Fits the small string buffer, the lookup does not allocate
+        std::string unit(field, len);
+        std::lock_guard<std::mutex> lock(units_mutex);
+        auto it = unit_pool.find(unit);
+        if (it == unit_pool.end())
+            it = unit_pool.insert(std::move(unit)).first;
+        cached.unit = it->c_str();
+        cached.len = len;
+        return cached.unit;
+    }
+    std::lock_guard<std::mutex> lock(units_mutex);
+    unsigned long id = strtoul(field + 1, NULL, 10);
+    struct stat st;
+    if (units_dir != shm_dir || id >= units_by_id.size() ||
+            stat((std::string(shm_dir) + "/" UNITS_FILE).c_str(), &st) < 0 || st.st_dev != units_dev ||
+            st.st_ino != units_ino)
+        load_units_locked();
+    if (id >= units_by_id.size()) {
+        errno = EIO;
+        return NULL;
+    }
+    return units_by_id[id];
+}
 
-    if (prepare_filename(filename, asset, strlen(asset), metric, strlen(metric)) < 0)
-        return -1;
-    if (!unit) {
-        char* dummy;
-        return read_value(filename, *value, dummy, false);
+// The tail of a record written at time_ns, which must not be 0
+static void format_stamp(char* tail, int64_t time_ns)
+{
+    tail[0] = '\0';
+    for (int i = 0; i < STAMP_LEN; i++)
+        tail[1 + i] = char(0x80 | ((time_ns >> (7 * (STAMP_LEN - 1 - i))) & 0x7f));
+    tail[STAMP_TAIL_LEN - 1] = '\0';
+}
+
+// The time of the write of the len bytes of a record in data, or 0 if it
+// does not end with one
+static int64_t record_time(const char* data, size_t len)
+{
+    int64_t time_ns = 0;
+
+    if (len < STAMP_TAIL_LEN || data[len - 1] || data[len - STAMP_TAIL_LEN])
+        return 0;
+    for (const char* p = data + len - 1 - STAMP_LEN; p < data + len - 1; p++) {
+        if (!(*p & 0x80))
+            return 0;
+        time_ns = (time_ns << 7) | (*p & 0x7f);
     }
-    return read_value(filename, *value, *unit);
+    return time_ns;
 }
 
-int fty_shm_delete_asset(const char* asset)
+static int64_t stat_time(const struct stat& st)
+{
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// Geometry and codec of the fixed size records of write_value(). The first
+// line is the ttl in 10 decimal digits, a compromise between machine and
+// human readability, the second the unit right-padded with spaces to
+// UnitWidth, the payload the value padded with '\0' up to RecordLen. A
+// value of up to inline_value_len bytes leaves room for the time of the
+// write at the end, a longer one fills the payload with its beginning
+template <size_t RecordLen, size_t UnitWidth>
+struct RecordLayout {
+    static constexpr size_t ttl_digits = 10;
+    static constexpr size_t ttl_len = ttl_digits + 1;
+    static constexpr size_t unit_offset = ttl_len;
+    static constexpr size_t unit_width = UnitWidth;
+    static constexpr size_t unit_len = UnitWidth + 1;
+    static constexpr size_t header_len = ttl_len + unit_len;
+    static constexpr size_t payload_len = RecordLen - header_len;
+    static constexpr size_t record_len = RecordLen;
+    static constexpr size_t stamp_offset = RecordLen - STAMP_TAIL_LEN;
+    // The longest value that fits in the record with the time
+    static constexpr size_t inline_value_len = payload_len - STAMP_TAIL_LEN;
+
+    // Records are packed in pages by the blob backends
+    static_assert(RecordLen <= 4096 && (RecordLen & (RecordLen - 1)) == 0,
+        "the record length must be a power of two of at most a page");
+    // "#<id>" of the first 100 long units
+    static_assert(UnitWidth >= 3, "the unit must hold a unit reference");
+    static_assert(RecordLen > header_len + STAMP_TAIL_LEN, "the payload must hold a value and the time");
+
+    // Write the header of a record with ttl and the unit, unit_len bytes
+    // long. Fails with EINVAL if the unit does not fit
+    static int encode_header(char* buf, int ttl, const char* unit, size_t unit_len)
+    {
+        if (unit_len > UnitWidth) {
+            errno = EINVAL;
+            return -1;
+        }
+        unsigned digits = ttl < 0 ? 0 : ttl;
+        for (size_t i = ttl_digits; i--; digits /= 10)
+            buf[i] = char('0' + digits % 10);
+        buf[ttl_digits] = '\n';
+        memcpy(buf + unit_offset, unit, unit_len);
+        memset(buf + unit_offset + unit_len, ' ', UnitWidth - unit_len);
+        buf[header_len - 1] = '\n';
+        return 0;
+    }
+
+    // Write the payload of a value of value_len bytes, written at time_ns
+    // unless 0. A value longer than inline_value_len gets no time and marks
+    // the header, written with a ttl of at most LONG_TTL_MAX, as the head of
+    // a long value
+    static void encode_payload(char* buf, const char* value, size_t value_len, int64_t time_ns)
+    {
+        char* payload = buf + header_len;
+
+        if (value_len > inline_value_len)
+            buf[0] = LONG_SIGN;
+        if (value_len >= payload_len) {
+            memcpy(payload, value, payload_len);
+            return;
+        }
+        memcpy(payload, value, value_len);
+        memset(payload + value_len, 0, payload_len - value_len);
+        if (time_ns && value_len <= inline_value_len)
+            format_stamp(buf + stamp_offset, time_ns);
+    }
+
+    // Whether the record in buf is the head of a long value
+    static bool long_head(const char* buf)
+    {
+        return buf[0] == LONG_SIGN;
+    }
+
+    // Parse the ttl of the record in buf. Fails with ERANGE unless it is 10
+    // digits, or the sign of a long value and 9 digits
+    static int decode_ttl(const char* buf, time_t& ttl)
+    {
+        time_t value = 0;
+
+        for (size_t i = long_head(buf); i < ttl_digits; i++) {
+            if (buf[i] < '0' || buf[i] > '9') {
+                errno = ERANGE;
+                return -1;
+            }
+            value = value * 10 + (buf[i] - '0');
+        }
+        ttl = value;
+        return 0;
+    }
+
+    static const char* unit_field(const char* buf)
+    {
+        return buf + unit_offset;
+    }
+
+    static const char* payload(const char* buf)
+    {
+        return buf + header_len;
+    }
+
+    // The time of the write of the record, or 0 if it does not say
+    static int64_t time(const char* buf)
+    {
+        return record_time(buf, RecordLen);
+    }
+};
+
+// ODR-used members, such as the arguments of std::min(), need a definition
+template <size_t R, size_t U> constexpr size_t RecordLayout<R, U>::ttl_len;
+template <size_t R, size_t U> constexpr size_t RecordLayout<R, U>::unit_len;
+template <size_t R, size_t U> constexpr size_t RecordLayout<R, U>::header_len;
+template <size_t R, size_t U> constexpr size_t RecordLayout<R, U>::payload_len;
+template <size_t R, size_t U> constexpr size_t RecordLayout<R, U>::record_len;
+template <size_t R, size_t U> constexpr size_t RecordLayout<R, U>::inline_value_len;
+
+// The records of the files and of the other backends, which every process
+// sharing the metrics has to agree on
+typedef RecordLayout<128, 10> Record;
+
+// Format the record of a value with its unit and ttl, written at time_ns
+// unless 0, into buf. A value longer than inline_value_len only fills the
+// payload, format_long_value() adds the rest
+static int format_value(char* buf, const char* value, const char* unit, int ttl, int64_t time_ns = 0)
+{
+    size_t value_len;
+
+    value_len = strlen(value);
+    if (value_len > VALUE_MAX_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ttl < 0)
+        ttl = 0;
+    // The first digit gives way to the sign of a long value
+    if (value_len > Record::inline_value_len && ttl > LONG_TTL_MAX)
+        ttl = LONG_TTL_MAX;
+    size_t unit_len = strlen(unit);
+    char ref[16];
+    if (unit_len > Record::unit_width || is_unit_ref(unit, unit_len)) {
+        if (unit_ref(unit, ref) < 0)
+            return -1;
+        unit = ref;
+        unit_len = strlen(ref);
+    }
+    if (Record::encode_header(buf, ttl, unit, unit_len) < 0)
+        return -1;
+    Record::encode_payload(buf, value, value_len, time_ns);
+    return 0;
+}
+
+// Follows the record of a long value. The version of the write, which is
+// the time of the write if not 0, is repeated after the value, a read with
+// different versions or a checksum that does not match the record and the
+// value is torn
+struct LongTrailer {
+    uint32_t magic;
+    uint32_t length;
+    uint64_t version;
+    uint64_t checksum;
+};
+
+static size_t long_record_len(size_t value_len)
+{
+    return Record::record_len + sizeof(LongTrailer) + value_len + sizeof(uint64_t);
+}
+
+// 64-bit FNV-1a, continuing from hash
+static uint64_t fnv1a64(const char* data, size_t len, uint64_t hash = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+    return hash;
+}
+
+// Build in record the long value record of value, with the record buf
+// formatted by format_value()
+static void format_long_value(const char* buf, const char* value, size_t value_len, uint64_t version,
+    std::string& record)
+{
+    LongTrailer trailer;
+
+    trailer.magic = LONG_MAGIC;
+    trailer.length = value_len;
+    trailer.version = version;
+    trailer.checksum = fnv1a64(value, value_len, fnv1a64(buf, Record::record_len));
+    record.reserve(long_record_len(value_len));
+    record.assign(buf, Record::record_len);
+    record.append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+    record.append(value, value_len);
+    record.append(reinterpret_cast<const char*>(&version), sizeof(version));
+}
+
+// Check the len bytes read from the start of a metric file. Returns 1 and
+// points value to the value if they hold a whole long value record, 0 if
+// they hold another record and -1 if the long value record is torn or cut
+// short. Then needed is the length to read, if more than len
+static int check_long_record(const char* buf, size_t len, const char*& value, size_t& value_len, size_t& needed,
+    int64_t* version_out = NULL)
+{
+    LongTrailer trailer;
+    uint64_t version;
+
+    needed = 0;
+    if (!len || !Record::long_head(buf))
+        return 0;
+    if (len < Record::record_len + sizeof(trailer)) {
+        needed = Record::record_len + sizeof(trailer);
+        return -1;
+    }
+    memcpy(&trailer, buf + Record::record_len, sizeof(trailer));
+    if (trailer.magic != LONG_MAGIC)
+        return -1;
+    if (trailer.length <= Record::inline_value_len || trailer.length > VALUE_MAX_LEN)
+        return -1;
+    if (len < long_record_len(trailer.length)) {
+        needed = long_record_len(trailer.length);
+        return -1;
+    }
+    value = buf + Record::record_len + sizeof(trailer);
+    value_len = trailer.length;
+    memcpy(&version, value + value_len, sizeof(version));
+    if (version != trailer.version || trailer.checksum != fnv1a64(value, value_len, fnv1a64(buf, Record::record_len)))
+        return -1;
+    if (version_out)
+        *version_out = version;
+    return 1;
+}
+
+// Read the record of fd, size bytes long as far as known, into record.
+// Returns check_long_record() of the first read that is not torn,
+// or fails with EAGAIN once the writes have torn every retry
+static int read_long_record(int fd, size_t size, std::string& record, const char*& value, size_t& value_len,
+    int64_t* version = NULL)
+{
+    size_t needed;
+
+    for (int retry = 0; retry < LONG_READ_RETRIES; retry++) {
+        // One more byte to tell a longer file
+        record.resize(size + 1);
+        ssize_t len = pread(fd, &record[0], size + 1, 0);
+        if (len < 0)
+            return -1;
+        record.resize(len);
+        int ret = check_long_record(record.data(), len, value, value_len, needed, version);
+        // Another record that is not whole yet
+        if (ret == 0 && size_t(len) > size && size < long_record_len(VALUE_MAX_LEN)) {
+            size = std::min(std::max<size_t>(size * 2, LONG_READ_LEN), long_record_len(VALUE_MAX_LEN));
+            continue;
+        }
+        if (ret >= 0)
+            return ret;
+        // Longer than known, else give the writer some time
+        if (needed > size)
+            size = needed;
+        else
+            sched_yield();
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+// Write suppression, and the writes it has skipped or let through
+static std::atomic<bool> write_suppression(false);
+static std::atomic<uint64_t> suppressed_writes(0);
+static std::atomic<uint64_t> unsuppressed_writes(0);
+
+// With set_store_frames(), the records of write_metric_data() also hold the
+// fty_proto_encode() frame of the metric, for forwarders to send as is. It
+// follows the text and a '\0', which ends the text for its readers, and is
+// followed by a FrameTrailer, then the time of the write
+static std::atomic<bool> store_frames(false);
+
+// "frm\0", the '\0' cannot appear in the text
+#define FRAME_MAGIC 0x006d7266u
+
+struct FrameTrailer {
+    uint32_t magic;
+    uint32_t length;
+};
+
+// Append the frame of metric and its trailer to out. Metrics encoded to
+// more than one frame are not stored
+static void append_frame(fty_proto_t* metric, std::string& out)
+{
+    fty_proto_t* copy = fty_proto_dup(metric);
+    zmsg_t* msg = fty_proto_encode(&copy);
+
+    if (!msg)
+        return;
+    if (zmsg_size(msg) == 1) {
+        zframe_t* frame = zmsg_first(msg);
+        FrameTrailer trailer = { FRAME_MAGIC, uint32_t(zframe_size(frame)) };
+        out.append(1, '\0');
+        out.append(reinterpret_cast<const char*>(zframe_data(frame)), zframe_size(frame));
+        out.append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+    }
+    zmsg_destroy(&msg);
+}
+
+// The frame of the record of write_metric_data() in data, len bytes long
+// without the time of the write. Returns false if it has none
+static bool find_frame(const char* data, size_t len, const char*& frame, size_t& frame_len)
+{
+    FrameTrailer trailer;
+
+    if (len < sizeof(trailer) + 2)
+        return false;
+    memcpy(&trailer, data + len - sizeof(trailer), sizeof(trailer));
+    len -= sizeof(trailer);
+    if (trailer.magic != FRAME_MAGIC || !trailer.length || trailer.length >= len ||
+            data[len - trailer.length - 1] != '\0')
+        return false;
+    frame = data + len - trailer.length;
+    frame_len = trailer.length;
+    return true;
+}
+
+static void count_write(bool suppressed)
+{
+    (suppressed ? suppressed_writes : unsuppressed_writes).fetch_add(1, std::memory_order_relaxed);
+}
+
+// With write suppression, if filename already holds the len bytes of data,
+// only refresh its timestamps, which its ttl counts from, and return 1. The
+// file is only opened for reading, watchers see no write. Returns 0 if the
+// file has to be written, errors included
+static int refresh_unchanged(const char* filename, const char* data, size_t len)
+{
+    static thread_local std::string buf;
+    ssize_t read_len;
+    int fd;
+
+    if (!write_suppression.load(std::memory_order_relaxed))
+        return 0;
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+        count_write(false);
+        return 0;
+    }
+    // One more byte to tell a longer file
+    buf.resize(len + 1);
+    read_len = pread(fd, &buf[0], len + 1, 0);
+    bool same = read_len == ssize_t(len) && !memcmp(buf.data(), data, len) && futimens(fd, NULL) == 0;
+    close(fd);
+    count_write(same);
+    return same;
+}
+
+// Write ttl and value to filename
+static int write_value(const char* filename, const char* value, const char* unit, int ttl)
+{
+    int fd;
+    char buf[Record::record_len];
+    std::string record;
+    const char* data = buf;
+    size_t len = sizeof(buf);
+    struct stat st;
+    int err = 0;
+
+    // Unchanged records must stay the same for write suppression
+    int64_t time_ns = write_suppression.load(std::memory_order_relaxed) ? 0 : now_ns();
+    if (format_value(buf, value, unit, ttl, time_ns) < 0)
+        return -1;
+    size_t value_len = strlen(value);
+    if (value_len > Record::inline_value_len) {
+        format_long_value(buf, value, value_len, time_ns, record);
+        data = record.data();
+        len = record.size();
+    }
+    if (refresh_unchanged(filename, data, len))
+        return 0;
+    if ((fd = open(filename, O_CREAT | O_RDWR | O_CLOEXEC, 0666)) < 0)
+        return -1;
+    if (pwrite(fd, data, len, 0) < 0)
+        err = -1;
+    // Drop what is left of a longer value, readers could take it for the
+    // rest of this one
+    else if (fstat(fd, &st) == 0 && st.st_size > off_t(len) && ftruncate(fd, len) < 0)
+        err = -1;
+    if (close(fd) < 0)
+        err = -1;
+    return err;
+}
+
+static int parse_ttl(char* ttl_str, time_t& ttl)
+{
+    char *err;
+    int res;
+
+    // Delete the '\n'
+    int len = strlen(ttl_str) -1;
+    if(ttl_str[len] == '\n')
+      ttl_str[len] = '\0';
+    res = strtol(ttl_str, &err, 10);
+    if (err != ttl_str + Record::ttl_len - 1) {
+        errno = ERANGE;
+        return -1;
+    }
+    ttl = res;
+    return 0;
+}
+
+// Directory timestamps are only updated once per clock tick, so a directory
+// modified less than this ago could still change without its timestamps
+// changing
+#define RACY_NS 20000000
+
+static bool timespec_eq(const struct timespec& a, const struct timespec& b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Modification and change time of a directory. Creating, renaming or
+// deleting entries updates both, rewriting a metric file updates neither.
+// For a metric file, every write updates the modification time
+struct DirStamp {
+    DirStamp()
+        : known(false)
+    {
+    }
+    // Record the current timestamps of the directory fd. Call this before
+    // reading the entries, so that a change during the read invalidates them
+    int update(int fd)
+    {
+        struct stat st;
+
+        known = false;
+        if (fstat(fd, &st) < 0)
+            return -1;
+        update(st);
+        return 0;
+    }
+    void update(const struct stat& st)
+    {
+        struct timespec now;
+
+        dev = st.st_dev;
+        ino = st.st_ino;
+        mtime = st.st_mtim;
+        ctime = st.st_ctim;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t age = (now.tv_sec - mtime.tv_sec) * 1000000000LL + now.tv_nsec - mtime.tv_nsec;
+        known = age >= RACY_NS;
+    }
+    // Return true if the directory or file fd is still the same
+    bool unchanged(int fd) const
+    {
+        struct stat st;
+
+        return known && fstat(fd, &st) == 0 && unchanged(st);
+    }
+    bool unchanged(const struct stat& st) const
+    {
+        return known && st.st_nlink && st.st_dev == dev && st.st_ino == ino &&
+            timespec_eq(st.st_mtim, mtime) && timespec_eq(st.st_ctim, ctime);
+    }
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    bool known;
+};
+
+// What the read cache or a consistent read has read a metric from, to tell
+// cheaply whether it has changed since
+struct ReadStamp {
+    ReadStamp()
+        : fd(-1), version(0), ttl(0), mtime(0), time_ns(0)
+    {
+    }
+    ~ReadStamp()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+    ReadStamp(const ReadStamp&) = delete;
+    ReadStamp& operator=(const ReadStamp&) = delete;
+    // The metric file, kept open by the read cache, and its timestamps
+    // (file backend)
+    int fd;
+    DirStamp file;
+    // Key and write counter of the metric (other backends), or the path of
+    // the metric file if it is not kept open
+    std::string key;
+    uint64_t version;
+    // Of the record read
+    time_t ttl;
+    time_t mtime;
+    int64_t time_ns;
+};
+
+// Split the record of write_value() in buf, last modified at mtime, into
+// value and unit, and the ttl if ttl_out is not NULL
+static int parse_value_record(char* buf, time_t mtime, std::string& value, std::string& unit, bool need_unit,
+        time_t* ttl_out = NULL)
+{
+    time_t now, ttl;
+
+    if (Record::decode_ttl(buf, ttl) < 0)
+        return -1;
+    if (ttl_out)
+        *ttl_out = ttl;
+    if (ttl) {
+        now = time(NULL);
+        if (now - mtime > ttl) {
+            errno = ESTALE;
+            return -1;
+        }
+    }
+    if (need_unit) {
+        const char* interned = resolve_unit(Record::unit_field(buf), Record::unit_len);
+        if (!interned)
+            return -1;
+        unit = interned;
+    }
+    value = Record::payload(buf);
+    return 0;
+}
+
+// XXX: The error codes are somewhat arbitrary
+// If stamp is not NULL, the file is left open in it
+static int read_value(int dfd, const char* filename, std::string& value, std::string& unit, bool need_unit = true,
+        ReadStamp* stamp = NULL, int64_t* time_ns = NULL)
+{
+    int fd;
+    struct stat st;
+    // The value can fill the whole payload
+    char buf[Record::header_len + Record::payload_len + 1];
+    std::string record;
+    const char* long_value;
+    size_t long_len;
+    int64_t written = 0;
+    int found = 0, ret = -1;
+
+    if ((fd = openat(dfd, filename, O_RDONLY | O_CLOEXEC)) < 0)
+        return ret;
+    // The read cache needs the timestamps of the file, others only the time
+    // of the write when the record does not say
+    if (stamp) {
+        if (fstat(fd, &st) < 0)
+            goto out_fd;
+        stamp->file.update(st);
+    }
+    if (read_buf(fd, buf, Record::header_len + Record::payload_len) < 0)
+        goto out_fd;
+    buf[Record::header_len + Record::payload_len] = '\0';
+    if (Record::long_head(buf)) {
+        found = read_long_record(fd, stamp ? st.st_size : LONG_READ_LEN, record, long_value, long_len, &written);
+        if (found < 0)
+            goto out_fd;
+        // The record of the same write as the value
+        if (found)
+            memcpy(buf, record.data(), Record::record_len);
+    } else {
+        written = record_time(buf, Record::record_len);
+    }
+    if (!written) {
+        if (!stamp && fstat(fd, &st) < 0)
+            goto out_fd;
+        written = stat_time(st);
+    }
+    if (stamp) {
+        stamp->mtime = written / 1000000000;
+        stamp->time_ns = written;
+    }
+    ret = parse_value_record(buf, written / 1000000000, value, unit, need_unit, stamp ? &stamp->ttl : NULL);
+    if (ret == 0 && found)
+        value.assign(long_value, long_len);
+    if (ret == 0 && time_ns)
+        *time_ns = written;
+
+out_fd:
+    if (stamp && ret == 0)
+        stamp->fd = fd;
+    else
+        close(fd);
+    return ret;
+}
+
+// Parsed view of the fixed part of a metric file. The unit and value
+// pointers point into buf
+struct RawRecord {
+    char buf[Record::header_len + Record::payload_len + 1];
+    time_t ttl;
+    time_t mtime;
+    const char* unit;
+    const char* value;
+    // End of the data read, the value ends at the first '\0' before it
+    const char* end;
+};
+
+// Read the metric file name relative to dfd and split it into ttl, unit and
+// value. Works for both the padded records of write_value() and the line
+// based records of write_metric_data(). Expired metrics fail with ESTALE,
+// long values, which do not fit and are no numbers anyway, with EINVAL
+static int read_record(int dfd, const char* name, RawRecord& rec)
+{
+    int fd;
+    struct stat st;
+    ssize_t len;
+
+    if ((fd = openat(dfd, name, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if ((len = read(fd, rec.buf, sizeof(rec.buf) - 1)) < 0) {
+        close(fd);
+        return -1;
+    }
+    rec.buf[len] = '\0';
+    int64_t written = record_time(rec.buf, len);
+    if (!written && fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    rec.mtime = written ? written / 1000000000 : st.st_mtime;
+
+    char* unit = strchr(rec.buf, '\n');
+    char* value = unit ? strchr(unit + 1, '\n') : NULL;
+    if (!value) {
+        // Malformed file
+        close(fd);
+        errno = EIO;
+        return -1;
+    }
+    // The head of a long value
+    if (Record::long_head(rec.buf)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    close(fd);
+    *unit++ = '\0';
+    *value = '\0';
+    // Trim the padding spaces
+    for (char* end = value; end > unit && end[-1] == ' '; --end)
+        end[-1] = '\0';
+    rec.ttl = strtol(rec.buf, NULL, 10);
+    if (rec.ttl && time(NULL) - rec.mtime > rec.ttl) {
+        errno = ESTALE;
+        return -1;
+    }
+    rec.unit = unit;
+    rec.value = value + 1;
+    rec.end = rec.buf + len;
+    return 0;
+}
+
+static const double pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Check eight ASCII characters loaded into a little-endian word at once
+static inline bool is_eight_digits(uint64_t val)
+{
+    return (((val & 0xF0F0F0F0F0F0F0F0) |
+                (((val + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) ==
+            0x3333333333333333);
+}
+
+// Convert eight ASCII digits with three multiplications instead of eight
+static inline uint64_t parse_eight_digits(uint64_t val)
+{
+    const uint64_t mask = 0x000000FF000000FF;
+    const uint64_t mul1 = 0x000F424000000064; // 100 + (1000000 << 32)
+    const uint64_t mul2 = 0x0000271000000001; // 1 + (10000 << 32)
+    val -= 0x3030303030303030;
+    val = (val * 10) + (val >> 8);
+    return (((val & mask) * mul1) + (((val >> 16) & mask) * mul2)) >> 32;
+}
+#endif
+
+// Accumulate the decimal digits at p into mantissa, at most 19 digits
+static const char* parse_digits(const char* p, const char* end, uint64_t& mantissa, int& digits)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t chunk;
+    while (end - p >= 8 && digits <= 19 - 8) {
+        memcpy(&chunk, p, sizeof(chunk));
+        if (!is_eight_digits(chunk))
+            break;
+        mantissa = mantissa * 100000000 + parse_eight_digits(chunk);
+        digits += 8;
+        p += 8;
+    }
+#endif
+    while (p < end && *p >= '0' && *p <= '9') {
+        mantissa = mantissa * 10 + (*p - '0');
+        ++digits;
+        ++p;
+        if (digits > 19)
+            break;
+    }
+    return p;
+}
+
+// Parse a numeric metric value. The number must span the whole value (the
+// line based format ends it with \n). Plain decimal numbers that fit into
+// a double exactly are converted without strtod(), everything else (long
+// mantissas, exponents, inf and nan) falls back to it
+static bool parse_value(const char* str, const char* end, double& value)
+{
+    const char* p = str;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool negative = false;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    const char* start = p;
+    p = parse_digits(p, end, mantissa, digits);
+    if (p < end && *p == '.') {
+        const char* fraction = ++p;
+        p = parse_digits(p, end, mantissa, digits);
+        exponent = fraction - p;
+    }
+    if (digits && digits <= 19 && mantissa <= (1ULL << 53) && exponent >= -22 &&
+            (p == end || *p == '\0' || *p == '\n')) {
+        value = exponent ? mantissa / pow10_table[-exponent] : mantissa;
+        if (negative)
+            value = -value;
+        return true;
+    }
+    // No digits at all can still be inf or nan, but nothing else
+    if (p == start && !(p < end && (*p == 'i' || *p == 'I' || *p == 'n' || *p == 'N')))
+        return false;
+
+    char* tail;
+    value = strtod(str, &tail);
+    return tail != str && (*tail == '\0' || *tail == '\n');
+}
+
+// Read the value of the metric name relative to dfd as a number. Fails for
+// expired and non-numeric metrics
+static int read_number(int dfd, const char* name, double& value, time_t& mtime)
+{
+    RawRecord rec;
+
+    if (read_record(dfd, name, rec) < 0)
+        return -1;
+    if (!parse_value(rec.value, rec.end, value)) {
+        errno = EINVAL;
+        return -1;
+    }
+    mtime = rec.mtime;
+    return 0;
+}
+
+// Parse the record of write_metric_data() in file, last modified at mtime,
+// into proto_metric. Closes file
+static int parse_data_metric(FILE* file, time_t mtime, fty_proto_t *proto_metric) {
+  int ret = -1;
+  char buf[128];
+  char bufVal[128];
+  time_t now, ttl;
+  int len;
+
+  //get ttl
+  fgets(buf, sizeof(buf), file);
+  
+  if (parse_ttl(buf, ttl) < 0)
+    goto shm_out_fd;
+
+  //data still valid ?
+  if (ttl) {
+        now = time(NULL);
+        if (now - mtime > ttl) {
+            errno = ESTALE;
+            goto shm_out_fd;
+        }
+    }
+
+  //set ttl
+  fty_proto_set_ttl(proto_metric,ttl);
+  //set timestamp
+  fty_proto_set_time(proto_metric, mtime);
+
+  //get unit
+  fgets(buf, sizeof(buf), file);
+  // Delete the '\n'
+  len = strlen(buf) -1;
+  if(buf[len] == '\n')
+    buf[len] = '\0';
+  if(buf[0] == UNIT_REF && strlen(buf) == Record::unit_len - 1) {
+    // Reference of write_value() to a long unit
+    const char* unit = resolve_unit(buf, Record::unit_len - 1);
+    if(!unit)
+      goto shm_out_fd;
+    fty_proto_set_unit(proto_metric, "%s", unit);
+  } else {
+    fty_proto_set_unit(proto_metric, buf);
+  }
+
+  //get value
+  fgets(buf, sizeof(buf), file);
+  // Delete the '\n'
+  len = strlen(buf) -1;
+  if(buf[len] == '\n')
+    buf[len] = '\0';
+
+  fty_proto_set_value(proto_metric, buf);
+
+  while(fgets(buf, sizeof(buf), file) != NULL) {
+    if(fgets(bufVal, sizeof(bufVal), file) == NULL) {
+      break;
+    }
+
+    // Delete the '\n'
+    len = strlen(buf) -1;
+    if(buf[len] == '\n')
+      buf[len] = '\0';
+
+    len = strlen(bufVal) -1;
+    if(bufVal[len] == '\n')
+      bufVal[len] = '\0';
+
+    fty_proto_aux_insert(proto_metric, buf, "%s", bufVal);
+  }
+  fclose(file);
+  return 0;
+
+shm_out_fd:
+    fclose(file);
+    return ret;
+}
+
+// Parse the long value record of value, last modified at mtime, with the
+// record in buf, into proto_metric like parse_data_metric()
+static int parse_long_metric(const char* buf, const char* value, size_t value_len, time_t mtime,
+    fty_proto_t* proto_metric)
+{
+    char ttl_str[Record::ttl_len];
+    time_t ttl;
+
+    memcpy(ttl_str, buf, Record::ttl_len - 1);
+    ttl_str[Record::ttl_len - 1] = '\0';
+    if (parse_ttl(ttl_str, ttl) < 0)
+        return -1;
+    if (ttl && time(NULL) - mtime > ttl) {
+        errno = ESTALE;
+        return -1;
+    }
+    fty_proto_set_ttl(proto_metric, ttl);
+    fty_proto_set_time(proto_metric, mtime);
+    if (buf[Record::ttl_len] == UNIT_REF) {
+        const char* unit = resolve_unit(buf + Record::ttl_len, Record::unit_len - 1);
+        if (!unit)
+            return -1;
+        fty_proto_set_unit(proto_metric, "%s", unit);
+    } else {
+        fty_proto_set_unit(proto_metric, "%.*s", int(Record::unit_len - 1), buf + Record::ttl_len);
+    }
+    fty_proto_set_value(proto_metric, "%.*s", int(value_len), value);
+    return 0;
+}
+
+int read_data_metric(int dfd, const char* name, fty_proto_t *proto_metric, DirStamp* stamp = NULL) {
+  struct stat st;
+  FILE* file = NULL;
+  std::string record;
+  const char* value;
+  size_t value_len;
+  int64_t written = 0;
+  int fd, found;
+
+  if((fd = openat(dfd, name, O_RDONLY | O_CLOEXEC)) < 0)
+    return -1;
+  if(stamp) {
+    if(fstat(fd, &st) < 0) {
+      close(fd);
+      return -1;
+    }
+    stamp->update(st);
+  }
+  // Read whole, a long value is no line based record
+  found = read_long_record(fd, stamp ? std::min<size_t>(st.st_size, long_record_len(VALUE_MAX_LEN)) : LONG_READ_LEN,
+    record, value, value_len, &written);
+  if(found < 0) {
+    close(fd);
+    return -1;
+  }
+  if(!found && (written = record_time(record.data(), record.size())))
+    record.resize(record.size() - STAMP_TAIL_LEN);
+  if(!written) {
+    if(!stamp && fstat(fd, &st) < 0) {
+      close(fd);
+      return -1;
+    }
+    written = stat_time(st);
+  }
+  close(fd);
+  if(found)
+    return parse_long_metric(record.data(), value, value_len, written / 1000000000, proto_metric);
+  // The text ends at the frame, if any
+  record.resize(strnlen(record.data(), record.size()));
+  if(record.empty()) {
+    errno = EIO;
+    return -1;
+  }
+  if(!(file = fmemopen(&record[0], record.size(), "r")))
+    return -1;
+  return parse_data_metric(file, written / 1000000000, proto_metric);
+}
+
+// Where the metrics are kept. The public functions go through the backend
+// selected with FTY_SHM_BACKEND or fty::shm::set_backend(). Metric names
+// are <type>@<asset> as in the file layout. Only the file backend has the
+// directory indexes, shards and aux indexes the queries can use, the other
+// backends are scanned with list()
+class StorageBackend {
+    public:
+        virtual ~StorageBackend() {}
+        virtual const char* name() const = 0;
+        // Store value and unit of the metric of asset in the metric family
+        virtual int write_value(const char* asset, const char* metric, const char* value, const char* unit,
+            int ttl) = 0;
+        // Read them back, the unit only if unit is not NULL and the time of
+        // the write, in nanoseconds since the epoch, only if time_ns is not
+        // NULL. Expired metrics fail with ESTALE
+        virtual int read_value(const char* asset, const char* metric, std::string& value, std::string* unit,
+            int64_t* time_ns) = 0;
+        // read_value() for the read cache, which also fills stamp
+        virtual int read_stamped(const char* asset, const char* metric, std::string& value, std::string& unit,
+            ReadStamp& stamp) = 0;
+        // True if the metric read with stamp has not been written since
+        virtual bool unchanged(ReadStamp& stamp) = 0;
+        // Store a whole fty_proto metric, aux attributes included
+        virtual int write_metric_data(fty_proto_t* metric) = 0;
+        // Read the metric name of family into proto_metric, except for its
+        // name and type, and fill stamp if not NULL
+        virtual int read_data_metric(const std::string& family, const char* name, fty_proto_t* proto_metric,
+            ReadStamp* stamp) = 0;
+        // Call fn(family, name) for every metric of family, or of every
+        // family if it is "*". The file backend reports the shard of a
+        // metric as its family
+        virtual int list(const std::string& family,
+            const std::function<void(const std::string&, const char*)>& fn) = 0;
+        // Delete the metric name of family, as reported by list()
+        virtual int remove(const std::string& family, const char* name) = 0;
+        // Delete the metrics that have expired long ago
+        virtual int cleanup() = 0;
+        // Read the values of all the metrics of asset in the metric family
+        // at once, for the backends that keep them together. The others
+        // fail with ENOTSUP
+        virtual int read_asset(const char* /* asset */, fty::shm::Metrics& /* metrics */)
+        {
+            errno = ENOTSUP;
+            return -1;
+        }
+        // Read the record of the metric name of family as stored, and the
+        // time of its write. Returns 1 for the record of a long value. The
+        // queries of the file backend read the directories themselves
+        virtual int read_raw(const std::string& /* family */, const char* /* name */, std::string& /* record */,
+            int64_t& /* time_ns */)
+        {
+            errno = ENOTSUP;
+            return -1;
+        }
+};
+
+static StorageBackend* storage();
+static bool files_backend();
+static int read_metric_cached(const char* asset, const char* metric, std::string& value, std::string* unit,
+    int64_t* time_ns = NULL);
+static void clear_read_cache();
+
+int fty_shm_write_metric(const char* asset, const char* metric, const char* value, const char* unit, int ttl)
+{
+    return storage()->write_value(asset, metric, value, unit, ttl);
+}
+
+// Forget the stamp of a read in a family being sharded, the metric may be
+// written to the other layout next, so that the read cache reads it again
+static void forget_stamp(ReadStamp* stamp)
+{
+    if (!stamp)
+        return;
+    if (stamp->fd >= 0)
+        close(stamp->fd);
+    stamp->fd = -1;
+    stamp->key.clear();
+}
+
+// read_value() of a metric. In a sharded family, a metric that has not
+// been moved to its shard yet is read from the flat layout, as is a newer
+// copy written there by a process that has not noticed the sharding yet
+static int read_metric_value(const char* asset, size_t a_len, const char* metric, size_t m_len, std::string& value,
+        std::string& unit, bool need_unit = true, ReadStamp* stamp = NULL, int64_t* time_ns = NULL)
+{
+    char filename[PATH_MAX], flat_name[PATH_MAX];
+    int sharded;
+
+    if ((sharded = prepare_filename(filename, asset, a_len, metric, m_len)) < 0)
+        return -1;
+    if (sharded == 2) {
+        prepare_filename(flat_name, asset, a_len, metric, m_len, true);
+        if (newer_flat_copy(filename, flat_name))
+            memcpy(filename, flat_name, strlen(flat_name) + 1);
+    }
+    if (read_value(AT_FDCWD, filename, value, unit, need_unit, stamp, time_ns) < 0) {
+        if (!sharded || errno != ENOENT)
+            return -1;
+        prepare_filename(filename, asset, a_len, metric, m_len, true);
+        if (read_value(AT_FDCWD, filename, value, unit, need_unit, stamp, time_ns) < 0)
+            return -1;
+    }
+    if (sharded == 2)
+        forget_stamp(stamp);
+    // For the read cache, in case the file is not kept open
+    else if (stamp)
+        stamp->key = filename;
+    return 0;
+}
+
+int fty_shm_read_metric(const char* asset, const char* metric, char** value, char** unit)
+{
+    std::string value_str, unit_str;
+
+    if (read_metric_cached(asset, metric, value_str, unit ? &unit_str : NULL) < 0)
+        return -1;
+    *value = strdup(value_str.c_str());
+    if (unit)
+        *unit = strdup(unit_str.c_str());
+    return 0;
+}
+
+int fty_shm_delete_asset(const char* asset)
+{
+    std::vector<std::pair<std::string, std::string>> found;
+    int err = 0;
+
+    // Collect the metrics first, the backends do not expect deletes while
+    // they list
+    if (storage()->list("*", [&](const std::string& family, const char* name) {
+            const char* delim = strchr(name, SEPARATOR);
+            if (delim && !strcmp(delim + 1, asset))
+                found.emplace_back(family, name);
+        }) < 0)
+        return -1;
+    for (const auto& metric : found) {
+        if (storage()->remove(metric.first, metric.second.c_str()) < 0 && errno != ENOENT)
+            err = -1;
+    }
+    clear_read_cache();
+    return err;
+}
+
+
+// A query pattern. Plain strings and prefixes, which are what most agents
+// ask for, are recognized so that they can be matched without std::regex
+// and looked up directly
+struct Pattern {
+    enum Kind {
+        ANY,     // ".*"
+        LITERAL, // no regex metacharacters, or only escaped ones
+        PREFIX,  // a literal followed by ".*"
+        REGEX
+    };
+    Kind kind;
+    // The unescaped literal or prefix
+    std::string text;
+    std::regex re;
+
+    int compile(const std::string& pattern);
+    bool match(const char* begin, const char* end) const
+    {
+        size_t len = end - begin;
+        switch (kind) {
+        case ANY:
+            return true;
+        case LITERAL:
+            return len == text.size() && memcmp(begin, text.data(), len) == 0;
+        case PREFIX:
+            return len >= text.size() && memcmp(begin, text.data(), text.size()) == 0;
+        default:
+            return std::regex_match(begin, end, re);
+        }
+    }
+};
+
+static const char* pattern_kind_names[] = { "any", "literal", "prefix", "regex" };
+
+int Pattern::compile(const std::string& pattern)
+{
+    static const char meta[] = ".[]{}()\\*+?^$|";
+
+    text.clear();
+    kind = LITERAL;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        char c = pattern[i];
+        if (c == '\\' && i + 1 < pattern.size() && strchr(meta, pattern[i + 1])) {
+            text += pattern[++i];
+            continue;
+        }
+        if (!strchr(meta, c))  {
+            text += c;
+            continue;
+        }
+        if (c == '.' && i + 2 == pattern.size() && pattern[i + 1] == '*') {
+            kind = text.empty() ? ANY : PREFIX;
+            break;
+        }
+        kind = REGEX;
+        break;
+    }
+    if (kind != REGEX)
+        return 0;
+    text.clear();
+    try {
+        re.assign(pattern);
+    } catch (const std::regex_error& e) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+// Inverted indexes of fty_proto aux attributes are kept in this directory of
+// a family, as empty files AUX_DIR/<key>/<value>/<type>@<asset>. The
+// directory of a key exists if the key is indexed
+#define AUX_DIR ".aux"
+
+// Escape an aux key or value for use as a file name: '/', '%' and a leading
+// '.' become %XX and the empty string becomes "%". Returns false if the
+// result is too long
+static bool escape_aux(const char* str, std::string& out)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    out.clear();
+    if (!*str)
+        out = "%";
+    for (const char* p = str; *p; p++) {
+        if (*p == '/' || *p == '%' || (*p == '.' && p == str)) {
+            out += '%';
+            out += hex[static_cast<unsigned char>(*p) >> 4];
+            out += hex[*p & 0xf];
+        } else {
+            out += *p;
+        }
+    }
+    return out.size() <= NAME_MAX;
+}
+
+typedef std::unordered_map<std::string, std::string> AuxMap;
+
+// Read the aux attributes of the metric file name relative to dfd. They
+// follow the value as key and value lines in the records of
+// write_metric_data(), the records of write_value() have none
+static int read_aux(int dfd, const char* name, AuxMap& aux)
+{
+    char buf[4096];
+    ssize_t len;
+    int fd;
+
+    if ((fd = openat(dfd, name, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    len = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (len < 0)
+        return -1;
+    // The text ends before the frame and the time of the write
+    const char* end = buf + strnlen(buf, len);
+    const char* p = buf;
+    // Skip the ttl, unit and value lines
+    for (int i = 0; i < 3 && p; i++) {
+        p = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (p)
+            p++;
+    }
+    while (p && p < end) {
+        const char* key_end = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!key_end)
+            break;
+        const char* value_end = static_cast<const char*>(memchr(key_end + 1, '\n', end - key_end - 1));
+        if (!value_end)
+            value_end = end;
+        aux[std::string(p, key_end)] = std::string(key_end + 1, value_end);
+        p = value_end + 1;
+    }
+    return 0;
+}
+
+// Where a query reads the metrics it has matched from: a directory of the
+// file storage, or a family of another backend
+struct Source {
+    Source(int dfd_)
+        : dfd(dfd_), family(NULL)
+    {
+    }
+    explicit Source(const std::string& family_)
+        : dfd(-1), family(&family_)
+    {
+    }
+    int dfd;
+    const std::string* family;
+};
+
+static int read_data_metric(const Source& src, const char* name, fty_proto_t* proto_metric)
+{
+    if (!src.family)
+        return read_data_metric(src.dfd, name, proto_metric);
+    return storage()->read_data_metric(*src.family, name, proto_metric, NULL);
+}
+
+// read_number() of a metric of any backend
+static int read_number(const Source& src, const char* name, double& value, time_t& mtime)
+{
+    if (!src.family)
+        return read_number(src.dfd, name, value, mtime);
+    fty_proto_t* proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+    int ret = read_data_metric(src, name, proto_metric);
+    if (ret == 0) {
+        const char* str = fty_proto_value(proto_metric);
+        if (parse_value(str, str + strlen(str), value)) {
+            mtime = fty_proto_time(proto_metric);
+        } else {
+            errno = EINVAL;
+            ret = -1;
+        }
+    }
+    fty_proto_destroy(&proto_metric);
+    return ret;
+}
+
+// Asset and type patterns and aux predicate of a query
+struct Matcher {
+    Pattern asset;
+    Pattern type;
+    bool has_aux;
+    std::string aux_key;
+    std::string aux_value;
+
+    int compile(const fty::shm::Query& query)
+    {
+        if (asset.compile(query.asset) < 0 || type.compile(query.type) < 0)
+            return -1;
+        has_aux = !query.aux_key.empty();
+        aux_key = query.aux_key;
+        aux_value = query.aux_value;
+        return 0;
+    }
+    // Return the length of the metric type if the directory entry is a
+    // metric whose asset and type match, or -1
+    ssize_t match(const DirEntry& entry) const
+    {
+        //If not a valid metric
+        if (!entry.delim || !is_file(entry))
+            return -1;
+        if (!type.match(entry.name, entry.delim) || !asset.match(entry.delim + SEPARATOR_LEN, entry.name + entry.len))
+            return -1;
+        return entry.delim - entry.name;
+    }
+    // Return true if the metric name of src satisfies the aux predicate.
+    // This has to read the metric, as the directory entry does not change
+    // when the attributes do
+    bool match_aux(const Source& src, const char* name) const
+    {
+        if (!has_aux)
+            return true;
+        if (src.family) {
+            fty_proto_t* proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+            const char* value = read_data_metric(src, name, proto_metric) == 0 ?
+                fty_proto_aux_string(proto_metric, aux_key.c_str(), NULL) : NULL;
+            bool match = value && aux_value == value;
+            fty_proto_destroy(&proto_metric);
+            return match;
+        }
+        AuxMap aux;
+        if (read_aux(src.dfd, name, aux) < 0)
+            return false;
+        auto it = aux.find(aux_key);
+        return it != aux.end() && it->second == aux_value;
+    }
+    // True if the query selects exactly one metric per family
+    bool literal() const
+    {
+        return asset.kind == Pattern::LITERAL && type.kind == Pattern::LITERAL;
+    }
+};
+
+// Read the metric name of src as fty_proto and append it to result, under
+// result_mutex if given
+static int add_metric(const Source& src, const char* name, size_t type_len, fty::shm::shmMetrics& result,
+        std::mutex* result_mutex = NULL)
+{
+    fty_proto_t *proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+    if (read_data_metric(src, name, proto_metric) < 0) {
+        fty_proto_destroy(&proto_metric);
+        return -1;
+    }
+    fty_proto_set_name(proto_metric, "%s", name + type_len + SEPARATOR_LEN);
+    fty_proto_set_type(proto_metric, "%.*s", static_cast<int>(type_len), name);
+    std::unique_lock<std::mutex> lock;
+    if (result_mutex)
+        lock = std::unique_lock<std::mutex>(*result_mutex);
+    result.add(proto_metric);
+    return 0;
+}
+
+// Read the metric name of src as a number and add it to result, under
+// result_mutex if given
+static int add_number(const Source& src, const char* name, size_t type_len, fty::shm::ColumnarResult& result,
+        std::mutex* result_mutex = NULL)
+{
+    double value;
+    time_t mtime;
+    if (read_number(src, name, value, mtime) < 0)
+        return -1;
+    std::unique_lock<std::mutex> lock;
+    if (result_mutex)
+        lock = std::unique_lock<std::mutex>(*result_mutex);
+    result.add(name + type_len + SEPARATOR_LEN, name, type_len, value, mtime);
+    return 0;
+}
+
+static int add_number(const Source& src, const char* name, size_t, fty::shm::Aggregate& result,
+        std::mutex* result_mutex = NULL)
+{
+    double value;
+    time_t mtime;
+    if (read_number(src, name, value, mtime) < 0)
+        return -1;
+    std::unique_lock<std::mutex> lock;
+    if (result_mutex)
+        lock = std::unique_lock<std::mutex>(*result_mutex);
+    result.add(value);
+    return 0;
+}
+
+// Estimate of the size of a family directory when nothing better is known
+#define DEFAULT_FAMILY_SIZE 1000
+
+// tmpfs accounts this many bytes of directory size per entry, including
+// "." and ".."
+#define TMPFS_DIRENT_SIZE 20
+
+// Number of entries of each family seen by the last scan in this process
+static std::mutex family_sizes_mutex;
+static std::unordered_map<std::string, size_t> family_sizes;
+
+// Estimate the number of entries of the family directory dfd. On tmpfs,
+// where the storage normally lives, the directory size tells it exactly.
+// Elsewhere, a directory not scanned yet is counted up to count_limit
+// entries if that is not 0
+static size_t estimate_entries(const std::string& family, int dfd, size_t count_limit = 0)
+{
+    struct statfs sfs;
+    struct stat st;
+
+    if (fstatfs(dfd, &sfs) == 0 && sfs.f_type == TMPFS_MAGIC && fstat(dfd, &st) == 0) {
+        size_t entries = st.st_size / TMPFS_DIRENT_SIZE;
+        return entries > 2 ? entries - 2 : 0;
+    }
+    {
+        std::lock_guard<std::mutex> lock(family_sizes_mutex);
+        auto it = family_sizes.find(family);
+        if (it != family_sizes.end())
+            return it->second;
+    }
+    if (!count_limit)
+        return DEFAULT_FAMILY_SIZE;
+    size_t entries = 0;
+    DirEntry de;
+    std::unique_ptr<DirReader> dir(new DirReader(dfd));
+    while (entries < count_limit && dir->next(de) > 0)
+        entries += de.name[0] != '.';
+    dir->rewind();
+    return entries;
+}
+
+// A metric name in a FamilyIndex
+struct IndexEntry {
+    uint32_t offset;
+    uint16_t type_len;
+    uint16_t len;
+};
+
+typedef std::pair<const IndexEntry*, const IndexEntry*> IndexRange;
+
+// Names of the metrics of one family directory, sorted once by type and
+// once by asset, so that queries for a literal or a prefix of either only
+// visit the matching range. Indexes are kept per process and rebuilt when
+// the directory changes, which only happens when metrics are created or
+// deleted. They also make the catalog of the assets and types
+struct FamilyIndex {
+    DirStamp stamp;
+    // The names, each followed by '\0', and slack for scan_name()
+    std::string pool;
+    std::vector<IndexEntry> by_type;
+    std::vector<IndexEntry> by_asset;
+    // Distinct assets and types, sorted, with their number of metrics
+    std::vector<std::pair<std::string, size_t>> assets;
+    std::vector<std::pair<std::string, size_t>> types;
+
+    int build(int dfd);
+    IndexRange range(const Matcher& matcher) const;
+    DirEntry entry(const IndexEntry& e) const
+    {
+        DirEntry de;
+        de.name = pool.data() + e.offset;
+        de.len = e.len;
+        de.delim = de.name + e.type_len;
+        de.type = DT_REG;
+        return de;
+    }
+};
+
+// Byte-wise comparison of two strings of known length
+static int compare_keys(const char* a, size_t a_len, const char* b, size_t b_len)
+{
+    int ret = memcmp(a, b, std::min(a_len, b_len));
+    if (ret)
+        return ret;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+int FamilyIndex::build(int dfd)
+{
+    DirEntry de;
+
+    if (stamp.update(dfd) < 0)
+        return -1;
+    pool.clear();
+    by_type.clear();
+    std::unique_ptr<DirReader> dir(new DirReader(dfd));
+    if (dir->rewind() < 0)
+        return -1;
+    while (dir->next(de) > 0) {
+        if (!de.delim || !is_file(de))
+            continue;
+        IndexEntry e = { static_cast<uint32_t>(pool.size()), static_cast<uint16_t>(de.delim - de.name),
+            static_cast<uint16_t>(de.len) };
+        pool.append(de.name, de.len + 1);
+        by_type.push_back(e);
+    }
+    pool.append(16, '\0');
+    const char* base = pool.data();
+    // Type, then asset
+    std::sort(by_type.begin(), by_type.end(), [base](const IndexEntry& a, const IndexEntry& b) {
+        int ret = compare_keys(base + a.offset, a.type_len, base + b.offset, b.type_len);
+        if (ret)
+            return ret < 0;
+        return strcmp(base + a.offset + a.type_len, base + b.offset + b.type_len) < 0;
+    });
+    by_asset = by_type;
+    // Asset, then type
+    std::stable_sort(by_asset.begin(), by_asset.end(), [base](const IndexEntry& a, const IndexEntry& b) {
+        return strcmp(base + a.offset + a.type_len, base + b.offset + b.type_len) < 0;
+    });
+    for (const IndexEntry& e : by_type) {
+        if (types.empty() || compare_keys(types.back().first.data(), types.back().first.size(), base + e.offset,
+                e.type_len))
+            types.emplace_back(std::string(base + e.offset, e.type_len), 0);
+        types.back().second++;
+    }
+    for (const IndexEntry& e : by_asset) {
+        const char* asset = base + e.offset + e.type_len + SEPARATOR_LEN;
+        if (assets.empty() || assets.back().first != asset)
+            assets.emplace_back(asset, 0);
+        assets.back().second++;
+    }
+    return 0;
+}
+
+// Return the range of order whose key, as extracted by key(), matches the
+// literal or prefix pattern
+template <typename K>
+static IndexRange find_range(const std::vector<IndexEntry>& order, const Pattern& pattern, K key)
+{
+    const char* text = pattern.text.data();
+    size_t text_len = pattern.text.size();
+    // <0 before the range, 0 in it, >0 after it
+    auto position = [&](const IndexEntry& e) {
+        const char* k;
+        size_t k_len;
+        key(e, k, k_len);
+        if (pattern.kind == Pattern::PREFIX && k_len > text_len)
+            k_len = text_len;
+        return compare_keys(k, k_len, text, text_len);
+    };
+    auto lo = std::partition_point(order.begin(), order.end(), [&](const IndexEntry& e) { return position(e) < 0; });
+    auto hi = std::partition_point(lo, order.end(), [&](const IndexEntry& e) { return position(e) == 0; });
+    return IndexRange(order.data() + (lo - order.begin()), order.data() + (hi - order.begin()));
+}
+
+// Return the shortest range of entries that can match. The whole index is
+// returned if neither pattern is a literal or a prefix
+IndexRange FamilyIndex::range(const Matcher& matcher) const
+{
+    const char* base = pool.data();
+    IndexRange best(by_type.data(), by_type.data() + by_type.size());
+
+    if (matcher.type.kind == Pattern::LITERAL || matcher.type.kind == Pattern::PREFIX) {
+        best = find_range(by_type, matcher.type, [base](const IndexEntry& e, const char*& k, size_t& k_len) {
+            k = base + e.offset;
+            k_len = e.type_len;
+        });
+    }
+    if (matcher.asset.kind == Pattern::LITERAL || matcher.asset.kind == Pattern::PREFIX) {
+        IndexRange r = find_range(by_asset, matcher.asset, [base](const IndexEntry& e, const char*& k, size_t& k_len) {
+            k = base + e.offset + e.type_len + SEPARATOR_LEN;
+            k_len = e.len - e.type_len - SEPARATOR_LEN;
+        });
+        if (r.second - r.first < best.second - best.first)
+            best = r;
+    }
+    return best;
+}
+
+// Indexes of the families queried by this process, by directory path
+static std::mutex family_indexes_mutex;
+static std::unordered_map<std::string, std::shared_ptr<const FamilyIndex>> family_indexes;
+
+// Return the index of the family directory dfd if it is up to date, or if
+// rebuild is set, a new one
+static std::shared_ptr<const FamilyIndex> get_family_index(const std::string& family, int dfd, bool rebuild)
+{
+    std::string path = std::string(shm_dir) + "/" + family;
+    std::shared_ptr<const FamilyIndex> index;
+    {
+        std::lock_guard<std::mutex> lock(family_indexes_mutex);
+        auto it = family_indexes.find(path);
+        if (it != family_indexes.end())
+            index = it->second;
+    }
+    if (index && index->stamp.unchanged(dfd))
+        return index;
+    if (!rebuild)
+        return std::shared_ptr<const FamilyIndex>();
+    std::shared_ptr<FamilyIndex> fresh = std::make_shared<FamilyIndex>();
+    if (fresh->build(dfd) < 0)
+        return std::shared_ptr<const FamilyIndex>();
+    std::lock_guard<std::mutex> lock(family_indexes_mutex);
+    family_indexes[path] = fresh;
+    return fresh;
+}
+
+// A directory of metrics: a family, or one shard of a sharded family
+struct MetricDir {
+    MetricDir(const std::string& path_, int dfd_, int shard_, unsigned fanout_)
+        : path(path_), dfd(dfd_), shard(shard_), fanout(fanout_), opened(dfd_ >= 0)
+    {
+    }
+    // Relative to the storage directory
+    std::string path;
+    int dfd;
+    // Shard number, or -1 for the family directory itself
+    int shard;
+    // Shards of the family
+    unsigned fanout;
+    // Shards are opened on first use
+    bool opened;
+};
+
+// Add the family directory and then its shards in order to dirs. Fails if
+// the family does not exist
+static int open_family(const std::string& family, std::vector<MetricDir>& dirs)
+{
+    std::string family_dir = std::string(shm_dir) + "/" + family;
+    char shard[SHARD_NAME_LEN + 1];
+    int dfd;
+
+    if ((dfd = open(family_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+    unsigned fanout = family_fanout(family_dir);
+    dirs.emplace_back(family, dfd, -1, fanout);
+    for (unsigned i = 0; i < fanout; i++) {
+        shard_name(i, shard);
+        dirs.emplace_back(family + "/" + shard, -1, i, fanout);
+    }
+    return 0;
+}
+
+// Return the fd of dirs[i], or -1 if it cannot be opened
+static int dir_fd(std::vector<MetricDir>& dirs, size_t i)
+{
+    MetricDir& dir = dirs[i];
+    if (!dir.opened) {
+        dir.opened = true;
+        dir.dfd = openat(dirs[i - 1 - dir.shard].dfd, dir.path.c_str() + dir.path.size() - SHARD_NAME_LEN,
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    return dir.dfd;
+}
+
+static void close_dirs(std::vector<MetricDir>& dirs)
+{
+    for (const MetricDir& dir : dirs)
+        if (dir.dfd >= 0)
+            close(dir.dfd);
+}
+
+// Open the directory of the aux value of the query in every family, or -1
+// where no metric has this value and for the shards, whose metrics are
+// indexed in their family. Fails if the key is not indexed in one of the
+// families
+static int open_aux_dirs(const Matcher& matcher, const std::vector<MetricDir>& dirs, std::vector<int>& aux_dirs)
+{
+    std::string key, value;
+
+    if (!escape_aux(matcher.aux_key.c_str(), key) || !escape_aux(matcher.aux_value.c_str(), value))
+        return -1;
+    key = AUX_DIR "/" + key;
+    for (const MetricDir& dir : dirs) {
+        if (dir.shard >= 0) {
+            aux_dirs.push_back(-1);
+            continue;
+        }
+        int key_fd = openat(dir.dfd, key.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (key_fd < 0)
+            break;
+        aux_dirs.push_back(openat(key_fd, value.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        close(key_fd);
+    }
+    if (aux_dirs.size() == dirs.size())
+        return 0;
+    for (int fd : aux_dirs)
+        if (fd >= 0)
+            close(fd);
+    aux_dirs.clear();
+    return -1;
+}
+
+// Return true if a point read of name has to look into dirs[i]. The
+// family directory of a sharded family is only looked into for metrics not
+// yet moved to their shard
+static bool point_candidate(const std::vector<MetricDir>& dirs, size_t i, const std::string& name)
+{
+    return dirs[i].shard < 0 || static_cast<unsigned>(dirs[i].shard) == shard_of(name.data(), name.size(), dirs[i].fanout);
+}
+
+// Choose how to run the query over the given family directories and
+// describe the choice in plan. Directly opening the only possible file
+// costs one lookup per directory it can be in, a scan costs one step per
+// directory entry, an index lookup costs the size of the matching range,
+// plus a scan if the index has to be rebuilt, and an aux index lookup
+// costs the number of metrics with the aux value. aux_dirs is NULL if the
+// aux predicate cannot be looked up
+static void plan_query(const Matcher& matcher, std::vector<MetricDir>& dirs, const std::vector<int>* aux_dirs,
+        fty::shm::QueryPlan& plan)
+{
+    size_t scan_cost = 0, index_cost = 0, aux_cost = 0, families = 0;
+    bool indexed = matcher.asset.kind == Pattern::LITERAL || matcher.asset.kind == Pattern::PREFIX ||
+        matcher.type.kind == Pattern::LITERAL || matcher.type.kind == Pattern::PREFIX;
+
+    for (const MetricDir& dir : dirs)
+        families += dir.shard < 0;
+    if (matcher.literal()) {
+        std::string name = matcher.type.text + SEPARATOR + matcher.asset.text;
+        plan.path = fty::shm::QueryPlan::POINT_READ;
+        plan.estimated_cost = 0;
+        for (size_t i = 0; i < dirs.size(); i++)
+            plan.estimated_cost += point_candidate(dirs, i, name);
+        plan.description = "point read of " + name;
+    } else {
+        for (size_t i = 0; i < dirs.size(); i++) {
+            int dfd = dir_fd(dirs, i);
+            if (dfd < 0)
+                continue;
+            // An up to date index knows the number of metrics
+            std::shared_ptr<const FamilyIndex> index = get_family_index(dirs[i].path, dfd, false);
+            size_t entries = index ? index->by_type.size() : estimate_entries(dirs[i].path, dfd);
+            scan_cost += entries;
+            if (!indexed)
+                continue;
+            // Rebuilding an index costs about as much as the scan it
+            // replaces and pays off on the next query
+            if (index) {
+                IndexRange r = index->range(matcher);
+                index_cost += r.second - r.first;
+            } else {
+                index_cost += entries;
+            }
+        }
+        if (aux_dirs) {
+            for (size_t i = 0; i < dirs.size(); i++) {
+                // The aux directories are small when they pay off, and
+                // counting them stops at the cost of the alternative
+                if ((*aux_dirs)[i] >= 0)
+                    aux_cost += estimate_entries(dirs[i].path + "/" AUX_DIR "/" + matcher.aux_key + "/" +
+                        matcher.aux_value, (*aux_dirs)[i], (indexed ? index_cost : scan_cost) + 1);
+            }
+        }
+        if (aux_dirs && (!indexed || aux_cost <= index_cost)) {
+            plan.path = fty::shm::QueryPlan::AUX_INDEX;
+            plan.estimated_cost = aux_cost;
+            plan.description = "aux index of " + matcher.aux_key + "=" + matcher.aux_value;
+        } else if (indexed) {
+            plan.path = fty::shm::QueryPlan::INDEX_RANGE;
+            plan.estimated_cost = index_cost;
+            plan.description = std::string("index range, asset: ") + pattern_kind_names[matcher.asset.kind] +
+                ", type: " + pattern_kind_names[matcher.type.kind];
+        } else {
+            plan.path = fty::shm::QueryPlan::SCAN;
+            plan.estimated_cost = scan_cost;
+            plan.description = std::string("scan, asset: ") + pattern_kind_names[matcher.asset.kind] +
+                ", type: " + pattern_kind_names[matcher.type.kind];
+        }
+    }
+    plan.description += " in " + std::to_string(families) + " famil" + (families == 1 ? "y" : "ies");
+    if (dirs.size() > families)
+        plan.description += " and " + std::to_string(dirs.size() - families) + " shards";
+}
+
+// Scans and index lookups of this many entries over several directories
+// are split between threads
+#define PARALLEL_SCAN_MIN 20000
+#define MAX_SCAN_THREADS 4
+
+// Open the family, or every family if it is "*", with their shards
+static int open_query_dirs(const std::string& family, std::vector<MetricDir>& dirs)
+{
+    DirEntry de;
+
+    if (family != "*")
+        return open_family(family, dirs);
+    int root_fd = open(shm_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0)
+        return -1;
+    std::unique_ptr<DirReader> root(new DirReader(root_fd));
+    while (root->next(de) > 0) {
+        if (is_family(de))
+            open_family(de.name, dirs);
+    }
+    close(root_fd);
+    return 0;
+}
+
+static int64_t elapsed_ns(const struct timespec& start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+}
+
+// run_query() on a backend other than files, which can only be scanned
+template <typename F>
+static int run_backend_query(const fty::shm::Query& query, const Matcher& matcher, fty::shm::QueryPlan& plan, F fn)
+{
+    struct timespec start;
+    DirEntry entry;
+    ssize_t type_len;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    plan.path = fty::shm::QueryPlan::SCAN;
+    int ret = storage()->list(query.family, [&](const std::string& family, const char* name) {
+        Source src(family);
+        entry.name = name;
+        entry.len = strlen(name);
+        entry.delim = strchr(name, SEPARATOR);
+        entry.type = DT_REG;
+        plan.actual_cost++;
+        if ((type_len = matcher.match(entry)) >= 0 && matcher.match_aux(src, name) &&
+                fn(family.c_str(), src, name, type_len) == 0)
+            plan.rows++;
+    });
+    plan.estimated_cost = plan.actual_cost;
+    plan.description = std::string("scan of the ") + storage()->name() + " backend";
+    plan.elapsed_ns = elapsed_ns(start);
+    return ret;
+}
+
+// Run the query: open the family (or every family if it is "*"), choose an
+// access path and call fn(dir, src, name, type_len) for every metric whose
+// asset and type match and that satisfies the aux predicate, where dir is
+// the family or the shard of the metric and src where to read it from. fn
+// returns 0 if it could read the metric. If parallel is set, fn can be
+// called from several threads at once. The chosen path and the work done
+// are reported in plan
+template <typename F>
+static int run_query(const fty::shm::Query& query, fty::shm::QueryPlan& plan, F fn, bool parallel = false)
+{
+    Matcher matcher;
+    std::vector<MetricDir> dirs;
+    std::vector<int> aux_dirs;
+    struct timespec start;
+    DirEntry de;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    plan.actual_cost = plan.rows = 0;
+    if (matcher.compile(query) < 0)
+        return -1;
+    if (!files_backend())
+        return run_backend_query(query, matcher, plan, fn);
+    if (open_query_dirs(query.family, dirs) < 0)
+        return -1;
+
+    bool aux_indexed = matcher.has_aux && open_aux_dirs(matcher, dirs, aux_dirs) == 0;
+    plan_query(matcher, dirs, aux_indexed ? &aux_dirs : NULL, plan);
+    auto visit = [&](size_t i, int dfd, const char* name, size_t type_len) {
+        return matcher.match_aux(dfd, name) && fn(dirs[i].path.c_str(), dfd, name, type_len) == 0;
+    };
+    if (plan.path == fty::shm::QueryPlan::POINT_READ) {
+        std::string name = matcher.type.text + SEPARATOR + matcher.asset.text;
+        for (size_t i = 0; i < dirs.size() && name.size() <= NAME_MAX; i++) {
+            if (!point_candidate(dirs, i, name) || dir_fd(dirs, i) < 0)
+                continue;
+            plan.actual_cost++;
+            plan.rows += visit(i, dirs[i].dfd, name.c_str(), matcher.type.text.size());
+        }
+    } else if (plan.path == fty::shm::QueryPlan::AUX_INDEX) {
+        // The index only lists candidates, entries of metrics that have been
+        // deleted or changed since are skipped
+        std::unique_ptr<DirReader> reader;
+        for (size_t i = 0; i < dirs.size(); i++) {
+            size_t entries = 0;
+            ssize_t type_len;
+            if (aux_dirs[i] < 0)
+                continue;
+            reader.reset(new DirReader(aux_dirs[i]));
+            while (reader->next(de) > 0) {
+                entries++;
+                if ((type_len = matcher.match(de)) < 0)
+                    continue;
+                size_t target = i;
+                if (dirs[i].fanout) {
+                    size_t shard = i + 1 + shard_of(de.name, de.len, dirs[i].fanout);
+                    int dfd = dir_fd(dirs, shard);
+                    if (dfd >= 0 && faccessat(dfd, de.name, F_OK, 0) == 0)
+                        target = shard;
+                }
+                plan.rows += visit(target, dirs[target].dfd, de.name, type_len);
+            }
+            plan.actual_cost += entries;
+            std::lock_guard<std::mutex> lock(family_sizes_mutex);
+            family_sizes[dirs[i].path + "/" AUX_DIR "/" + matcher.aux_key + "/" + matcher.aux_value] = entries;
+        }
+    } else {
+        // Scan or index lookup of dirs[i], adding to rows and cost
+        auto scan = [&](size_t i, size_t& rows, size_t& cost) {
+            int dfd = dir_fd(dirs, i);
+            ssize_t type_len;
+            DirEntry entry;
+            if (dfd < 0)
+                return;
+            if (plan.path == fty::shm::QueryPlan::INDEX_RANGE) {
+                std::shared_ptr<const FamilyIndex> index = get_family_index(dirs[i].path, dfd, true);
+                if (!index)
+                    return;
+                IndexRange r = index->range(matcher);
+                cost += r.second - r.first;
+                for (const IndexEntry* e = r.first; e != r.second; ++e) {
+                    entry = index->entry(*e);
+                    if ((type_len = matcher.match(entry)) >= 0)
+                        rows += visit(i, dfd, entry.name, type_len);
+                }
+                return;
+            }
+            size_t entries = 0;
+            std::unique_ptr<DirReader> reader(new DirReader(dfd));
+            while (reader->next(entry) > 0) {
+                entries++;
+                if ((type_len = matcher.match(entry)) >= 0)
+                    rows += visit(i, dfd, entry.name, type_len);
+            }
+            cost += entries;
+            std::lock_guard<std::mutex> lock(family_sizes_mutex);
+            family_sizes[dirs[i].path] = entries;
+        };
+        std::atomic<size_t> next(0), rows(0), cost(0);
+        auto worker = [&]() {
+            size_t worker_rows = 0, worker_cost = 0;
+            for (size_t i; (i = next++) < dirs.size();)
+                scan(i, worker_rows, worker_cost);
+            rows += worker_rows;
+            cost += worker_cost;
+        };
+        std::vector<std::thread> workers;
+        if (parallel && dirs.size() > 1 && plan.estimated_cost >= PARALLEL_SCAN_MIN) {
+            size_t threads = std::min<size_t>(std::min<size_t>(std::thread::hardware_concurrency(), MAX_SCAN_THREADS),
+                dirs.size());
+            try {
+                while (workers.size() + 1 < threads)
+                    workers.emplace_back(worker);
+            } catch (const std::system_error& e) {
+                // Do with the threads we have
+            }
+        }
+        worker();
+        for (std::thread& t : workers)
+            t.join();
+        plan.rows = rows;
+        plan.actual_cost = cost;
+    }
+    close_dirs(dirs);
+    for (int fd : aux_dirs)
+        if (fd >= 0)
+            close(fd);
+    plan.elapsed_ns = elapsed_ns(start);
+    return 0;
+}
+
+template <typename F>
+static int scan_query(const fty::shm::Query& query, F fn, bool parallel = false)
+{
+    fty::shm::QueryPlan plan;
+    return run_query(query, plan, fn, parallel);
+}
+
+int fty::shm::read_metrics(const std::string& family, const std::string& asset, const std::string& type, shmMetrics& result)
+{
+    return read_metrics(Query(family, asset, type), result);
+}
+
+int fty::shm::read_metrics(const Query& query, shmMetrics& result)
+{
+    std::mutex result_mutex;
+    return scan_query(query, [&](const char*, const Source& src, const char* name, size_t type_len) {
+        return add_metric(src, name, type_len, result, &result_mutex);
+    }, true);
+}
+
+int fty::shm::explain(const Query& query, QueryPlan& plan)
+{
+    shmMetrics result;
+    std::mutex result_mutex;
+    return run_query(query, plan, [&](const char*, const Source& src, const char* name, size_t type_len) {
+        return add_metric(src, name, type_len, result, &result_mutex);
+    }, true);
+}
+
+// Read the record of the metric name of src whole, without the time of the
+// write, and that time. Returns 1 for the record of a long value
+static int read_raw(const Source& src, const char* name, std::string& record, int64_t& written)
+{
+    const char* value;
+    size_t value_len;
+    struct stat st;
+    int fd, found;
+
+    if (src.family)
+        return storage()->read_raw(*src.family, name, record, written);
+    if ((fd = openat(src.dfd, name, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    written = 0;
+    found = read_long_record(fd, LONG_READ_LEN, record, value, value_len, &written);
+    if (found == 0 && (written = record_time(record.data(), record.size())))
+        record.resize(record.size() - STAMP_TAIL_LEN);
+    if (found >= 0 && !written) {
+        if (fstat(fd, &st) < 0)
+            found = -1;
+        else
+            written = stat_time(st);
+    }
+    close(fd);
+    return found;
+}
+
+// Append the stored frame of the metric name of src to frames, under
+// frames_mutex, or encode one if it has none
+static int add_frame(const Source& src, const char* name, size_t type_len, fty::shm::Frames& frames,
+        std::mutex& frames_mutex)
+{
+    std::string record;
+    int64_t written;
+    time_t ttl;
+    const char* frame;
+    size_t frame_len;
+
+    int found = read_raw(src, name, record, written);
+    if (found < 0)
+        return -1;
+    if (record.size() < Record::ttl_len || Record::decode_ttl(record.data(), ttl) < 0) {
+        errno = EIO;
+        return -1;
+    }
+    if (ttl && time(NULL) - written / 1000000000 > ttl) {
+        errno = ESTALE;
+        return -1;
+    }
+    if (!found && find_frame(record.data(), record.size(), frame, frame_len)) {
+        std::lock_guard<std::mutex> lock(frames_mutex);
+        frames.emplace_back(frame, frame_len);
+        return 0;
+    }
+    fty::shm::shmMetrics metrics;
+    if (add_metric(src, name, type_len, metrics) < 0)
+        return -1;
+    fty_proto_t* metric = metrics.getDup(0);
+    zmsg_t* msg = fty_proto_encode(&metric);
+    if (!msg)
+        return -1;
+    // fty_proto messages are a single frame
+    zframe_t* part = zmsg_first(msg);
+    std::lock_guard<std::mutex> lock(frames_mutex);
+    frames.emplace_back(reinterpret_cast<const char*>(zframe_data(part)), zframe_size(part));
+    zmsg_destroy(&msg);
+    return 0;
+}
+
+int fty::shm::read_metric_frames(const Query& query, Frames& frames)
+{
+    std::mutex frames_mutex;
+    frames.clear();
+    return scan_query(query, [&](const char*, const Source& src, const char* name, size_t type_len) {
+        return add_frame(src, name, type_len, frames, frames_mutex);
+    }, true);
+}
+
+void fty::shm::set_store_frames(bool enabled)
+{
+    store_frames.store(enabled, std::memory_order_relaxed);
+}
+
+int fty::shm::read_metrics_columnar(const Query& query, ColumnarResult& result)
+{
+    std::mutex result_mutex;
+    result.clear_rows();
+    return scan_query(query, [&](const char*, const Source& src, const char* name, size_t type_len) {
+        return add_number(src, name, type_len, result, &result_mutex);
+    }, true);
+}
+
+// Bound on the validation rounds of a consistent read
+#define CONSISTENT_ROUNDS 10
+
+// A metric of a consistent read, and what it was read from
+struct ConsistentMetric {
+    ConsistentMetric(const char* dir_, const char* name_, size_t type_len_)
+        : dir(dir_), name(name_), type_len(type_len_), proto(NULL)
+    {
+    }
+    ~ConsistentMetric()
+    {
+        fty_proto_destroy(&proto);
+    }
+    // Read the metric again, and drop it if it is gone
+    bool read()
+    {
+        fty_proto_destroy(&proto);
+        proto = fty_proto_new(FTY_PROTO_METRIC);
+        if (storage()->read_data_metric(dir, name.c_str(), proto, &stamp) < 0) {
+            fty_proto_destroy(&proto);
+            return false;
+        }
+        fty_proto_set_name(proto, "%s", name.c_str() + type_len + SEPARATOR_LEN);
+        fty_proto_set_type(proto, "%.*s", static_cast<int>(type_len), name.c_str());
+        return true;
+    }
+    // Whether the metric file, written too recently for its timestamps to
+    // tell, still holds what was read. A value written over and back since
+    // is not noticed
+    bool same_file()
+    {
+        ReadStamp current;
+        fty_proto_t* current_proto = fty_proto_new(FTY_PROTO_METRIC);
+        bool same = storage()->read_data_metric(dir, name.c_str(), current_proto, &current) == 0 &&
+            current.key == stamp.key && same_metric(proto, current_proto);
+        if (same)
+            stamp.file = current.file;
+        fty_proto_destroy(&current_proto);
+        return same;
+    }
+    static bool same_metric(fty_proto_t* a, fty_proto_t* b)
+    {
+        if (strcmp(fty_proto_value(a), fty_proto_value(b)) || strcmp(fty_proto_unit(a), fty_proto_unit(b)) ||
+                fty_proto_ttl(a) != fty_proto_ttl(b) || fty_proto_time(a) != fty_proto_time(b))
+            return false;
+        zhash_t* a_aux = fty_proto_aux(a);
+        zhash_t* b_aux = fty_proto_aux(b);
+        if (!a_aux || !b_aux)
+            return !a_aux == !b_aux;
+        if (zhash_size(a_aux) != zhash_size(b_aux))
+            return false;
+        for (char* value = (char*) zhash_first(a_aux); value; value = (char*) zhash_next(a_aux)) {
+            const char* b_value = (const char*) zhash_lookup(b_aux, zhash_cursor(a_aux));
+            if (!b_value || strcmp(value, b_value))
+                return false;
+        }
+        return true;
+    }
+    std::string dir;
+    std::string name;
+    size_t type_len;
+    fty_proto_t* proto;
+    ReadStamp stamp;
+};
+
+// Optimistic concurrency: read every metric with its stamp, then check
+// that none has changed since. If so, the values were all current when the
+// last one was read, and a new scan tells whether metrics were created
+// until then; otherwise read the ones that changed, or were created, and
+// check all of them again. Metric files written within RACY_NS are
+// compared with what was read instead
+int fty::shm::read_metrics_consistent(const Query& query, shmMetrics& result, ConsistentReadStats* stats)
+{
+    std::vector<std::unique_ptr<ConsistentMetric>> metrics;
+    std::vector<ConsistentMetric*> changed, created;
+    std::unordered_set<std::string> found;
+    ConsistentReadStats dummy;
+    struct timespec start;
+
+    if (!stats)
+        stats = &dummy;
+    *stats = ConsistentReadStats();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Add the metrics that are not in metrics yet to created
+    auto scan = [&]() {
+        return scan_query(query, [&](const char* dir, const Source&, const char* name, size_t type_len) {
+            if (found.insert(std::string(dir) + "/" + name).second) {
+                metrics.emplace_back(new ConsistentMetric(dir, name, type_len));
+                created.push_back(metrics.back().get());
+            }
+            return 0;
+        });
+    };
+    if (scan() < 0)
+        return -1;
+    for (stats->rounds = 1; ; stats->rounds++) {
+        for (ConsistentMetric* metric : changed)
+            metric->read();
+        for (ConsistentMetric* metric : created)
+            metric->read();
+        stats->rereads += changed.size();
+        stats->reads += created.size();
+        changed.clear();
+        created.clear();
+        for (const auto& metric : metrics) {
+            if (!metric->proto || storage()->unchanged(metric->stamp))
+                continue;
+            if (files_backend() && !metric->stamp.file.known) {
+                stats->compares++;
+                if (metric->same_file())
+                    continue;
+            }
+            changed.push_back(metric.get());
+        }
+        if (changed.empty()) {
+            if (scan() < 0)
+                return -1;
+            if (created.empty())
+                break;
+        }
+        if (stats->rounds == CONSISTENT_ROUNDS) {
+            stats->elapsed_ns = elapsed_ns(start);
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    for (const auto& metric : metrics) {
+        if (metric->proto) {
+            result.add(metric->proto);
+            metric->proto = NULL;
+        }
+    }
+    stats->elapsed_ns = elapsed_ns(start);
+    return 0;
+}
+
+int fty::shm::aggregate(const Query& query, Aggregate& result)
+{
+    std::mutex result_mutex;
+    result = Aggregate();
+    return scan_query(query, [&](const char*, const Source& src, const char* name, size_t type_len) {
+        return add_number(src, name, type_len, result, &result_mutex);
+    }, true);
+}
+
+int fty_shm_set_test_dir(const char* dir)
+{
+    if (strlen(dir) > PATH_MAX - strlen("/") - NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    shm_dir = dir;
+    shm_dir_len = strlen(dir);
+    clear_read_cache();
+    return 0;
+}
+
+// Remove the aux index entries of the metrics of the family dfd, which has
+// fanout shards, that no longer exist
+static void cleanup_aux_index(int dfd, unsigned fanout)
+{
+    DirEntry key, value, entry;
+    int aux_fd, key_fd, value_fd;
+    char path[SHARD_NAME_LEN + 1 + NAME_MAX + 1];
+
+    if ((aux_fd = openat(dfd, AUX_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return;
+    std::unique_ptr<DirReader> keys(new DirReader(aux_fd));
+    while (keys->next(key) > 0) {
+        if (key.name[0] == '.' || (key_fd = openat(aux_fd, key.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+            continue;
+        std::unique_ptr<DirReader> values(new DirReader(key_fd));
+        while (values->next(value) > 0) {
+            if (value.name[0] == '.' || (value_fd = openat(key_fd, value.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+                continue;
+            std::unique_ptr<DirReader> entries(new DirReader(value_fd));
+            while (entries->next(entry) > 0) {
+                if (!entry.delim || faccessat(dfd, entry.name, F_OK, 0) == 0 || errno != ENOENT)
+                    continue;
+                if (fanout) {
+                    shard_name(shard_of(entry.name, entry.len, fanout), path);
+                    path[SHARD_NAME_LEN] = '/';
+                    memcpy(path + SHARD_NAME_LEN + 1, entry.name, entry.len + 1);
+                    if (faccessat(dfd, path, F_OK, 0) == 0 || errno != ENOENT)
+                        continue;
+                }
+                unlinkat(value_fd, entry.name, 0);
+            }
+            close(value_fd);
+        }
+        close(key_fd);
+    }
+    close(aux_fd);
+}
+
+// renameat2() is unfortunately Linux-specific and glibc does not even
+// provide a wrapper
+static int rename_noreplace(int dfd, const char* src, const char* dst)
+{
+    return syscall(SYS_renameat2, dfd, src, dfd, dst, RENAME_NOREPLACE);
+}
+
+// Delete the metrics of the directory dfd that have expired long ago
+static int cleanup_dir(int dfd)
+{
+    DirEntry de;
+    int err = 0;
+
+    std::unique_ptr<DirReader> dir_child(new DirReader(dfd));
+    while (dir_child->next(de) > 0) {
+        int fd;
+        time_t now, ttl;
+        struct stat st1, st2;
+        char ttl_str[Record::ttl_len];
+
+        // Skip ".", ".." and our own ".delete"
+        if (!is_file(de) || de.name[0] == '.')
+            continue;
+        if ((fd = openat(dfd, de.name, O_RDONLY | O_CLOEXEC)) < 0) {
+            err = -1;
+            continue;
+        }
+        if (fstat(fd, &st1) < 0) {
+            err = -1;
+            close(fd);
+            continue;
+        }
+        if (st1.st_size < off_t(Record::header_len)) {
+            // Malformed file
+            close(fd);
+            continue;
+        }
+        if (read_buf(fd, ttl_str, Record::ttl_len) < 0) {
+            err = -1;
+            close(fd);
+            continue;
+        }
+        close(fd);
+        if (parse_ttl(ttl_str, ttl) < 0) {
+            err = -1;
+            continue;
+        }
+        if (!ttl)
+            continue;
+        now = time(NULL);
+        // We wait for two times the ttl value before deleting the entry
+        if ((now - st1.st_mtime) / 2 <= ttl)
+            continue;
+        // We can race here, but that is not considered a problem. A
+        // metric not updated for twice the ttl time is already a bug
+        // and the effect of the race is following:
+        // 1. Metric expires
+        // 2. We check that another ttl seconds have passed
+        // 3. Metric gets updated
+        // 4. We erroneously delete the updated metric
+        // 5. We restore the updated metric
+        // i.e. the updated metric disappears briefly between 4. and 5.,
+        // while it had been gone for ttl seconds between 1. and 3.
+        if (renameat(dfd, de.name, dfd, ".delete") < 0) {
+            err = -1;
+            continue;
+        }
+        if (fstatat(dfd, ".delete", &st2, 0) < 0) {
+            // This should not happen
+            err = -1;
+            continue;
+        }
+        if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
+            if (unlinkat(dfd, ".delete", 0) < 0)
+                err = -1;
+            continue;
+        }
+        // We lost the race. Restore the metric, but only if it has not
+        // been updated for the second time.
+        if (rename_noreplace(dfd, ".delete", de.name) < 0) {
+            unlinkat(dfd, ".delete", 0);
+            err = -1;
+        }
+    }
+    return err;
+}
+
+static int finish_sharding(int dfd, const std::string& family_dir);
+
+// fty_shm_cleanup() of the file backend
+static int cleanup_files()
+{
+    int dfd_root, dfd, shard_fd;
+    DirEntry de_root;
+    char shard[SHARD_NAME_LEN + 1];
+    int err = 0;
+
+    if ((dfd_root = open(shm_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+    std::unique_ptr<DirReader> dir(new DirReader(dfd_root));
+
+    while (dir->next(de_root) > 0) {
+      if (!is_family(de_root))
+        continue;
+      if ((dfd = openat(dfd_root, de_root.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        continue;
+      if (cleanup_dir(dfd) < 0)
+          err = -1;
+      std::string family_dir = std::string(shm_dir) + "/" + de_root.name;
+      if (finish_sharding(dfd, family_dir) < 0)
+          err = -1;
+      unsigned fanout = read_fanout(family_dir);
+      for (unsigned i = 0; i < fanout; i++) {
+          shard_name(i, shard);
+          if ((shard_fd = openat(dfd, shard, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+              continue;
+          if (cleanup_dir(shard_fd) < 0)
+              err = -1;
+          close(shard_fd);
+      }
+      cleanup_aux_index(dfd, fanout);
+      close(dfd);
+    }
+    close(dfd_root);
+    return err;
+}
+
+// Move the metrics of the family directory dfd to their shard. A metric
+// already in its shard is only replaced by a newer one
+static int move_to_shards(int dfd, unsigned fanout)
+{
+    char path[SHARD_NAME_LEN + 1 + NAME_MAX + 1];
+    struct stat flat_st, shard_st;
+    DirEntry de;
+    int err = 0;
+
+    std::unique_ptr<DirReader> dir(new DirReader(dfd));
+    if (dir->rewind() < 0)
+        return -1;
+    while (dir->next(de) > 0) {
+        if (!de.delim || !is_file(de) || de.name[0] == '.')
+            continue;
+        shard_name(shard_of(de.name, de.len, fanout), path);
+        path[SHARD_NAME_LEN] = '/';
+        memcpy(path + SHARD_NAME_LEN + 1, de.name, de.len + 1);
+        if (rename_noreplace(dfd, de.name, path) == 0)
+            continue;
+        if (errno != EEXIST || fstatat(dfd, de.name, &flat_st, 0) < 0 || fstatat(dfd, path, &shard_st, 0) < 0) {
+            err = -1;
+            continue;
+        }
+        if (newer_file(flat_st, shard_st)) {
+            if (renameat(dfd, de.name, dfd, path) < 0)
+                err = -1;
+        } else if (unlinkat(dfd, de.name, 0) < 0) {
+            err = -1;
+        }
+    }
+    return err;
+}
+
+// Publish the layout of the family directory dfd atomically
+static int publish_layout(int dfd, const std::string& family_dir, unsigned fanout, bool migrating)
+{
+    std::string layout = std::to_string(fanout) + (migrating ? SHARDS_MIGRATING "\n" : "\n");
+    int fd, err;
+
+    if ((fd = openat(dfd, SHARDS_FILE ".new", O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666)) < 0)
+        return -1;
+    err = write(fd, layout.data(), layout.size()) != static_cast<ssize_t>(layout.size());
+    if (close(fd) < 0 || err || renameat(dfd, SHARDS_FILE ".new", dfd, SHARDS_FILE) < 0) {
+        unlinkat(dfd, SHARDS_FILE ".new", 0);
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(layouts_mutex);
+    layouts.erase(family_dir);
+    return 0;
+}
+
+// Finish the sharding of the family directory dfd once every process has
+// noticed the sharded layout: move the metrics written to the flat layout
+// in the meantime and drop the migrating mark. Returns 1 if it is finished
+static int finish_sharding(int dfd, const std::string& family_dir)
+{
+    struct timespec published, now;
+    bool migrating;
+
+    unsigned fanout = read_fanout(family_dir, &migrating, &published);
+    if (!fanout || !migrating)
+        return fanout ? 1 : 0;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if ((now.tv_sec - published.tv_sec) * 1000000000LL + now.tv_nsec - published.tv_nsec < 2 * LAYOUT_CACHE_NS)
+        return 0;
+    if (move_to_shards(dfd, fanout) < 0 || publish_layout(dfd, family_dir, fanout, false) < 0)
+        return -1;
+    return 1;
+}
+
+int fty::shm::shard_family(const std::string& family, unsigned fanout)
+{
+    std::string family_dir = std::string(shm_dir) + "/" + family;
+    char shard[SHARD_NAME_LEN + 1];
+    int dfd, err;
+
+    if (fanout < 2 || fanout > MAX_FANOUT || family.empty() || family.find('/') != std::string::npos) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!files_backend()) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    unsigned current = read_fanout(family_dir);
+    if (current && current != fanout) {
+        // Resharding is not supported
+        errno = EEXIST;
+        return -1;
+    }
+    if ((dfd = open(family_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+    for (unsigned i = 0; i < fanout; i++) {
+        shard_name(i, shard);
+        if (mkdirat(dfd, shard, 0777) < 0 && errno != EEXIST) {
+            close(dfd);
+            return -1;
+        }
+    }
+    // The shards exist by now
+    if (!current && publish_layout(dfd, family_dir, fanout, true) < 0) {
+        close(dfd);
+        return -1;
+    }
+    // Move what is there now. What the writers that still use the cached
+    // flat layout write is moved by the cleanup, or by running this again,
+    // once they all have noticed
+    err = move_to_shards(dfd, fanout);
+    if (finish_sharding(dfd, family_dir) < 0)
+        err = -1;
+    close(dfd);
+    return err;
+}
+
+// Format the record of a whole fty_proto metric: ttl, unit and value lines
+// followed by a key and a value line per aux attribute, its frame if frame
+// is set, and the time of the write unless time_ns is 0
+static void format_metric_data(fty_proto_t* metric, std::string& out, int64_t time_ns = 0, bool frame = false)
+{
+    int ttl = fty_proto_ttl(metric);
+    char ttl_str[Record::ttl_len + 1];
+
+    if (ttl < 0)
+        ttl = 0;
+    sprintf(ttl_str, TTL_FMT, ttl);
+    out.assign(ttl_str);
+    // Unset fields are NULL
+    const char* unit = fty_proto_unit(metric);
+    const char* value = fty_proto_value(metric);
+    out.append(unit ? unit : "").append("\n").append(value ? value : "");
+    zhash_t *aux = fty_proto_aux(metric);
+
+    if (aux) {
+      char *item = (char *) zhash_first (aux);
+      while (item) {
+          out.append("\n").append(zhash_cursor(aux)).append("\n").append(item);
+          item = (char *) zhash_next (aux);
+      }
+    }
+    if (frame)
+        append_frame(metric, out);
+    if (time_ns) {
+        char tail[STAMP_TAIL_LEN];
+        format_stamp(tail, time_ns);
+        out.append(tail, sizeof(tail));
+    }
+}
+
+// Write ttl and value to filename
+static int write_metric_data(const char* filename, fty_proto_t* metric)
+{
+    std::string data;
+
+    format_metric_data(metric, data, write_suppression.load(std::memory_order_relaxed) ? 0 : now_ns(),
+        store_frames.load(std::memory_order_relaxed));
+    if (refresh_unchanged(filename, data.data(), data.size()))
+        return 0;
+    FILE* file = fopen(filename, "w");
+    if(file == NULL)
+      return -1;
+    fwrite(data.data(), 1, data.size(), file);
+    if(fclose(file) < 0)
+      return -1;
+
+    return 0;
+}
+
+
+// Aux keys indexed in the metric family, as last read by this process
+static std::mutex aux_keys_mutex;
+static DirStamp aux_keys_stamp;
+static std::shared_ptr<const std::unordered_set<std::string>> aux_keys;
+
+// Return the escaped names of the aux keys indexed in the metric family, or
+// NULL if there are none. Costs a stat() unless they have changed
+static std::shared_ptr<const std::unordered_set<std::string>> indexed_aux_keys()
+{
+    std::string aux_dir = std::string(shm_dir) + "/metric/" AUX_DIR;
+    std::shared_ptr<std::unordered_set<std::string>> keys;
+    struct stat st;
+    DirEntry de;
+    int fd;
+
+    std::lock_guard<std::mutex> lock(aux_keys_mutex);
+    if (stat(aux_dir.c_str(), &st) < 0)
+        return std::shared_ptr<const std::unordered_set<std::string>>();
+    if (aux_keys_stamp.unchanged(st))
+        return aux_keys;
+    if ((fd = open(aux_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return std::shared_ptr<const std::unordered_set<std::string>>();
+    keys = std::make_shared<std::unordered_set<std::string>>();
+    aux_keys_stamp.update(fd);
+    std::unique_ptr<DirReader> dir(new DirReader(fd));
+    while (dir->next(de) > 0) {
+        if (de.name[0] != '.')
+            keys->emplace(de.name, de.len);
+    }
+    close(fd);
+    aux_keys = keys;
+    if (keys->empty())
+        aux_keys.reset();
+    return aux_keys;
+}
+
+// Add the metric name to the aux index of a key, given the directory of the key
+static int add_aux_entry(const std::string& key_dir, const char* value, const char* name)
+{
+    std::string dir;
+    int fd;
+
+    if (!escape_aux(value, dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    dir = key_dir + "/" + dir;
+    if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST)
+        return -1;
+    if ((fd = open((dir + "/" + name).c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0666)) < 0)
+        return -1;
+    return close(fd);
+}
+
+// Move the metric name between the aux indexes of keys from the values in
+// old_aux to the ones in aux
+static void update_aux_index(const char* name, const AuxMap& old_aux, zhash_t* aux,
+        const std::unordered_set<std::string>& keys)
+{
+    std::string aux_dir = std::string(shm_dir) + "/metric/" AUX_DIR "/";
+    std::string key, value;
+
+    for (const auto& item : old_aux) {
+        const char* new_value = aux ? static_cast<const char*>(zhash_lookup(aux, item.first.c_str())) : NULL;
+        if ((new_value && item.second == new_value) || !escape_aux(item.first.c_str(), key) || !keys.count(key))
+            continue;
+        if (escape_aux(item.second.c_str(), value))
+            unlink((aux_dir + key + "/" + value + "/" + name).c_str());
+    }
+    if (!aux)
+        return;
+    for (const char* item = static_cast<const char*>(zhash_first(aux)); item;
+            item = static_cast<const char*>(zhash_next(aux))) {
+        auto it = old_aux.find(zhash_cursor(aux));
+        if ((it != old_aux.end() && it->second == item) || !escape_aux(zhash_cursor(aux), key) || !keys.count(key))
+            continue;
+        add_aux_entry(aux_dir + key, item, name);
+    }
+}
+
+// write_metric_data() of the file backend, which maintains the aux indexes
+static int write_metric_files(fty_proto_t* metric)
+{
+    char filename[PATH_MAX];
+    AuxMap old_aux;
+
+    if (prepare_filename(filename, fty_proto_name(metric), strlen(fty_proto_name(metric)), fty_proto_type(metric), strlen(fty_proto_type(metric))) < 0)
+        return -1;
+    std::shared_ptr<const std::unordered_set<std::string>> keys = indexed_aux_keys();
+    if (keys)
+        read_aux(AT_FDCWD, filename, old_aux);
+    if (write_metric_data(filename, metric) < 0)
+        return -1;
+    if (keys)
+        update_aux_index(strrchr(filename, '/') + 1, old_aux, fty_proto_aux(metric), *keys);
+    return 0;
+}
+
+int fty::shm::add_aux_index(const std::string& key)
+{
+    std::string family_dir = std::string(shm_dir) + "/metric";
+    std::string key_dir = family_dir + "/" AUX_DIR;
+    std::string escaped;
+    DirEntry de;
+    int dfd;
+
+    if (key.empty() || !escape_aux(key.c_str(), escaped)) {
+        errno = EINVAL;
+        return -1;
+    }
+    // The other backends check the predicate of every metric they scan
+    if (!files_backend())
+        return 0;
+    if (mkdir(key_dir.c_str(), 0777) < 0 && errno != EEXIST)
+        return -1;
+    key_dir += "/" + escaped;
+    if (mkdir(key_dir.c_str(), 0777) < 0 && errno != EEXIST)
+        return -1;
+    // Writers maintain the index from now on, add the metrics written so far
+    std::vector<MetricDir> dirs;
+    if (open_family("metric", dirs) < 0)
+        return -1;
+    for (size_t i = 0; i < dirs.size(); i++) {
+        if ((dfd = dir_fd(dirs, i)) < 0)
+            continue;
+        std::unique_ptr<DirReader> dir(new DirReader(dfd));
+        while (dir->next(de) > 0) {
+            AuxMap aux;
+            if (!de.delim || !is_file(de) || read_aux(dfd, de.name, aux) < 0)
+                continue;
+            auto it = aux.find(key);
+            if (it != aux.end())
+                add_aux_entry(key_dir, it->second.c_str(), de.name);
+        }
+    }
+    close_dirs(dirs);
+    return 0;
+}
+
+// The file backend: a directory per family in the storage directory, which
+// can be spread over shards, and a file per metric
+class FileBackend : public StorageBackend {
+    public:
+        const char* name() const override
+        {
+            return "file";
+        }
+        int write_value(const char* asset, const char* metric, const char* value, const char* unit,
+            int ttl) override
+        {
+            char filename[PATH_MAX];
+
+            if (prepare_filename(filename, asset, strlen(asset), metric, strlen(metric)) < 0)
+                return -1;
+            return ::write_value(filename, value, unit, ttl);
+        }
+        int read_value(const char* asset, const char* metric, std::string& value, std::string* unit,
+            int64_t* time_ns) override
+        {
+            std::string dummy;
+
+            return read_metric_value(asset, strlen(asset), metric, strlen(metric), value, unit ? *unit : dummy,
+                unit != NULL, NULL, time_ns);
+        }
+        int read_stamped(const char* asset, const char* metric, std::string& value, std::string& unit,
+            ReadStamp& stamp) override
+        {
+            return read_metric_value(asset, strlen(asset), metric, strlen(metric), value, unit, true, &stamp);
+        }
+        // Costs an fstat() of the open file, or of its path. Deleting or
+        // moving the file changes its change time
+        bool unchanged(ReadStamp& stamp) override
+        {
+            struct stat st;
+
+            if (stamp.fd >= 0)
+                return stamp.file.unchanged(stamp.fd);
+            return fstatat(AT_FDCWD, stamp.key.c_str(), &st, 0) == 0 && stamp.file.unchanged(st);
+        }
+        int write_metric_data(fty_proto_t* metric) override
+        {
+            return write_metric_files(metric);
+        }
+        int read_data_metric(const std::string& family, const char* name, fty_proto_t* proto_metric,
+            ReadStamp* stamp) override
+        {
+            std::string dir = std::string(shm_dir) + "/" + family;
+            bool migrating = false;
+            unsigned fanout = family.find('/') == std::string::npos ? family_fanout(dir, &migrating) : 0;
+            std::string path, flat_path = dir + "/" + name;
+            int ret;
+
+            if (fanout) {
+                char shard[SHARD_NAME_LEN + 1];
+                shard_name(shard_of(name, strlen(name), fanout), shard);
+                path = dir + "/" + shard + "/" + name;
+                if (migrating && newer_flat_copy(path.c_str(), flat_path.c_str()))
+                    path = flat_path;
+                // Not moved to its shard yet if ENOENT
+                ret = ::read_data_metric(AT_FDCWD, path.c_str(), proto_metric, stamp ? &stamp->file : NULL);
+                if (ret < 0 && errno == ENOENT && path != flat_path) {
+                    path = flat_path;
+                    ret = ::read_data_metric(AT_FDCWD, path.c_str(), proto_metric, stamp ? &stamp->file : NULL);
+                }
+            } else {
+                path = flat_path;
+                ret = ::read_data_metric(AT_FDCWD, path.c_str(), proto_metric, stamp ? &stamp->file : NULL);
+            }
+            if (migrating)
+                forget_stamp(stamp);
+            else if (stamp)
+                stamp->key = path;
+            return ret;
+        }
+        int list(const std::string& family, const std::function<void(const std::string&, const char*)>& fn) override
+        {
+            std::vector<MetricDir> dirs;
+            DirEntry de;
+            int dfd;
+
+            if (open_query_dirs(family, dirs) < 0)
+                return -1;
+            for (size_t i = 0; i < dirs.size(); i++) {
+                if ((dfd = dir_fd(dirs, i)) < 0)
+                    continue;
+                std::unique_ptr<DirReader> dir(new DirReader(dfd));
+                while (dir->next(de) > 0) {
+                    if (de.delim && is_file(de))
+                        fn(dirs[i].path, de.name);
+                }
+            }
+            close_dirs(dirs);
+            return 0;
+        }
+        int remove(const std::string& family, const char* name) override
+        {
+            return unlink((std::string(shm_dir) + "/" + family + "/" + name).c_str());
+        }
+        int cleanup() override
+        {
+            return cleanup_files();
+        }
+};
+
+// Key <family>/<type>@<asset> of a metric in the backends that store blobs
+static int blob_key(const char* family, const char* asset, const char* metric, std::string& key)
+{
+    size_t a_len = strlen(asset), m_len = strlen(metric);
+
+    if (check_names(asset, a_len, metric, m_len) < 0)
+        return -1;
+    key.assign(family).append("/").append(metric, m_len).append(1, SEPARATOR).append(asset, a_len);
+    return 0;
+}
+
+// Attempts of BlobBackend::remove() at a metric that keeps being written
+#define REMOVE_RETRIES 16
+
+// Base of the backends that keep the records of the file backend as blobs,
+// with the time of their last write instead of the file modification time
+class BlobBackend : public StorageBackend {
+    public:
+        int write_value(const char* asset, const char* metric, const char* value, const char* unit,
+            int ttl) override
+        {
+            char buf[Record::header_len + Record::payload_len];
+            std::string key;
+
+            if (blob_key("metric", asset, metric, key) < 0 || format_value(buf, value, unit, ttl) < 0)
+                return -1;
+            size_t value_len = strlen(value);
+            if (value_len > Record::inline_value_len) {
+                // No version, the backends keep writes whole and unchanged
+                // values can be told by their data
+                std::string record;
+                format_long_value(buf, value, value_len, 0, record);
+                return put_changed(key, record.data(), record.size());
+            }
+            return put_changed(key, buf, sizeof(buf));
+        }
+        int read_value(const char* asset, const char* metric, std::string& value, std::string* unit,
+            int64_t* time_ns) override
+        {
+            return read_blob_value(asset, metric, value, unit, NULL, time_ns);
+        }
+        int read_stamped(const char* asset, const char* metric, std::string& value, std::string& unit,
+            ReadStamp& stamp) override
+        {
+            return read_blob_value(asset, metric, value, &unit, &stamp, NULL);
+        }
+        bool unchanged(ReadStamp& stamp) override
+        {
+            uint64_t version;
+            return get_version(stamp.key, version) == 0 && version == stamp.version;
+        }
+        int write_metric_data(fty_proto_t* metric) override
+        {
+            std::string key, data;
+
+            if (blob_key("metric", fty_proto_name(metric), fty_proto_type(metric), key) < 0)
+                return -1;
+            bool frame = store_frames.load(std::memory_order_relaxed);
+            format_metric_data(metric, data, 0, frame);
+            if (put_changed(key, data.data(), data.size()) == 0)
+                return 0;
+            // Without the frame if the record does not fit with it
+            if (!frame || errno != EMSGSIZE)
+                return -1;
+            format_metric_data(metric, data);
+            return put_changed(key, data.data(), data.size());
+        }
+        int read_data_metric(const std::string& family, const char* name, fty_proto_t* proto_metric,
+            ReadStamp* stamp) override
+        {
+            std::string data, key = family + "/" + name;
+            int64_t mtime;
+            uint64_t version;
+            FILE* file;
+
+            if (get(key, data, mtime, version) < 0)
+                return -1;
+            if (stamp) {
+                stamp->key = key;
+                stamp->version = version;
+            }
+            const char* value;
+            size_t value_len, needed;
+            // Blobs are never torn, an invalid long value is corrupt
+            switch (check_long_record(data.data(), data.size(), value, value_len, needed)) {
+                case 1:
+                    return parse_long_metric(data.data(), value, value_len, mtime / 1000000000, proto_metric);
+                case -1:
+                    errno = EIO;
+                    return -1;
+            }
+            // The text ends at the frame, if any
+            data.resize(strnlen(data.data(), data.size()));
+            if (data.empty()) {
+                errno = EIO;
+                return -1;
+            }
+            if (!(file = fmemopen(&data[0], data.size(), "r")))
+                return -1;
+            return parse_data_metric(file, mtime / 1000000000, proto_metric);
+        }
+        int read_raw(const std::string& family, const char* name, std::string& record, int64_t& time_ns) override
+        {
+            const char* value;
+            size_t value_len, needed;
+            uint64_t version;
+
+            if (get(family + "/" + name, record, time_ns, version) < 0)
+                return -1;
+            int ret = check_long_record(record.data(), record.size(), value, value_len, needed);
+            if (ret < 0)
+                errno = EIO;
+            return ret;
+        }
+        int list(const std::string& family, const std::function<void(const std::string&, const char*)>& fn) override
+        {
+            std::vector<std::string> found;
+
+            // Collect the keys first, fn can call back into the backend
+            keys(family == "*" ? std::string() : family + "/", found);
+            for (const std::string& key : found) {
+                size_t slash = key.find('/');
+                fn(key.substr(0, slash), key.c_str() + slash + 1);
+            }
+            return 0;
+        }
+        int remove(const std::string& family, const char* name) override
+        {
+            std::string key = family + "/" + name, data;
+            int64_t mtime;
+            uint64_t version;
+
+            // Retry if the metric is written in between
+            for (int i = 0; i < REMOVE_RETRIES; i++) {
+                if (get(key, data, mtime, version) < 0)
+                    return errno == ENOENT ? 0 : -1;
+                if (erase(key, mtime) < 0)
+                    return -1;
+            }
+            errno = EAGAIN;
+            return -1;
+        }
+        int cleanup() override
+        {
+            std::vector<std::string> found;
+            std::string data;
+            int64_t mtime;
+            uint64_t version;
+
+            keys(std::string(), found);
+            for (const std::string& key : found) {
+                if (get(key, data, mtime, version) < 0)
+                    continue;
+                time_t ttl = strtol(data.c_str(), NULL, 10);
+                // Like the files, wait for two times the ttl value
+                if (ttl && (time(NULL) - mtime / 1000000000) / 2 > ttl)
+                    erase(key, mtime);
+            }
+            return 0;
+        }
+    protected:
+        virtual int put(const std::string& key, const char* data, size_t len) = 0;
+        // Fetch the blob under key, the time of its last write, in
+        // nanoseconds since the epoch, and its version, which changes with
+        // every write
+        virtual int get(const std::string& key, std::string& data, int64_t& mtime, uint64_t& version) = 0;
+        // Fetch only the version of the blob under key
+        virtual int get_version(const std::string& key, uint64_t& version) = 0;
+        // Append the keys that start with prefix to result
+        virtual void keys(const std::string& prefix, std::vector<std::string>& result) = 0;
+        // Delete the blob under key, unless it has been written after mtime
+        // or is gone. Returns 0 then too
+        virtual int erase(const std::string& key, int64_t mtime) = 0;
+        // If the blob under key holds the len bytes of data, only update its
+        // time of last write and return 1, else return 0
+        virtual int touch(const std::string& key, const char* data, size_t len) = 0;
+        // Split the blob of write_value() in data, written at mtime, into
+        // value and unit, the unit only if unit is not NULL
+        static int decode_value(const std::string& data, int64_t mtime, std::string& value, std::string* unit,
+            time_t* ttl = NULL)
+        {
+            // The value can fill the whole payload
+            char buf[Record::record_len + 1];
+            std::string dummy;
+            const char* long_value = NULL;
+            size_t long_len, needed;
+
+            if (data.size() != Record::record_len &&
+                check_long_record(data.data(), data.size(), long_value, long_len, needed) != 1) {
+                errno = EIO;
+                return -1;
+            }
+            memcpy(buf, data.data(), Record::record_len);
+            buf[Record::record_len] = '\0';
+            if (parse_value_record(buf, mtime / 1000000000, value, unit ? *unit : dummy, unit != NULL, ttl) < 0)
+                return -1;
+            if (long_value)
+                value.assign(long_value, long_len);
+            return 0;
+        }
+    private:
+        // put(), or touch() with write suppression
+        int put_changed(const std::string& key, const char* data, size_t len)
+        {
+            if (write_suppression.load(std::memory_order_relaxed)) {
+                bool same = touch(key, data, len) > 0;
+                count_write(same);
+                if (same)
+                    return 0;
+            }
+            return put(key, data, len);
+        }
+        int read_blob_value(const char* asset, const char* metric, std::string& value, std::string* unit,
+            ReadStamp* stamp, int64_t* time_ns)
+        {
+            std::string key, data;
+            int64_t mtime;
+            uint64_t version;
+
+            if (blob_key("metric", asset, metric, key) < 0 || get(key, data, mtime, version) < 0)
+                return -1;
+            if (stamp) {
+                stamp->key = key;
+                stamp->version = version;
+                stamp->mtime = mtime / 1000000000;
+                stamp->time_ns = mtime;
+            }
+            if (decode_value(data, mtime, value, unit, stamp ? &stamp->ttl : NULL) < 0)
+                return -1;
+            if (time_ns)
+                *time_ns = mtime;
+            return 0;
+        }
+};
+
+// Metrics in the memory of the process, for unit tests and programs that
+// embed the library without sharing their metrics
+class HeapBackend : public BlobBackend {
+    public:
+        HeapBackend()
+            : m_writes(0)
+        {
+        }
+        const char* name() const override
+        {
+            return "heap";
+        }
+    protected:
+        int put(const std::string& key, const char* data, size_t len) override
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Blob& blob = m_blobs[key];
+            blob.data.assign(data, len);
+            blob.mtime = now_ns();
+            blob.version = ++m_writes;
+            return 0;
+        }
+        int get(const std::string& key, std::string& data, int64_t& mtime, uint64_t& version) override
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_blobs.find(key);
+            if (it == m_blobs.end()) {
+                errno = ENOENT;
+                return -1;
+            }
+            data = it->second.data;
+            mtime = it->second.mtime;
+            version = it->second.version;
+            return 0;
+        }
+        int get_version(const std::string& key, uint64_t& version) override
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_blobs.find(key);
+            if (it == m_blobs.end()) {
+                errno = ENOENT;
+                return -1;
+            }
+            version = it->second.version;
+            return 0;
+        }
+        void keys(const std::string& prefix, std::vector<std::string>& result) override
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (const auto& blob : m_blobs) {
+                if (!blob.first.compare(0, prefix.size(), prefix))
+                    result.push_back(blob.first);
+            }
+        }
+        int erase(const std::string& key, int64_t mtime) override
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_blobs.find(key);
+            if (it != m_blobs.end() && it->second.mtime == mtime)
+                m_blobs.erase(it);
+            return 0;
+        }
+        int touch(const std::string& key, const char* data, size_t len) override
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_blobs.find(key);
+            if (it == m_blobs.end() || it->second.data.compare(0, std::string::npos, data, len))
+                return 0;
+            it->second.mtime = now_ns();
+            // The read cache has to see the new time
+            it->second.version = ++m_writes;
+            return 1;
+        }
+    private:
+        struct Blob {
+            std::string data;
+            int64_t mtime;
+            // Value of m_writes after the last write, unique even when a
+            // blob is deleted and written again
+            uint64_t version;
+        };
+        std::mutex m_mutex;
+        std::unordered_map<std::string, Blob> m_blobs;
+        uint64_t m_writes;
+};
+
+// The segment backend keeps every metric in one file of the storage
+// directory, mapped by all the processes. It is a series of open addressing
+// hash tables of fixed size slots, each twice as large as the one before,
+// after a header. A table is laid out as an index with the state and key
+// hash of every slot for the probes, and the slots themselves. A key is
+// looked for in at most SEGMENT_PROBES slots of every table. New keys are
+// claimed under the flock() of the file, in the first free or deleted slot
+// of their probes, or in a new table when there is none. The data is
+// written under a sequence lock so that readers never block writers, and
+// the slots of deleted metrics are freed for other keys
+#define SEGMENT_FILE ".segment"
+#define SEGMENT_MAGIC 0x32306d6873797466ULL
+#define SEGMENT_HEADER_SIZE 4096
+#define SEGMENT_SLOTS 65536
+#define SEGMENT_TABLES 8
+#define SEGMENT_PROBES 64
+#define SEGMENT_KEY_LEN 320
+#define SEGMENT_DATA_LEN 688
+// Bound on the waits for a slot that another process is writing, in case
+// it has died meanwhile
+#define SEGMENT_SPINS 100000
+
+struct SegmentHeader {
+    // Set last by whoever creates the segment
+    std::atomic<uint64_t> magic;
+    // Of the first table
+    uint32_t slots;
+    uint32_t slot_size;
+    std::atomic<uint32_t> tables;
+};
+
+// A slot is CLAIMED while a key is written to it, under the lock of the
+// segment. The lock holder finding a CLAIMED slot knows that its claimer
+// died and deletes it
+enum { SLOT_FREE, SLOT_CLAIMED, SLOT_USED, SLOT_DELETED };
+
+struct SegmentIndexEntry {
+    std::atomic<uint32_t> state;
+    // Valid once the slot is used
+    uint32_t hash;
+};
+
+struct SegmentSlot {
+    // Odd while the key or the data is being written
+    std::atomic<uint32_t> seq;
+    // 0 if the slot has been deleted
+    uint16_t key_len;
+    // 0 if the metric has been deleted
+    uint16_t data_len;
+    // Time of the last write, in nanoseconds since the epoch
+    int64_t mtime;
+    char key[SEGMENT_KEY_LEN];
+    char data[SEGMENT_DATA_LEN];
+};
+
+static_assert(sizeof(SegmentSlot) == 1024, "segment slots must not change size");
+static_assert(sizeof(SegmentHeader) <= SEGMENT_HEADER_SIZE, "the segment header must fit in its page");
+
+struct SegmentTable {
+    uint32_t slots;
+    SegmentIndexEntry* index;
+    SegmentSlot* slot;
+};
+
+// Mapping of the segment of a storage directory
+struct Segment {
+    std::string dir;
+    // Of the file, reopened to lock it and to map the tables added later
+    dev_t dev;
+    ino_t ino;
+    SegmentHeader* header;
+    // Number of tables mapped, which only grows
+    std::atomic<uint32_t> tables;
+    SegmentTable table[SEGMENT_TABLES];
+    // Serializes the mappings of the tables added later
+    std::mutex mutex;
+};
+
+static size_t segment_table_size(uint32_t slots)
+{
+    return size_t(slots) * (sizeof(SegmentIndexEntry) + sizeof(SegmentSlot));
+}
+
+// Size of the segment file with tables tables of slots slots for the first
+static size_t segment_size(uint32_t slots, uint32_t tables)
+{
+    size_t size = SEGMENT_HEADER_SIZE;
+
+    for (uint32_t i = 0; i < tables; i++)
+        size += segment_table_size(slots << i);
+    return size;
+}
+
+// Open the file of segment again. Fails with ESTALE if it has been
+// replaced
+static int open_segment(Segment* segment)
+{
+    std::string path = segment->dir + "/" SEGMENT_FILE;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path.c_str(), O_RDWR | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_dev != segment->dev || st.st_ino != segment->ino) {
+        close(fd);
+        errno = ESTALE;
+        return -1;
+    }
+    return fd;
+}
+
+// Map the tables of segment, open as fd, that another process has added.
+// Called with the mutex of the segment
+static int map_segment_tables(Segment* segment, int fd)
+{
+    uint32_t mapped = segment->tables.load(std::memory_order_relaxed);
+    uint32_t tables = segment->header->tables.load(std::memory_order_acquire);
+    struct stat st;
+
+    if (tables > SEGMENT_TABLES || fstat(fd, &st) < 0 ||
+            size_t(st.st_size) < segment_size(segment->header->slots, tables)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (uint32_t i = mapped; i < tables; i++) {
+        SegmentTable& table = segment->table[i];
+        table.slots = segment->header->slots << i;
+        void* base = mmap(NULL, segment_table_size(table.slots), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+            segment_size(segment->header->slots, i));
+        if (base == MAP_FAILED)
+            return -1;
+        table.index = static_cast<SegmentIndexEntry*>(base);
+        table.slot = reinterpret_cast<SegmentSlot*>(table.index + table.slots);
+        segment->tables.store(i + 1, std::memory_order_release);
+    }
+    return 0;
+}
+
+// Map the segment of the storage directory, creating it if needed. The
+// file stays sparse until its slots are used
+static Segment* map_segment()
+{
+    std::string path = std::string(shm_dir) + "/" SEGMENT_FILE;
+    struct stat st;
+    void* base;
+    int fd;
+
+    if ((fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0)
+        return NULL;
+    // Created under the lock, with the size of the first table
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0 ||
+            (!st.st_size && ftruncate(fd, segment_size(SEGMENT_SLOTS, 1)) < 0) ||
+            (base = mmap(NULL, SEGMENT_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    SegmentHeader* header = static_cast<SegmentHeader*>(base);
+    uint64_t magic = header->magic.load(std::memory_order_acquire);
+    if (!magic) {
+        header->slots = SEGMENT_SLOTS;
+        header->slot_size = sizeof(SegmentSlot);
+        header->tables.store(1, std::memory_order_relaxed);
+        header->magic.store(magic = SEGMENT_MAGIC, std::memory_order_release);
+    }
+    flock(fd, LOCK_UN);
+    // Every table has to start on a page
+    if (magic != SEGMENT_MAGIC || header->slot_size != sizeof(SegmentSlot) || !header->slots ||
+            segment_table_size(header->slots) % SEGMENT_HEADER_SIZE || !header->tables.load(std::memory_order_acquire)) {
+        munmap(base, SEGMENT_HEADER_SIZE);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    Segment* segment = new Segment;
+    segment->dir = shm_dir;
+    segment->dev = st.st_dev;
+    segment->ino = st.st_ino;
+    segment->header = header;
+    segment->tables.store(0, std::memory_order_relaxed);
+    int ret = map_segment_tables(segment, fd);
+    int err = errno;
+    close(fd);
+    if (ret < 0) {
+        for (uint32_t i = 0; i < segment->tables.load(std::memory_order_relaxed); i++)
+            munmap(segment->table[i].index, segment_table_size(segment->table[i].slots));
+        munmap(base, SEGMENT_HEADER_SIZE);
+        delete segment;
+        errno = err;
+        return NULL;
+    }
+    return segment;
+}
+
+// Take the sequence lock of a slot for writing, seq is set to its value
+// before
+static bool lock_slot(SegmentSlot& slot, uint32_t& seq)
+{
+    seq = slot.seq.load(std::memory_order_relaxed);
+    for (int spins = 0; spins < SEGMENT_SPINS; spins++) {
+        if (!(seq & 1) && slot.seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire)) {
+            std::atomic_thread_fence(std::memory_order_release);
+            return true;
+        }
+        if (seq & 1) {
+            sched_yield();
+            seq = slot.seq.load(std::memory_order_relaxed);
+        }
+    }
+    errno = EBUSY;
+    return false;
+}
+
+static void unlock_slot(SegmentSlot& slot, uint32_t seq)
+{
+    slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+static bool slot_has_key(const SegmentSlot& slot, const std::string& key)
+{
+    return slot.key_len == key.size() && !memcmp(slot.key, key.data(), key.size());
+}
+
+class SegmentBackend : public BlobBackend {
+    public:
+        SegmentBackend()
+            : m_segment(NULL)
+        {
+        }
+        const char* name() const override
+        {
+            return "segment";
+        }
+    protected:
+        int put(const std::string& key, const char* data, size_t len) override
+        {
+            SegmentSlot* slot;
+            uint32_t seq;
+
+            if (len > SEGMENT_DATA_LEN) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            // Until the slot found still has the key under its lock, it can
+            // be deleted and claimed for another key in between
+            for (;;) {
+                if (!(slot = find(key, true)) || !lock_slot(*slot, seq))
+                    return -1;
+                if (slot_has_key(*slot, key))
+                    break;
+                unlock_slot(*slot, seq);
+            }
+            memcpy(slot->data, data, len);
+            slot->data_len = len;
+            slot->mtime = now_ns();
+            unlock_slot(*slot, seq);
+            return 0;
+        }
+        // The version is the sequence number of the slot
+        int get(const std::string& key, std::string& data, int64_t& mtime, uint64_t& version) override
+        {
+            char buf[SEGMENT_DATA_LEN];
+            SegmentSlot* slot;
+
+            if (!(slot = find(key, false)))
+                return -1;
+            for (int spins = 0; spins < SEGMENT_SPINS; spins++) {
+                uint32_t seq = slot->seq.load(std::memory_order_acquire);
+                if (seq & 1) {
+                    sched_yield();
+                    continue;
+                }
+                bool same_key = slot_has_key(*slot, key);
+                size_t len = slot->data_len;
+                int64_t slot_mtime = slot->mtime;
+                if (len > SEGMENT_DATA_LEN)
+                    continue;
+                memcpy(buf, slot->data, len);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot->seq.load(std::memory_order_relaxed) != seq)
+                    continue;
+                if (!same_key || !len) {
+                    errno = ENOENT;
+                    return -1;
+                }
+                data.assign(buf, len);
+                mtime = slot_mtime;
+                version = seq;
+                return 0;
+            }
+            errno = EBUSY;
+            return -1;
+        }
+        int get_version(const std::string& key, uint64_t& version) override
+        {
+            SegmentSlot* slot;
+
+            if (!(slot = find(key, false)))
+                return -1;
+            version = slot->seq.load(std::memory_order_acquire);
+            return 0;
+        }
+        void keys(const std::string& prefix, std::vector<std::string>& result) override
+        {
+            Segment* segment = current();
+
+            if (!segment)
+                return;
+            for (uint32_t t = 0; t < segment->tables.load(std::memory_order_acquire); t++) {
+                const SegmentTable& table = segment->table[t];
+                for (uint32_t i = 0; i < table.slots; i++) {
+                    const SegmentSlot& slot = table.slot[i];
+                    size_t key_len = std::min<size_t>(slot.key_len, SEGMENT_KEY_LEN);
+                    if (table.index[i].state.load(std::memory_order_acquire) != SLOT_USED || !slot.data_len ||
+                            key_len < prefix.size() || memcmp(slot.key, prefix.data(), prefix.size()))
+                        continue;
+                    result.emplace_back(slot.key, key_len);
+                }
+            }
+        }
+        // Frees the slot for another key
+        int erase(const std::string& key, int64_t mtime) override
+        {
+            SegmentIndexEntry* entry;
+            SegmentSlot* slot;
+            uint32_t seq;
+
+            if (!(slot = find(key, false, &entry)))
+                return errno == ENOENT ? 0 : -1;
+            if (!lock_slot(*slot, seq))
+                return -1;
+            bool deleted = slot_has_key(*slot, key) && slot->mtime == mtime;
+            if (deleted) {
+                slot->data_len = 0;
+                slot->key_len = 0;
+            }
+            unlock_slot(*slot, seq);
+            uint32_t state = SLOT_USED;
+            if (deleted)
+                entry->state.compare_exchange_strong(state, SLOT_DELETED, std::memory_order_release);
+            return 0;
+        }
+        // Compares in place, under the lock of the slot
+        int touch(const std::string& key, const char* data, size_t len) override
+        {
+            SegmentSlot* slot;
+            uint32_t seq;
+
+            if (!(slot = find(key, false)) || !lock_slot(*slot, seq))
+                return 0;
+            bool same = slot_has_key(*slot, key) && slot->data_len == len && !memcmp(slot->data, data, len);
+            if (same)
+                slot->mtime = now_ns();
+            unlock_slot(*slot, seq);
+            return same;
+        }
+    private:
+        // The segment of the current storage directory, with the tables
+        // other processes have added mapped. Mappings of other directories
+        // are kept, as other threads may still use them
+        Segment* current()
+        {
+            Segment* segment = m_segment.load(std::memory_order_acquire);
+            if (!segment || segment->dir != shm_dir) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                segment = m_segment.load(std::memory_order_relaxed);
+                if (!segment || segment->dir != shm_dir) {
+                    if (!(segment = map_segment()))
+                        return NULL;
+                    m_segment.store(segment, std::memory_order_release);
+                }
+            }
+            if (segment->tables.load(std::memory_order_acquire) !=
+                    segment->header->tables.load(std::memory_order_acquire)) {
+                std::lock_guard<std::mutex> lock(segment->mutex);
+                int fd = open_segment(segment);
+                if (fd < 0)
+                    return NULL;
+                int ret = map_segment_tables(segment, fd);
+                int err = errno;
+                close(fd);
+                errno = err;
+                if (ret < 0)
+                    return NULL;
+            }
+            return segment;
+        }
+        // The used slot of key, and its index entry if entry is not NULL.
+        // A slot being claimed has no data yet and is passed over like a
+        // deleted one
+        static SegmentSlot* lookup(Segment* segment, const std::string& key, uint32_t hash,
+            SegmentIndexEntry** entry = NULL)
+        {
+            for (uint32_t t = 0; t < segment->tables.load(std::memory_order_acquire); t++) {
+                SegmentTable& table = segment->table[t];
+                for (uint32_t i = 0; i < SEGMENT_PROBES; i++) {
+                    uint32_t pos = (hash + i) % table.slots;
+                    uint32_t state = table.index[pos].state.load(std::memory_order_acquire);
+                    if (state == SLOT_FREE)
+                        break;
+                    if (state == SLOT_USED && table.index[pos].hash == hash && slot_has_key(table.slot[pos], key)) {
+                        if (entry)
+                            *entry = &table.index[pos];
+                        return &table.slot[pos];
+                    }
+                }
+            }
+            errno = ENOENT;
+            return NULL;
+        }
+        // Claim a slot for key, under the locks of the segment, open as fd
+        static SegmentSlot* claim(Segment* segment, int fd, const std::string& key, uint32_t hash)
+        {
+            SegmentIndexEntry* entry = NULL;
+            SegmentSlot* slot;
+            uint32_t seq;
+
+            // Claimed by someone else meanwhile
+            if ((slot = lookup(segment, key, hash)))
+                return slot;
+            for (uint32_t t = 0; !entry; t++) {
+                if (t == segment->tables.load(std::memory_order_relaxed) && add_table(segment, fd) < 0)
+                    return NULL;
+                SegmentTable& table = segment->table[t];
+                for (uint32_t i = 0; i < SEGMENT_PROBES; i++) {
+                    uint32_t pos = (hash + i) % table.slots;
+                    uint32_t state = table.index[pos].state.load(std::memory_order_acquire);
+                    // Left by a claimer that died
+                    if (state == SLOT_CLAIMED) {
+                        table.index[pos].state.store(SLOT_DELETED, std::memory_order_release);
+                        state = SLOT_DELETED;
+                    }
+                    if (state == SLOT_FREE || state == SLOT_DELETED) {
+                        entry = &table.index[pos];
+                        slot = &table.slot[pos];
+                        break;
+                    }
+                }
+            }
+            entry->state.store(SLOT_CLAIMED, std::memory_order_relaxed);
+            if (!lock_slot(*slot, seq)) {
+                entry->state.store(SLOT_DELETED, std::memory_order_release);
+                return NULL;
+            }
+            memcpy(slot->key, key.data(), key.size());
+            slot->key_len = key.size();
+            slot->data_len = 0;
+            unlock_slot(*slot, seq);
+            entry->hash = hash;
+            entry->state.store(SLOT_USED, std::memory_order_release);
+            return slot;
+        }
+        // Append a table twice as large as the last one, under the locks
+        // of the segment, open as fd
+        static int add_table(Segment* segment, int fd)
+        {
+            uint32_t tables = segment->tables.load(std::memory_order_relaxed);
+
+            if (tables == SEGMENT_TABLES) {
+                errno = ENOSPC;
+                return -1;
+            }
+            if (ftruncate(fd, segment_size(segment->header->slots, tables + 1)) < 0)
+                return -1;
+            segment->header->tables.store(tables + 1, std::memory_order_release);
+            return map_segment_tables(segment, fd);
+        }
+        // Return the slot of key, claiming one if create is set
+        SegmentSlot* find(const std::string& key, bool create, SegmentIndexEntry** entry = NULL)
+        {
+            Segment* segment = current();
+            SegmentSlot* slot;
+
+            if (!segment)
+                return NULL;
+            if (key.size() > SEGMENT_KEY_LEN) {
+                errno = ENAMETOOLONG;
+                return NULL;
+            }
+            uint32_t hash = fnv1a(key.data(), key.size());
+            if ((slot = lookup(segment, key, hash, entry)) || !create)
+                return slot;
+            std::lock_guard<std::mutex> lock(segment->mutex);
+            int fd = open_segment(segment);
+            if (fd < 0)
+                return NULL;
+            slot = NULL;
+            // With the tables added by others while waiting for the lock
+            if (flock(fd, LOCK_EX) == 0 && map_segment_tables(segment, fd) == 0)
+                slot = claim(segment, fd, key, hash);
+            int err = errno;
+            // The mappings of new tables keep the open file, and its lock
+            flock(fd, LOCK_UN);
+            close(fd);
+            errno = err;
+            return slot;
+        }
+
+        std::mutex m_mutex;
+        std::atomic<Segment*> m_segment;
+};
+
+// The packed backend keeps the metrics of an asset in one file,
+// <PACKED_DIR>/<family>/<asset>, of fixed size slots, so that a page and an
+// inode hold the metrics of an asset instead of a single one. The headers
+// of the slots are the directory of the file. A slot is added for a type
+// under the lock of the file and keeps it for good, a deleted metric only
+// has no data, so a process can remember where the slot of a type is. A
+// slot never crosses a page and is written in one piece, its checksum
+// tells a read that a write tore
+#define PACKED_DIR ".packed"
+#define PACKED_SLOT_SIZE 256
+#define PACKED_TYPE_LEN 41
+#define PACKED_DATA_LEN 192
+#define PACKED_READ_RETRIES 100
+#define PACKED_PAGE_SIZE 4096
+
+struct PackedSlot {
+    // Time of the last write, in nanoseconds since the epoch
+    int64_t mtime;
+    // Changes with every write of the data
+    uint64_t version;
+    // FNV-1a of the data
+    uint32_t checksum;
+    // 0 if the metric has been deleted
+    uint16_t data_len;
+    uint8_t type_len;
+    char type[PACKED_TYPE_LEN];
+    char data[PACKED_DATA_LEN];
+};
+
+static_assert(sizeof(PackedSlot) == PACKED_SLOT_SIZE && PACKED_PAGE_SIZE % PACKED_SLOT_SIZE == 0,
+    "packed slots must not cross pages");
+static_assert(PACKED_DATA_LEN >= Record::record_len, "packed slots must hold a record");
+
+class PackedBackend : public BlobBackend {
+    public:
+        const char* name() const override
+        {
+            return "packed";
+        }
+        int read_asset(const char* asset, fty::shm::Metrics& metrics) override
+        {
+            std::vector<PackedSlot> slots;
+            std::string data, value, unit;
+
+            if (read_slots(path("metric", asset), slots) < 0)
+                return -1;
+            for (const PackedSlot& slot : slots) {
+                if (!slot.data_len)
+                    continue;
+                data.assign(slot.data, slot.data_len);
+                if (decode_value(data, slot.mtime, value, &unit) < 0)
+                    continue;
+                fty::shm::Metric& metric = metrics[std::string(slot.type, slot.type_len)];
+                metric.value.swap(value);
+                metric.unit.swap(unit);
+            }
+            return 0;
+        }
+    protected:
+        int put(const std::string& key, const char* data, size_t len) override
+        {
+            std::string file, type;
+            PackedSlot slot;
+            int fd, index;
+
+            if (len > PACKED_DATA_LEN) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            if (split(key, file, type) < 0 || (fd = open_file(file, true)) < 0)
+                return -1;
+            if ((index = find(fd, file, type, true)) < 0) {
+                close(fd);
+                return -1;
+            }
+            memset(&slot, 0, sizeof(slot));
+            slot.mtime = now_ns();
+            slot.version = slot.mtime;
+            slot.checksum = fnv1a(data, len);
+            slot.data_len = len;
+            slot.type_len = type.size();
+            memcpy(slot.type, type.data(), type.size());
+            memcpy(slot.data, data, len);
+            int ret = pwrite(fd, &slot, sizeof(slot), off_t(index) * sizeof(slot)) == sizeof(slot) ? 0 : -1;
+            close(fd);
+            return ret;
+        }
+        int get(const std::string& key, std::string& data, int64_t& mtime, uint64_t& version) override
+        {
+            PackedSlot slot;
+
+            if (get_slot(key, slot) < 0)
+                return -1;
+            if (!slot.data_len) {
+                errno = ENOENT;
+                return -1;
+            }
+            data.assign(slot.data, slot.data_len);
+            mtime = slot.mtime;
+            version = slot.version;
+            return 0;
+        }
+        int get_version(const std::string& key, uint64_t& version) override
+        {
+            PackedSlot slot;
+
+            if (get_slot(key, slot) < 0)
+                return -1;
+            version = slot.version;
+            return 0;
+        }
+        void keys(const std::string& prefix, std::vector<std::string>& result) override
+        {
+            std::string root = std::string(shm_dir) + "/" PACKED_DIR;
+            std::vector<PackedSlot> slots;
+            std::vector<std::string> families;
+            struct dirent* de;
+            DIR* dir;
+
+            if (!prefix.empty()) {
+                families.push_back(prefix.substr(0, prefix.find('/')));
+            } else if ((dir = opendir(root.c_str()))) {
+                while ((de = readdir(dir))) {
+                    if (de->d_name[0] != '.')
+                        families.push_back(de->d_name);
+                }
+                closedir(dir);
+            }
+            for (const std::string& family : families) {
+                if (!(dir = opendir((root + "/" + family).c_str())))
+                    continue;
+                while ((de = readdir(dir))) {
+                    if (de->d_name[0] == '.' || read_slots(root + "/" + family + "/" + de->d_name, slots) < 0)
+                        continue;
+                    for (const PackedSlot& slot : slots) {
+                        if (slot.data_len)
+                            result.push_back(family + "/" + std::string(slot.type, slot.type_len) + SEPARATOR +
+                                de->d_name);
+                    }
+                }
+                closedir(dir);
+            }
+        }
+        // Races with writes like the cleanup of the files
+        int erase(const std::string& key, int64_t mtime) override
+        {
+            std::string file, type;
+            PackedSlot slot;
+            int fd, index, err = 0;
+
+            if (split(key, file, type) < 0)
+                return -1;
+            if ((fd = open_file(file, false)) < 0)
+                return errno == ENOENT ? 0 : -1;
+            if ((index = find(fd, file, type, false)) < 0 || read_slot(fd, index, slot) < 0)
+                err = errno == ENOENT ? 0 : -1;
+            else if (slot.mtime == mtime) {
+                slot.data_len = 0;
+                slot.checksum = fnv1a(slot.data, 0);
+                if (pwrite(fd, &slot, sizeof(slot), off_t(index) * sizeof(slot)) != sizeof(slot))
+                    err = -1;
+            }
+            close(fd);
+            return err;
+        }
+        // Only the time of the write is written, in place
+        int touch(const std::string& key, const char* data, size_t len) override
+        {
+            std::string file, type;
+            PackedSlot slot;
+            int fd, index;
+
+            if (split(key, file, type) < 0 || (fd = open_file(file, false)) < 0)
+                return 0;
+            bool same = (index = find(fd, file, type, false)) >= 0 && read_slot(fd, index, slot) == 0 &&
+                slot.data_len == len && !memcmp(slot.data, data, len);
+            if (same) {
+                slot.mtime = now_ns();
+                same = pwrite(fd, &slot.mtime, sizeof(slot.mtime), off_t(index) * sizeof(slot)) ==
+                    sizeof(slot.mtime);
+            }
+            close(fd);
+            return same;
+        }
+    private:
+        static std::string path(const std::string& family, const std::string& asset)
+        {
+            return std::string(shm_dir) + "/" PACKED_DIR "/" + family + "/" + asset;
+        }
+        // Split the key <family>/<type>@<asset> into the path of the file
+        // and the type
+        static int split(const std::string& key, std::string& file, std::string& type)
+        {
+            size_t slash = key.find('/'), delim = key.find(SEPARATOR, slash);
+
+            type.assign(key, slash + 1, delim - slash - 1);
+            if (type.size() > PACKED_TYPE_LEN) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            file = path(key.substr(0, slash), key.substr(delim + SEPARATOR_LEN));
+            return 0;
+        }
+        static int open_file(const std::string& file, bool create)
+        {
+            int fd = open(file.c_str(), create ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDWR | O_CLOEXEC, 0666);
+            if (fd >= 0 || !create || errno != ENOENT)
+                return fd;
+            // The family, and the backend directory with the first family
+            std::string family = file.substr(0, file.rfind('/'));
+            if ((mkdir(family.substr(0, family.rfind('/')).c_str(), 0777) < 0 && errno != EEXIST) ||
+                (mkdir(family.c_str(), 0777) < 0 && errno != EEXIST))
+                return -1;
+            return open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        }
+        // Read slot index of fd, retrying while a write tears it. A slot
+        // past the end of the file fails with ENOENT
+        static int read_slot(int fd, int index, PackedSlot& slot)
+        {
+            for (int retry = 0; retry < PACKED_READ_RETRIES; retry++) {
+                ssize_t len = pread(fd, &slot, sizeof(slot), off_t(index) * sizeof(slot));
+                if (len < 0)
+                    return -1;
+                if (len != sizeof(slot)) {
+                    errno = ENOENT;
+                    return -1;
+                }
+                if (slot.data_len <= PACKED_DATA_LEN && slot.checksum == fnv1a(slot.data, slot.data_len))
+                    return 0;
+                sched_yield();
+            }
+            errno = EAGAIN;
+            return -1;
+        }
+        // Read all the slots of file in one read, again while a write tears
+        // one of them
+        static int read_slots(const std::string& file, std::vector<PackedSlot>& slots)
+        {
+            struct stat st;
+            int fd;
+
+            if ((fd = open(file.c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+                return -1;
+            for (int retry = 0; retry < PACKED_READ_RETRIES; retry++) {
+                // One more slot than the file has, to tell a file that grew
+                if (!retry && fstat(fd, &st) == 0)
+                    slots.resize(st.st_size / sizeof(PackedSlot) + 1);
+                ssize_t len = pread(fd, slots.data(), slots.size() * sizeof(PackedSlot), 0);
+                if (len < 0)
+                    break;
+                size_t count = len / sizeof(PackedSlot);
+                if (count == slots.size()) {
+                    slots.resize(count * 2);
+                    continue;
+                }
+                slots.resize(count);
+                bool torn = false;
+                for (const PackedSlot& slot : slots)
+                    torn |= slot.data_len > PACKED_DATA_LEN || slot.checksum != fnv1a(slot.data, slot.data_len);
+                if (!torn) {
+                    close(fd);
+                    return 0;
+                }
+                sched_yield();
+            }
+            close(fd);
+            if (errno != ENOENT)
+                errno = EAGAIN;
+            return -1;
+        }
+        // Index of the slot of type in the open file, adding one under the
+        // lock of the file if create is set
+        int find(int fd, const std::string& file, const std::string& type, bool create)
+        {
+            std::string key = file + "/" + type;
+            PackedSlot slot;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto it = m_slots.find(key);
+                // The file may have been deleted and created again since
+                if (it != m_slots.end() && read_slot(fd, it->second, slot) == 0 &&
+                        std::string(slot.type, slot.type_len) == type)
+                    return it->second;
+            }
+            if (create && flock(fd, LOCK_EX) < 0)
+                return -1;
+            int index = 0;
+            bool found = false;
+            for (;; index++) {
+                if (read_slot(fd, index, slot) < 0) {
+                    if (errno != ENOENT || !create)
+                        index = -1;
+                    break;
+                }
+                if ((found = std::string(slot.type, slot.type_len) == type))
+                    break;
+            }
+            if (index >= 0 && !found) {
+                // A new slot at the end, without data until put() writes it
+                memset(&slot, 0, sizeof(slot));
+                slot.type_len = type.size();
+                memcpy(slot.type, type.data(), type.size());
+                slot.checksum = fnv1a(slot.data, 0);
+                if (pwrite(fd, &slot, sizeof(slot), off_t(index) * sizeof(slot)) != sizeof(slot))
+                    index = -1;
+            }
+            if (create)
+                flock(fd, LOCK_UN);
+            if (index >= 0) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_slots[key] = index;
+            }
+            return index;
+        }
+        int get_slot(const std::string& key, PackedSlot& slot)
+        {
+            std::string file, type;
+            int fd, index, ret = -1;
+
+            if (split(key, file, type) < 0 || (fd = open(file.c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+                return -1;
+            if ((index = find(fd, file, type, false)) >= 0)
+                ret = read_slot(fd, index, slot);
+            close(fd);
+            return ret;
+        }
+
+        std::mutex m_mutex;
+        // Slot of every <path of the file>/<type> this process has used
+        std::unordered_map<std::string, int> m_slots;
+};
+
+static FileBackend& file_backend()
+{
+    static FileBackend backend;
+    return backend;
+}
+
+// The backends, the default first
+static const std::vector<StorageBackend*>& backends()
+{
+    static SegmentBackend segment;
+    static PackedBackend packed;
+    static HeapBackend heap;
+    static const std::vector<StorageBackend*> all = { &file_backend(), &segment, &packed, &heap };
+    return all;
+}
+
+static StorageBackend* find_backend(const std::string& name)
+{
+    for (StorageBackend* backend : backends()) {
+        if (name == backend->name())
+            return backend;
+    }
+    return NULL;
+}
+
+static std::atomic<StorageBackend*> current_backend(NULL);
+
+// The backend set with fty::shm::set_backend(), else the one named by
+// FTY_SHM_BACKEND, else the files
+static StorageBackend* storage()
+{
+    StorageBackend* backend = current_backend.load(std::memory_order_acquire);
+    if (backend)
+        return backend;
+    const char* name = getenv("FTY_SHM_BACKEND");
+    if (!name || !(backend = find_backend(name)))
+        backend = &file_backend();
+    StorageBackend* expected = NULL;
+    if (!current_backend.compare_exchange_strong(expected, backend))
+        return expected;
+    return backend;
+}
+
+static bool files_backend()
+{
+    return storage() == &file_backend();
+}
+
+// Decoded value of a metric in the read cache
+struct CachedValue {
+    std::string value;
+    std::string unit;
+    ReadStamp stamp;
+};
+
+// The read cache, keyed by <type>@<asset>
+static std::atomic<size_t> read_cache_size(0);
+static std::atomic<uint64_t> read_cache_hits(0);
+static std::atomic<uint64_t> read_cache_misses(0);
+static std::mutex read_cache_mutex;
+static std::unordered_map<std::string, std::unique_ptr<CachedValue>> read_cache;
+
+// The file backend keeps the files of the cached metrics open, up to this
+// share of the limit of open files, and checks the others by their path.
+// Counts under read_cache_mutex
+#define READ_CACHE_FD_SHARE 4
+static size_t read_cache_fds = 0;
+static size_t read_cache_max_fds = 0;
+
+static void clear_read_cache()
+{
+    std::lock_guard<std::mutex> lock(read_cache_mutex);
+    read_cache.clear();
+    read_cache_fds = 0;
+}
+
+// Count the open file of entry, or close it if there are too many
+static void keep_cached_fd(CachedValue& entry)
+{
+    if (entry.stamp.fd < 0)
+        return;
+    if (read_cache_fds < read_cache_max_fds) {
+        read_cache_fds++;
+        return;
+    }
+    close(entry.stamp.fd);
+    entry.stamp.fd = -1;
+}
+
+static void erase_cached(std::unordered_map<std::string, std::unique_ptr<CachedValue>>::iterator it)
+{
+    if (it->second->stamp.fd >= 0)
+        read_cache_fds--;
+    read_cache.erase(it);
+}
+
+// read_value() of the backend through the read cache, if enabled. A cached
+// value is returned if the backend says the metric has not changed, after
+// checking its ttl
+static int read_metric_cached(const char* asset, const char* metric, std::string& value, std::string* unit,
+    int64_t* time_ns)
+{
+    static thread_local std::string key;
+    std::unique_ptr<CachedValue> entry;
+
+    if (!read_cache_size.load(std::memory_order_relaxed))
+        return storage()->read_value(asset, metric, value, unit, time_ns);
+    key.assign(metric).append(1, SEPARATOR).append(asset);
+    {
+        std::lock_guard<std::mutex> lock(read_cache_mutex);
+        auto it = read_cache.find(key);
+        if (it != read_cache.end() && storage()->unchanged(it->second->stamp)) {
+            const CachedValue& cached = *it->second;
+            read_cache_hits.fetch_add(1, std::memory_order_relaxed);
+            if (cached.stamp.ttl && time(NULL) - cached.stamp.mtime > cached.stamp.ttl) {
+                errno = ESTALE;
+                return -1;
+            }
+            value = cached.value;
+            if (unit)
+                *unit = cached.unit;
+            if (time_ns)
+                *time_ns = cached.stamp.time_ns;
+            return 0;
+        }
+    }
+    // Read without holding the lock
+    read_cache_misses.fetch_add(1, std::memory_order_relaxed);
+    entry.reset(new CachedValue);
+    if (storage()->read_stamped(asset, metric, entry->value, entry->unit, entry->stamp) < 0)
+        return -1;
+    value = entry->value;
+    if (unit)
+        *unit = entry->unit;
+    if (time_ns)
+        *time_ns = entry->stamp.time_ns;
+    std::lock_guard<std::mutex> lock(read_cache_mutex);
+    size_t size = read_cache_size.load(std::memory_order_relaxed);
+    if (!size)
+        return 0;
+    auto it = read_cache.find(key);
+    if (it != read_cache.end())
+        erase_cached(it);
+    // Evict an arbitrary entry when full
+    else if (read_cache.size() >= size)
+        erase_cached(read_cache.begin());
+    keep_cached_fd(*entry);
+    read_cache.emplace(key, std::move(entry));
+    return 0;
+}
+
+void fty::shm::set_read_cache(size_t entries)
+{
+    struct rlimit limit;
+
+    std::lock_guard<std::mutex> lock(read_cache_mutex);
+    read_cache_size.store(entries, std::memory_order_relaxed);
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+        read_cache_max_fds = limit.rlim_cur / READ_CACHE_FD_SHARE;
+    while (read_cache.size() > entries)
+        erase_cached(read_cache.begin());
+}
+
+fty::shm::ReadCacheStats fty::shm::read_cache_stats()
+{
+    ReadCacheStats stats;
+    stats.hits = read_cache_hits.load(std::memory_order_relaxed);
+    stats.misses = read_cache_misses.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void fty::shm::set_write_suppression(bool enabled)
+{
+    write_suppression.store(enabled, std::memory_order_relaxed);
+}
+
+fty::shm::WriteSuppressionStats fty::shm::write_suppression_stats()
+{
+    WriteSuppressionStats stats;
+    stats.suppressed = suppressed_writes.load(std::memory_order_relaxed);
+    stats.written = unsuppressed_writes.load(std::memory_order_relaxed);
+    return stats;
+}
+
+int fty::shm::set_backend(const std::string& name)
+{
+    StorageBackend* backend = find_backend(name);
+    if (!backend) {
+        errno = EINVAL;
+        return -1;
+    }
+    current_backend.store(backend, std::memory_order_release);
+    clear_read_cache();
+    return 0;
+}
+
+const char* fty::shm::backend_name()
+{
+    return storage()->name();
+}
+
+std::vector<std::string> fty::shm::backend_names()
+{
+    std::vector<std::string> names;
+    for (StorageBackend* backend : backends())
+        names.push_back(backend->name());
+    return names;
+}
+
+int fty::shm::write_metric(const std::string& asset, const std::string& metric, const std::string& value, const std::string& unit, int ttl)
+{
+    return storage()->write_value(asset.c_str(), metric.c_str(), value.c_str(), unit.c_str(), ttl);
+}
+
+int fty::shm::write_metric(fty_proto_t* metric)
+{
+    return storage()->write_metric_data(metric);
+}
+
+int fty::shm::read_metric(const std::string& asset, const std::string& metric, std::string& value)
+{
+    return read_metric_cached(asset.c_str(), metric.c_str(), value, NULL);
+}
+
+int fty::shm::read_metric(const std::string& asset, const std::string& metric, std::string& value, std::string& unit)
+{
+    return read_metric_cached(asset.c_str(), metric.c_str(), value, &unit);
+}
+
+int fty::shm::read_metric(const std::string& asset, const std::string& metric, std::string& value, std::string& unit,
+    int64_t& time_ns)
+{
+    return read_metric_cached(asset.c_str(), metric.c_str(), value, &unit, &time_ns);
+}
+
+int fty::shm::read_metric(const std::string& asset, const std::string& metric, std::string& value, const char*& unit)
+{
+    static thread_local std::string unit_str;
+
+    if (read_metric_cached(asset.c_str(), metric.c_str(), value, &unit_str) < 0)
+        return -1;
+    unit = intern_unit(unit_str);
+    return 0;
+}
+
+const char* fty::shm::intern_unit(const std::string& unit)
+{
+    std::lock_guard<std::mutex> lock(units_mutex);
+    return unit_pool.insert(unit).first->c_str();
+}
+
+int fty_shm_cleanup(bool /* verbose */)
+{
+    return storage()->cleanup();
+}
+
+enum CatalogKey { CATALOG_FAMILY, CATALOG_ASSET, CATALOG_TYPE };
+
+// Count the metrics of the family, or of every family if it is "*", by
+// family, asset or type. The file backend counts the names in the indexes
+// of the family directories and their shards, which are only rebuilt when
+// metrics were created or deleted; the other backends are listed
+static int read_catalog(const std::string& family, CatalogKey key, fty::shm::CatalogCounts& counts)
+{
+    std::vector<MetricDir> dirs;
+    int err = 0;
+
+    if (!files_backend()) {
+        return storage()->list(family, [&counts, key](const std::string& metric_family, const char* name) {
+            const char* delim = strchr(name, SEPARATOR);
+            if (!delim)
+                return;
+            if (key == CATALOG_FAMILY)
+                counts[metric_family]++;
+            else if (key == CATALOG_ASSET)
+                counts[delim + SEPARATOR_LEN]++;
+            else
+                counts[std::string(name, delim)]++;
+        });
+    }
+    if (open_query_dirs(family, dirs) < 0)
+        return -1;
+    for (size_t i = 0; i < dirs.size(); i++) {
+        int dfd = dir_fd(dirs, i);
+        std::shared_ptr<const FamilyIndex> index;
+        if (dfd < 0 || !(index = get_family_index(dirs[i].path, dfd, true))) {
+            err = -1;
+            break;
+        }
+        if (key == CATALOG_FAMILY) {
+            counts[dirs[i].path.substr(0, dirs[i].path.find('/'))] += index->by_type.size();
+            continue;
+        }
+        for (const auto& count : key == CATALOG_ASSET ? index->assets : index->types)
+            counts[count.first] += count.second;
+    }
+    close_dirs(dirs);
+    return err;
+}
+
+int fty::shm::list_families(CatalogCounts& families)
+{
+    CatalogCounts counts;
+
+    if (read_catalog("*", CATALOG_FAMILY, counts) < 0)
+        return -1;
+    families.swap(counts);
+    return 0;
+}
+
+int fty::shm::find_assets(const std::string& family, CatalogCounts& assets)
+{
+    CatalogCounts counts;
+
+    if (read_catalog(family, CATALOG_ASSET, counts) < 0)
+        return -1;
+    assets.swap(counts);
+    return 0;
+}
+
+int fty::shm::find_assets(Assets& assets)
+{
+    CatalogCounts counts;
+
+    if (read_catalog("*", CATALOG_ASSET, counts) < 0)
+        return -1;
+    assets.clear();
+    assets.reserve(counts.size());
+    for (const auto& count : counts)
+        assets.push_back(count.first);
+    return 0;
+}
+
+int fty::shm::list_types(const std::string& family, CatalogCounts& types)
+{
+    CatalogCounts counts;
+
+    if (read_catalog(family, CATALOG_TYPE, counts) < 0)
+        return -1;
+    types.swap(counts);
+    return 0;
+}
+
+int fty::shm::read_asset_metrics(const std::string& asset, Metrics& metrics)
+{
+    AssetsMetrics result;
+
+    metrics.clear();
+    if (read_assets_metrics({ asset }, result) < 0)
+        return -1;
+    auto it = result.find(asset);
+    if (it == result.end()) {
+        errno = ENOENT;
+        return -1;
+    }
+    metrics.swap(it->second);
+    return 0;
+}
+
+int fty::shm::read_assets_metrics(const std::unordered_set<std::string>& assets, AssetsMetrics& result)
+{
+    int dfd;
+    DirEntry de;
+    std::string asset;
+    std::vector<MetricDir> dirs;
+
+    result.clear();
+    if (!files_backend()) {
+        // One read per asset where the backend keeps an asset together
+        bool per_asset = true;
+        for (auto it = assets.begin(); per_asset && it != assets.end(); ++it) {
+            Metrics metrics;
+            if (storage()->read_asset(it->c_str(), metrics) < 0) {
+                per_asset = errno != ENOTSUP;
+                continue;
+            }
+            if (!metrics.empty())
+                result[*it].swap(metrics);
+        }
+        if (per_asset)
+            return 0;
+        result.clear();
+        return storage()->list("metric", [&](const std::string&, const char* name) {
+            const char* delim = strchr(name, SEPARATOR);
+            if (!delim || !assets.count(asset.assign(delim + SEPARATOR_LEN)))
+                return;
+            std::string type(name, delim);
+            Metric metric;
+            if (storage()->read_value(asset.c_str(), type.c_str(), metric.value, &metric.unit, NULL) == 0)
+                result[asset].emplace(type, std::move(metric));
+        });
+    }
+    if (open_family("metric", dirs) < 0)
+        return -1;
+
+    std::unique_ptr<DirReader> dir;
+    for (size_t i = 0; i < dirs.size(); i++) {
+        if ((dfd = dir_fd(dirs, i)) < 0)
+            continue;
+        dir.reset(new DirReader(dfd));
+        while (dir->next(de) > 0) {
+            if (!de.delim || !is_file(de))
+                continue;
+            // Reuse the buffer of asset for the lookup
+            asset.assign(de.delim + SEPARATOR_LEN, de.name + de.len);
+            if (!assets.count(asset))
+                continue;
+            Metric metric;
+            if (read_value(dfd, de.name, metric.value, metric.unit) < 0)
+                continue;
+            result[asset].emplace(std::string(de.name, de.delim), std::move(metric));
+        }
+    }
+    close_dirs(dirs);
+    return 0;
+}
+
+int fty::shm::top_k(const Query& query, size_t k, SortOrder order, shmMetrics& result)
+{
+    struct Candidate {
+        double value;
+        // Family or shard of the metric
+        std::string dir;
+        std::string name;
+    };
+    // Used as the "less" of the heap, so the heap top is the worst winner
+    auto better = [order](const Candidate& a, const Candidate& b) {
+        return order == SORT_DESCENDING ? a.value > b.value : a.value < b.value;
+    };
+    std::vector<Candidate> heap;
+
+    if (!k)
+        return 0;
+    heap.reserve(k);
+    int ret = scan_query(query, [&](const char* family, const Source& src, const char* name, size_t) {
+        double value;
+        time_t mtime;
+        if (read_number(src, name, value, mtime) < 0 || value != value)
+            return -1;
+        if (heap.size() == k) {
+            if (!better(Candidate{ value, std::string(), std::string() }, heap.front()))
+                return 0;
+            std::pop_heap(heap.begin(), heap.end(), better);
+            heap.pop_back();
+        }
+        heap.push_back(Candidate{ value, family, name });
+        std::push_heap(heap.begin(), heap.end(), better);
+        return 0;
+    });
+    if (ret < 0)
+        return ret;
+
+    // Materialize the winners, best first. Winners that expired or were
+    // deleted since the scan are skipped
+    std::sort_heap(heap.begin(), heap.end(), better);
+    for (const Candidate& c : heap) {
+        size_t type_len = c.name.find(SEPARATOR);
+        if (!files_backend()) {
+            add_metric(Source(c.dir), c.name.c_str(), type_len, result);
+            continue;
+        }
+        int dfd = open((std::string(shm_dir) + "/" + c.dir).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd < 0)
+            continue;
+        add_metric(dfd, c.name.c_str(), type_len, result);
+        close(dfd);
+    }
+    return 0;
+}
+
+struct fty::shm::Scanner::Impl {
+    Query query;
+    Matcher matcher;
+    // Root directory when iterating over all families
+    int root_fd;
+    std::unique_ptr<DirReader> root;
+    // Family or shard being scanned
+    int dir_fd;
+    std::unique_ptr<DirReader> dir;
+    // Shards of the families opened so far left to scan
+    std::vector<std::string> shards;
+    bool started;
+    int efd;
+    int error;
+
+    Impl(const Query& q)
+        : query(q), root_fd(-1), dir_fd(-1), started(false), efd(-1), error(0)
+    {
+    }
+    bool next_family();
+    void close_family();
+    void close_root();
+};
+
+void fty::shm::Scanner::Impl::close_family()
+{
+    dir.reset();
+    close(dir_fd);
+    dir_fd = -1;
+}
+
+void fty::shm::Scanner::Impl::close_root()
+{
+    root.reset();
+    close(root_fd);
+    root_fd = -1;
+}
+
+// Open the next family or shard to scan. Returns false when there are none
+// left
+bool fty::shm::Scanner::Impl::next_family()
+{
+    DirEntry de;
+    std::string path;
+
+    while (true) {
+        if (!shards.empty()) {
+            path = shards.back();
+            shards.pop_back();
+        } else if (query.family != "*") {
+            if (started)
+                return false;
+            started = true;
+            path = query.family;
+        } else {
+            if (!started) {
+                started = true;
+                if ((root_fd = open(shm_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+                    error = errno;
+                    return false;
+                }
+                root.reset(new DirReader(root_fd));
+            }
+            do {
+                if (!root || root->next(de) <= 0)
+                    return false;
+            } while (!is_family(de));
+            path.assign(de.name, de.len);
+        }
+        std::string dir_path = std::string(shm_dir) + "/" + path;
+        if ((dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            if (path == query.family) {
+                error = errno;
+                return false;
+            }
+            continue;
+        }
+        if (path.find('/') == std::string::npos) {
+            char shard[SHARD_NAME_LEN + 1];
+            unsigned fanout = family_fanout(dir_path);
+            for (unsigned i = 0; i < fanout; i++) {
+                shard_name(i, shard);
+                shards.push_back(path + "/" + shard);
+            }
+        }
+        dir.reset(new DirReader(dir_fd));
+        return true;
+    }
+}
+
+fty::shm::Scanner::Scanner(const Query& query)
+    : m_impl(new Impl(query))
+{
+    if (m_impl->matcher.compile(query) < 0) {
+        m_impl->error = errno;
+        return;
+    }
+    // The eventfd counter stays non-zero, i.e. readable, until the scan
+    // is finished
+    if ((m_impl->efd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        m_impl->error = errno;
+}
+
+fty::shm::Scanner::~Scanner()
+{
+    if (m_impl->dir)
+        m_impl->close_family();
+    if (m_impl->root)
+        m_impl->close_root();
+    if (m_impl->efd >= 0)
+        close(m_impl->efd);
+}
+
+int fty::shm::Scanner::fd() const
+{
+    return m_impl->efd;
+}
+
+bool fty::shm::Scanner::done() const
+{
+    return m_impl->started && !m_impl->dir && !m_impl->root && m_impl->shards.empty();
+}
+
+int fty::shm::Scanner::step(size_t budget, shmMetrics& result)
+{
+    DirEntry de;
+    ssize_t type_len;
+
+    if (m_impl->error) {
+        errno = m_impl->error;
+        return -1;
+    }
+    if (!m_impl->started && !files_backend()) {
+        // Other backends are read in one step, next_family() then finds
+        // nothing left to scan
+        m_impl->started = true;
+        if (read_metrics(m_impl->query, result) < 0)
+            m_impl->error = errno;
+    }
+    while (budget) {
+        if (!m_impl->dir && !m_impl->next_family()) {
+            if (m_impl->root)
+                m_impl->close_root();
+            // Drain the eventfd so that the poller stops reporting it
+            uint64_t counter;
+            if (read(m_impl->efd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+                m_impl->error = errno;
+            if (m_impl->error) {
+                errno = m_impl->error;
+                return -1;
+            }
+            return 0;
+        }
+        if (m_impl->dir->next(de) <= 0) {
+            m_impl->close_family();
+            continue;
+        }
+        --budget;
+        if ((type_len = m_impl->matcher.match(de)) < 0 || !m_impl->matcher.match_aux(m_impl->dir_fd, de.name))
+            continue;
+        add_metric(m_impl->dir_fd, de.name, type_len, result);
+    }
+    return 1;
+}
+
+// Matching entries of one family or shard directory, as of stamp
+struct CachedFamily {
+    CachedFamily(const std::string& name_, unsigned fanout_ = 0)
+        : name(name_), fanout(fanout_), dfd(-1)
+    {
+    }
+    // Relative to the storage directory
+    std::string name;
+    // Shards of a family, as of the last open_families()
+    unsigned fanout;
+    int dfd;
+    DirStamp stamp;
+    std::vector<std::pair<std::string, size_t>> entries;
+};
+
+struct fty::shm::PreparedQuery::Impl {
+    Impl(const Query& q)
+        : query(q), root_fd(-1), scanned(0), error(0)
+    {
+    }
+    ~Impl();
+    int refresh();
+    int refresh_family(CachedFamily& family);
+    int open_families();
+    bool layout_changed();
+    template <typename F>
+    int for_each(F fn);
+
+    Query query;
+    Matcher matcher;
+    // Open storage directory when the query is for all families
+    int root_fd;
+    DirStamp root_stamp;
+    std::vector<CachedFamily> families;
+    // Directory entries read by the last refresh()
+    size_t scanned;
+    // What the last run did
+    QueryPlan plan;
+    int error;
+};
+
+fty::shm::PreparedQuery::Impl::~Impl()
+{
+    for (CachedFamily& family : families)
+        if (family.dfd >= 0)
+            close(family.dfd);
+    if (root_fd >= 0)
+        close(root_fd);
+}
+
+// Re-read the matching entries of the family if it has changed
+int fty::shm::PreparedQuery::Impl::refresh_family(CachedFamily& family)
+{
+    DirEntry de;
+    ssize_t type_len;
+
+    if (family.dfd >= 0 && family.stamp.unchanged(family.dfd))
+        return 0;
+    if (family.dfd >= 0) {
+        struct stat st;
+        // Reopen a family that has been deleted and created again
+        if (fstat(family.dfd, &st) < 0 || !st.st_nlink) {
+            close(family.dfd);
+            family.dfd = -1;
+        }
+    }
+    if (family.dfd < 0) {
+        std::string family_dir = shm_dir;
+        family_dir.append("/");
+        family_dir.append(family.name);
+        if ((family.dfd = open(family_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+            return -1;
+    }
+    family.entries.clear();
+    if (family.stamp.update(family.dfd) < 0)
+        return -1;
+    std::unique_ptr<DirReader> dir(new DirReader(family.dfd));
+    if (dir->rewind() < 0)
+        return -1;
+    while (dir->next(de) > 0) {
+        scanned++;
+        if ((type_len = matcher.match(de)) < 0)
+            continue;
+        family.entries.emplace_back(std::string(de.name, de.len), type_len);
+    }
+    return 0;
+}
+
+// Synchronize the list of families and their shards with the storage
+// directory
+int fty::shm::PreparedQuery::Impl::open_families()
+{
+    DirEntry de;
+    std::vector<std::string> names;
+    std::vector<CachedFamily> current;
+    char shard[SHARD_NAME_LEN + 1];
+
+    if (query.family != "*") {
+        names.push_back(query.family);
+    } else {
+        if (root_stamp.update(root_fd) < 0)
+            return -1;
+        std::unique_ptr<DirReader> dir(new DirReader(root_fd));
+        if (dir->rewind() < 0)
+            return -1;
+        while (dir->next(de) > 0) {
+            if (is_family(de))
+                names.emplace_back(de.name, de.len);
+        }
+    }
+    for (const std::string& name : names) {
+        unsigned fanout = family_fanout(std::string(shm_dir) + "/" + name);
+        current.emplace_back(name, fanout);
+        for (unsigned i = 0; i < fanout; i++) {
+            shard_name(i, shard);
+            current.emplace_back(name + "/" + shard);
+        }
+    }
+    // Keep the cache of families and shards that still exist
+    for (CachedFamily& entry : current) {
+        for (CachedFamily& family : families) {
+            if (family.name == entry.name) {
+                std::swap(entry.dfd, family.dfd);
+                std::swap(entry.stamp, family.stamp);
+                std::swap(entry.entries, family.entries);
+                break;
+            }
+        }
+    }
+    families.swap(current);
+    for (CachedFamily& family : current)
+        if (family.dfd >= 0)
+            close(family.dfd);
+    return 0;
+}
+
+// True if a family has been sharded since the last open_families()
+bool fty::shm::PreparedQuery::Impl::layout_changed()
+{
+    for (const CachedFamily& family : families) {
+        if (family.name.find('/') == std::string::npos &&
+                family_fanout(std::string(shm_dir) + "/" + family.name) != family.fanout)
+            return true;
+    }
+    return false;
+}
+
+int fty::shm::PreparedQuery::Impl::refresh()
+{
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    if (query.family != "*") {
+        if ((families.empty() || layout_changed()) && open_families() < 0)
+            return -1;
+        if (refresh_family(families.front()) < 0)
+            return -1;
+        for (size_t i = 1; i < families.size(); i++)
+            refresh_family(families[i]);
+        return 0;
+    }
+    if (root_fd < 0 && (root_fd = open(shm_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+    if ((!root_stamp.unchanged(root_fd) || layout_changed()) && open_families() < 0)
+        return -1;
+    for (CachedFamily& family : families)
+        // Not every entry of the storage directory has to be a family
+        refresh_family(family);
+    return 0;
+}
+
+template <typename F>
+int fty::shm::PreparedQuery::Impl::for_each(F fn)
+{
+    struct timespec start, end;
+
+    if (!files_backend()) {
+        // There are no directories to cache with the other backends
+        if (error) {
+            errno = error;
+            return -1;
+        }
+        return run_query(query, plan, [&fn](const char*, const Source& src, const char* name, size_t type_len) {
+            return fn(src, name, type_len);
+        });
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Expect one fstat() per family and a read of every cached entry
+    plan.estimated_cost = families.size();
+    for (const CachedFamily& family : families)
+        plan.estimated_cost += family.entries.size();
+    plan.rows = 0;
+    scanned = 0;
+    if (refresh() < 0)
+        return -1;
+    plan.path = scanned ? QueryPlan::SCAN : QueryPlan::CACHED;
+    plan.actual_cost = families.size() + scanned;
+    for (CachedFamily& family : families) {
+        if (family.dfd < 0)
+            continue;
+        for (const auto& entry : family.entries) {
+            // The aux attributes can change without the directory changing
+            if (matcher.match_aux(family.dfd, entry.first.c_str()) && fn(family.dfd, entry.first.c_str(), entry.second) == 0)
+                plan.rows++;
+        }
+        plan.actual_cost += family.entries.size();
+    }
+    plan.description = std::string(scanned ? "rescan and read" : "read") + " of " +
+        std::to_string(plan.actual_cost - families.size() - scanned) + " cached entries in " +
+        std::to_string(families.size()) + " famil" + (families.size() == 1 ? "y" : "ies");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    plan.elapsed_ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    return 0;
+}
+
+fty::shm::PreparedQuery::PreparedQuery(const Query& query)
+    : m_impl(new Impl(query))
+{
+    if (m_impl->matcher.compile(query) < 0)
+        m_impl->error = errno;
+}
+
+fty::shm::PreparedQuery::~PreparedQuery()
+{
+}
+
+int fty::shm::PreparedQuery::read_metrics(shmMetrics& result)
+{
+    return m_impl->for_each([&result](const Source& src, const char* name, size_t type_len) {
+        return add_metric(src, name, type_len, result);
+    });
+}
+
+int fty::shm::PreparedQuery::explain(QueryPlan& plan)
+{
+    shmMetrics result;
+    if (read_metrics(result) < 0)
+        return -1;
+    plan = m_impl->plan;
+    return 0;
+}
+
+int fty::shm::PreparedQuery::read_metrics_columnar(ColumnarResult& result)
+{
+    result.clear_rows();
+    return m_impl->for_each([&result](const Source& src, const char* name, size_t type_len) {
+        return add_number(src, name, type_len, result);
+    });
+}
+
+int fty::shm::PreparedQuery::aggregate(Aggregate& result)
+{
+    result = Aggregate();
+    return m_impl->for_each([&result](const Source& src, const char* name, size_t type_len) {
+        return add_number(src, name, type_len, result);
+    });
+}
+
+// A write queued by a WriteBehind
+struct QueuedWrite {
+    QueuedWrite* next;
+    // <type>@<asset>, to coalesce the writes of a metric
+    std::string key;
+    std::string asset;
+    std::string metric;
+    std::string value;
+    std::string unit;
+    int ttl;
+    int64_t queued_ns;
+};
+
+// The queue is a lock-free stack that flush() takes as a whole. Flushes
+// are serialized by flush_mutex, the thread waits on wake_mutex
+struct fty::shm::WriteBehind::Impl {
+    Impl(unsigned max_delay_ms_)
+        : head(NULL), depth(0), queued(0), written(0), coalesced(0), failed(0), lag_ns(0), max_lag_ns(0),
+          max_delay_ms(max_delay_ms_), stopping(false)
+    {
+    }
+    int flush();
+    void run();
+
+    std::atomic<QueuedWrite*> head;
+    std::atomic<size_t> depth;
+    std::atomic<uint64_t> queued;
+    std::atomic<uint64_t> written;
+    std::atomic<uint64_t> coalesced;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> lag_ns;
+    std::atomic<uint64_t> max_lag_ns;
+    unsigned max_delay_ms;
+    std::mutex flush_mutex;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread thread;
+};
+
+int fty::shm::WriteBehind::Impl::flush()
+{
+    std::lock_guard<std::mutex> lock(flush_mutex);
+    QueuedWrite* queue = head.exchange(NULL, std::memory_order_acquire);
+    std::vector<QueuedWrite*> batch;
+    std::unordered_map<std::string, size_t> positions;
+    size_t count = 0;
+    int err = 0;
+
+    // The stack has the last write first, keep the first write of every
+    // metric met. The writes are flushed from the oldest
+    for (QueuedWrite* next; queue; queue = next, count++) {
+        next = queue->next;
+        if (positions.emplace(queue->key, batch.size()).second) {
+            batch.push_back(queue);
+        } else {
+            delete queue;
+            coalesced.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    if (batch.empty())
+        return 0;
+    int64_t oldest = batch.back()->queued_ns;
+    for (auto it = batch.rbegin(); it != batch.rend(); ++it) {
+        QueuedWrite* write = *it;
+        if (fty::shm::write_metric(write->asset, write->metric, write->value, write->unit, write->ttl) < 0) {
+            err = errno;
+            failed.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            written.fetch_add(1, std::memory_order_relaxed);
+        }
+        delete write;
+    }
+    uint64_t lag = now_ns() - oldest;
+    lag_ns.store(lag, std::memory_order_relaxed);
+    if (lag > max_lag_ns.load(std::memory_order_relaxed))
+        max_lag_ns.store(lag, std::memory_order_relaxed);
+    depth.fetch_sub(count, std::memory_order_relaxed);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void fty::shm::WriteBehind::Impl::run()
+{
+    std::unique_lock<std::mutex> lock(wake_mutex);
+    while (!stopping) {
+        wake.wait_for(lock, std::chrono::milliseconds(max_delay_ms));
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+}
+
+fty::shm::WriteBehind::WriteBehind(unsigned max_delay_ms)
+    : m_impl(new Impl(max_delay_ms))
+{
+    // Without a thread, the writes are flushed by write_metric()
+    try {
+        m_impl->thread = std::thread(&Impl::run, m_impl.get());
+    } catch (const std::system_error&) {
+    }
+}
+
+fty::shm::WriteBehind::~WriteBehind()
+{
+    if (m_impl->thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_impl->wake_mutex);
+            m_impl->stopping = true;
+        }
+        m_impl->wake.notify_one();
+        m_impl->thread.join();
+    }
+    m_impl->flush();
+}
+
+int fty::shm::WriteBehind::write_metric(const std::string& asset, const std::string& metric,
+    const std::string& value, const std::string& unit, int ttl)
+{
+    // Reject what write_value() would
+    if (check_names(asset.c_str(), asset.size(), metric.c_str(), metric.size()) < 0)
+        return -1;
+    if (value.size() > VALUE_MAX_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+    QueuedWrite* write = new QueuedWrite;
+    write->key.assign(metric).append(1, SEPARATOR).append(asset);
+    write->asset = asset;
+    write->metric = metric;
+    write->value = value;
+    write->unit = unit;
+    write->ttl = ttl;
+    write->queued_ns = now_ns();
+    // Counted first, flush() could take it right away
+    m_impl->depth.fetch_add(1, std::memory_order_relaxed);
+    m_impl->queued.fetch_add(1, std::memory_order_relaxed);
+    write->next = m_impl->head.load(std::memory_order_relaxed);
+    while (!m_impl->head.compare_exchange_weak(write->next, write, std::memory_order_release,
+            std::memory_order_relaxed))
+        ;
+    if (!m_impl->thread.joinable())
+        return m_impl->flush();
+    return 0;
+}
+
+int fty::shm::WriteBehind::flush()
+{
+    return m_impl->flush();
+}
+
+fty::shm::WriteBehindStats fty::shm::WriteBehind::stats() const
+{
+    WriteBehindStats stats;
+    stats.depth = m_impl->depth.load(std::memory_order_relaxed);
+    stats.queued = m_impl->queued.load(std::memory_order_relaxed);
+    stats.written = m_impl->written.load(std::memory_order_relaxed);
+    stats.coalesced = m_impl->coalesced.load(std::memory_order_relaxed);
+    stats.failed = m_impl->failed.load(std::memory_order_relaxed);
+    stats.lag_ns = m_impl->lag_ns.load(std::memory_order_relaxed);
+    stats.max_lag_ns = m_impl->max_lag_ns.load(std::memory_order_relaxed);
+    return stats;
+}
+
+// The snapshot of a SnapshotPublisher is a header, the records of the
+// metrics, sorted by family, type and asset, and a pool of the
+// NUL-terminated strings they point to. Generations are written to a new
+// file renamed over the previous one
+#define SNAPSHOT_FILE ".snapshot"
+#define SNAPSHOT_MAGIC 0x3130706e73797466ULL
+
+struct SnapshotHeader {
+    uint64_t magic;
+    uint64_t generation;
+    uint32_t count;
+    uint32_t pool_size;
+};
+
+struct SnapshotRecord {
+    // Offsets in the pool
+    uint32_t family;
+    uint32_t type;
+    uint32_t asset;
+    uint32_t value;
+    uint32_t unit;
+    uint32_t aux;
+    uint32_t aux_count;
+    int32_t ttl;
+    int64_t time;
+};
+
+// A metric as last read by the publisher
+struct SnapshotItem {
+    std::string value;
+    std::string unit;
+    int ttl;
+    int64_t time;
+    // Keys and values of the aux attributes, alternately
+    std::vector<std::string> aux;
+};
+
+struct fty::shm::SnapshotPublisher::Impl {
+    Impl()
+        : inotify_fd(-1), generation(0), rescan(true)
+    {
+    }
+    ~Impl()
+    {
+        if (inotify_fd >= 0)
+            close(inotify_fd);
+    }
+    void watch(const std::string& dir);
+    void read_events();
+    void update(const std::string& dir, const std::string& name);
+    int write();
+
+    int inotify_fd;
+    // Watched family and shard directories, relative to the storage
+    // directory, by watch descriptor
+    std::unordered_map<int, std::string> dirs;
+    // Metrics to re-read, by directory and name
+    std::set<std::pair<std::string, std::string>> dirty;
+    // Keyed by family, type and asset separated by NULs, which sorts them
+    std::map<std::string, SnapshotItem> items;
+    uint64_t generation;
+    bool rescan;
+};
+
+#define SNAPSHOT_DIR_EVENTS (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+// IN_ATTRIB is all a suppressed write does
+#define SNAPSHOT_FAMILY_EVENTS \
+    (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR)
+
+// Watch a family or shard directory and mark all its metrics dirty
+void fty::shm::SnapshotPublisher::Impl::watch(const std::string& dir)
 {
-    DIR* dir;
+    std::string path = std::string(shm_dir) + "/" + dir;
     struct dirent* de;
-    int err = 0;
+    DIR* d;
+    int wd;
 
-    if (!(dir = opendir(shm_dir)))
-        return -1;
-
-    while ((de = readdir(dir))) {
-        const char* delim = strchr(de->d_name, ':');
-        if (!delim)
-            // Malformed filename
-            continue;
-        size_t asset_len = delim - de->d_name;
-        if (std::string(de->d_name, asset_len) != asset)
+    // The directory can be gone already
+    if ((wd = inotify_add_watch(inotify_fd, path.c_str(), SNAPSHOT_FAMILY_EVENTS)) < 0)
+        return;
+    dirs[wd] = dir;
+    if (!(d = opendir(path.c_str())))
+        return;
+    while ((de = readdir(d))) {
+        struct stat st;
+        if (de->d_name[0] == '.')
             continue;
-        char filename[PATH_MAX];
-        sprintf(filename, "%s/%s", shm_dir, de->d_name);
-        if (unlink(filename) < 0)
-            err = -1;
+        bool is_dir = de->d_type == DT_DIR ||
+            (de->d_type == DT_UNKNOWN && fstatat(dirfd(d), de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+        if (is_dir && dir.find('/') == std::string::npos)
+            watch(dir + "/" + de->d_name);
+        else if (!is_dir && strchr(de->d_name, SEPARATOR))
+            dirty.emplace(dir, de->d_name);
     }
-    closedir(dir);
-    return err;
+    closedir(d);
 }
 
-
-int fty_shm_read_family(const char* family, std::string asset, std::string type, fty::shm::shmMetrics& result)
+void fty::shm::SnapshotPublisher::Impl::read_events()
 {
-  char* working_dir = (char*) malloc(250);
-  getcwd(working_dir, 250);
-  std::string family_dir = shm_dir;
-  family_dir.append("/");
-  family_dir.append(family);
-  DIR* dir;
-  if(!(dir = opendir(family_dir.c_str())))
-    return -1;
-  chdir(family_dir.c_str());
-  //fchdir(dirfd(dir));
-  struct dirent* de;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
 
-  try {
-
-    std::regex regType(type);
-    std::regex regAsset(asset);
-    int dixfois = 0;
-    std::cout << std::endl;
-    while ((de = readdir(dir))) {
-      const char* delim = strchr(de->d_name, SEPARATOR);
-      //If not a valid metric
-      if(!delim)
-        continue;
-      size_t type_name = delim - de->d_name;
-      if(std::regex_match(std::string(delim+1), regAsset) && std::regex_match(std::string(de->d_name, type_name), regType)) {
-        fty_proto_t *proto_metric = fty_proto_new(FTY_PROTO_METRIC);
-        if(read_data_metric(de->d_name, proto_metric) == 0) {
-          fty_proto_set_name(proto_metric, "%s", std::string(delim+1).c_str());
-          fty_proto_set_type(proto_metric, "%s", std::string(de->d_name, type_name).c_str());
-          result.add(proto_metric);
-        } else {
-          fty_proto_destroy(&proto_metric);
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + reinterpret_cast<struct inotify_event*>(p)->len) {
+            const struct inotify_event* event = reinterpret_cast<struct inotify_event*>(p);
+            if (event->mask & IN_Q_OVERFLOW) {
+                rescan = true;
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                dirs.erase(event->wd);
+                continue;
+            }
+            auto it = dirs.find(event->wd);
+            if (!event->len || event->name[0] == '.')
+                continue;
+            if (it == dirs.end()) {
+                // The storage directory, where new families appear
+                if (event->mask & IN_ISDIR)
+                    watch(event->name);
+            } else if (event->mask & IN_ISDIR) {
+                if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && it->second.find('/') == std::string::npos)
+                    watch(it->second + "/" + event->name);
+            } else if (strchr(event->name, SEPARATOR) && !(event->mask & IN_CREATE)) {
+                // A new file is read when it has been written
+                dirty.emplace(it->second, event->name);
+            }
         }
-      }
     }
-  } catch(const std::regex_error& e) {
-    chdir(working_dir);
-    return -1;
-  }
-  chdir(working_dir);
-  return 0;
 }
 
-int fty::shm::read_metrics(const std::string& family, const std::string& asset, const std::string& type, shmMetrics& result)
+// Re-read the metric name of the family or shard directory dir
+void fty::shm::SnapshotPublisher::Impl::update(const std::string& dir, const std::string& name)
 {
-  DIR* dir;
-  if(family == "*") {
-    struct dirent *de_root;
-    if (!(dir = opendir(shm_dir)))
-        return -1;
-    int dfd_root = dirfd(dir);
-    while ((de_root = readdir(dir))) {
-      fty_shm_read_family(de_root->d_name, asset, type, result);
+    std::string key = dir.substr(0, dir.find('/'));
+    size_t delim = name.find(SEPARATOR);
+    key.append(1, '\0').append(name, 0, delim).append(1, '\0').append(name, delim + SEPARATOR_LEN, std::string::npos);
+    fty_proto_t* proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+    if (storage()->read_data_metric(dir, name.c_str(), proto_metric, NULL) < 0) {
+        items.erase(key);
+        fty_proto_destroy(&proto_metric);
+        return;
     }
-  }
-  else {
-    fty_shm_read_family(family.c_str(), asset, type, result);
-  }
+    SnapshotItem& item = items[key];
+    const char* value = fty_proto_value(proto_metric);
+    const char* unit = fty_proto_unit(proto_metric);
+    item.value = value ? value : "";
+    item.unit = unit ? unit : "";
+    item.ttl = fty_proto_ttl(proto_metric);
+    item.time = fty_proto_time(proto_metric);
+    item.aux.clear();
+    zhash_t* aux = fty_proto_aux(proto_metric);
+    if (aux) {
+        for (char* aux_value = (char*) zhash_first(aux); aux_value; aux_value = (char*) zhash_next(aux)) {
+            item.aux.push_back(zhash_cursor(aux));
+            item.aux.push_back(aux_value);
+        }
+    }
+    fty_proto_destroy(&proto_metric);
 }
 
-int fty_shm_set_test_dir(const char* dir)
+// Write the items as the next generation of the snapshot
+int fty::shm::SnapshotPublisher::Impl::write()
 {
-    if (strlen(dir) > PATH_MAX - strlen("/") - NAME_MAX) {
-        errno = ENAMETOOLONG;
+    std::unordered_map<std::string, uint32_t> interned;
+    std::vector<SnapshotRecord> records;
+    std::string pool;
+    SnapshotHeader header;
+    int fd;
+
+    // Families, types and units repeat, the rest is mostly unique
+    auto add = [&pool](const char* str, size_t len) {
+        uint32_t offset = pool.size();
+        pool.append(str, len).append(1, '\0');
+        return offset;
+    };
+    auto intern = [&](const std::string& str) {
+        auto it = interned.find(str);
+        if (it != interned.end())
+            return it->second;
+        uint32_t offset = add(str.data(), str.size());
+        interned.emplace(str, offset);
+        return offset;
+    };
+    records.reserve(items.size());
+    for (const auto& item : items) {
+        const std::string& key = item.first;
+        size_t type_end = key.find('\0', key.find('\0') + 1);
+        SnapshotRecord record;
+        record.family = intern(key.substr(0, key.find('\0')));
+        record.type = intern(key.substr(key.find('\0') + 1, type_end - key.find('\0') - 1));
+        record.asset = add(key.data() + type_end + 1, key.size() - type_end - 1);
+        record.value = add(item.second.value.data(), item.second.value.size());
+        record.unit = intern(item.second.unit);
+        record.aux = pool.size();
+        record.aux_count = item.second.aux.size() / 2;
+        // Readers walk the keys and values of a record in a row, so the
+        // keys are not interned
+        for (const std::string& str : item.second.aux)
+            add(str.data(), str.size());
+        record.ttl = item.second.ttl;
+        record.time = item.second.time;
+        records.push_back(record);
+    }
+    if (pool.size() > std::numeric_limits<uint32_t>::max()) {
+        errno = EFBIG;
         return -1;
     }
-    shm_dir = dir;
-    shm_dir_len = strlen(dir);
+    header.magic = SNAPSHOT_MAGIC;
+    header.generation = generation + 1;
+    header.count = records.size();
+    header.pool_size = pool.size();
+
+    std::string path = std::string(shm_dir) + "/" SNAPSHOT_FILE;
+    std::string tmp_path = path + "." + std::to_string(getpid());
+    if ((fd = open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666)) < 0)
+        return -1;
+    struct iovec iov[3] = {
+        { &header, sizeof(header) },
+        { records.data(), records.size() * sizeof(SnapshotRecord) },
+        { &pool[0], pool.size() }
+    };
+    size_t total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    ssize_t written = writev(fd, iov, 3);
+    if (close(fd) < 0 || written != ssize_t(total) || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        if (written >= 0 && written != ssize_t(total))
+            errno = EIO;
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    generation = header.generation;
     return 0;
 }
 
-// renameat2() is unfortunately Linux-specific and glibc does not even
-// provide a wrapper
-static int rename_noreplace(int dfd, const char* src, const char* dst)
+fty::shm::SnapshotPublisher::SnapshotPublisher()
+    : m_impl(new Impl)
 {
-    return syscall(SYS_renameat2, dfd, src, dfd, dst, RENAME_NOREPLACE);
+    SnapshotHeader header;
+    std::string path = std::string(shm_dir) + "/" SNAPSHOT_FILE;
+    int fd;
+
+    // Keep counting the generations of a previous publisher
+    if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) >= 0) {
+        if (pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == SNAPSHOT_MAGIC)
+            m_impl->generation = header.generation;
+        close(fd);
+    }
+    if (files_backend())
+        m_impl->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 }
 
-int fty_shm_cleanup(bool verbose)
+fty::shm::SnapshotPublisher::~SnapshotPublisher()
 {
-    DIR* dir;
-    DIR* dir_child;
-    int dfd_root, dfd;
-    struct dirent *de, *de_root;
-    int err = 0;
-    std::string shm_subdir;
+}
 
-    if (!(dir = opendir(shm_dir)))
-        return -1;
-    dfd_root = dirfd(dir);
+int fty::shm::SnapshotPublisher::fd() const
+{
+    return m_impl->inotify_fd;
+}
 
-    while ((de_root = readdir(dir))) {
-      shm_subdir = shm_dir;
-      shm_subdir.append("/");
-      shm_subdir.append(de_root->d_name);
-      if(!(dir_child = opendir(shm_subdir.c_str())))
-        continue;
-      dfd = dirfd(dir_child);
-      while ((de = readdir(dir_child))) {
-          int fd;
-          time_t now, ttl;
-          struct stat st1, st2;
-          size_t len = strlen(de->d_name);
-          char ttl_str[TTL_LEN];
-
-          if ((fd = openat(dfd, de->d_name, O_RDONLY | O_CLOEXEC)) < 0) {
-              err = -1;
-              continue;
-          }
-          if (fstat(fd, &st1) < 0) {
-              err = -1;
-              close(fd);
-              continue;
-          }
-          if (st1.st_size < HEADER_LEN) {
-              // Malformed file
-              close(fd);
-              continue;
-          }
-          if (read_buf(fd, ttl_str, TTL_LEN) < 0) {
-              err = -1;
-              close(fd);
-              continue;
-          }
-          close(fd);
-          if (parse_ttl(ttl_str, ttl) < 0) {
-              err = -1;
-              continue;
-          }
-          if (!ttl)
-              continue;
-          now = time(NULL);
-          // We wait for two times the ttl value before deleting the entry
-          if ((now - st1.st_mtime) / 2 <= ttl)
-              continue;
-          // We can race here, but that is not considered a problem. A
-          // metric not updated for twice the ttl time is already a bug
-          // and the effect of the race is following:
-          // 1. Metric expires
-          // 2. We check that another ttl seconds have passed
-          // 3. Metric gets updated
-          // 4. We erroneously delete the updated metric
-          // 5. We restore the updated metric
-          // i.e. the updated metric disappears briefly between 4. and 5.,
-          // while it had been gone for ttl seconds between 1. and 3.
-          if (renameat(dfd, de->d_name, dfd, ".delete") < 0) {
-              err = -1;
-              continue;
-          }
-          if (fstatat(dfd, ".delete", &st2, 0) < 0) {
-              // This should not happen
-              err = -1;
-              continue;
-          }
-          if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
-              if (unlinkat(dfd, ".delete", 0) < 0)
-                  err = -1;
-              continue;
-          }
-          // We lost the race. Restore the metric, but only if it has not
-          // been updated for the second time.
-          if (rename_noreplace(dfd, ".delete", de->d_name) < 0) {
-              unlinkat(dfd, ".delete", 0);
-              err = -1;
-          }
-      }
-      closedir(dir_child);
-    }
-    closedir(dir);
-    return err;
+uint64_t fty::shm::SnapshotPublisher::generation() const
+{
+    return m_impl->generation;
 }
 
-// Write ttl and value to filename
-static int write_metric_data(const char* filename, fty_proto_t* metric)
+int fty::shm::SnapshotPublisher::publish()
 {
-    FILE* file = fopen(filename, "w");
-    if(file == NULL)
-      return -1;
-    int ttl = fty_proto_ttl(metric);
-    if (ttl < 0)
-        ttl = 0;
-    fprintf(file, "%d\n%s\n%s", ttl, fty_proto_unit(metric), fty_proto_value(metric));
-    zhash_t *aux = fty_proto_aux(metric);
+    Impl& impl = *m_impl;
+    bool changed = impl.rescan;
 
-    if (aux) {
-      char *item = (char *) zhash_first (aux);
-      while (item) {
-          fprintf (file, "\n%s\n%s", zhash_cursor (aux), item);
-          item = (char *) zhash_next (aux);
-      }
+    if (impl.inotify_fd >= 0)
+        impl.read_events();
+    if (impl.rescan || impl.inotify_fd < 0) {
+        changed = true;
+        impl.items.clear();
+        impl.dirty.clear();
+        if (impl.inotify_fd < 0) {
+            storage()->list("*", [&impl](const std::string& family, const char* name) {
+                impl.dirty.emplace(family, name);
+            });
+        } else {
+            // Watch before scanning, so that no change is missed
+            struct dirent* de;
+            DIR* dir;
+            if (inotify_add_watch(impl.inotify_fd, shm_dir, SNAPSHOT_DIR_EVENTS) < 0 || !(dir = opendir(shm_dir)))
+                return -1;
+            while ((de = readdir(dir))) {
+                if (de->d_name[0] != '.' && de->d_type != DT_REG)
+                    impl.watch(de->d_name);
+            }
+            closedir(dir);
+        }
+        impl.rescan = false;
     }
-    if(fclose(file) < 0)
-      return -1;
-
-    return 0;
+    changed |= !impl.dirty.empty();
+    for (const auto& metric : impl.dirty)
+        impl.update(metric.first, metric.second);
+    impl.dirty.clear();
+    time_t now = time(NULL);
+    for (auto it = impl.items.begin(); it != impl.items.end();) {
+        if (it->second.ttl && now - it->second.time > it->second.ttl) {
+            it = impl.items.erase(it);
+            changed = true;
+        } else {
+            ++it;
+        }
+    }
+    if (!changed)
+        return 0;
+    return impl.write();
 }
 
+struct fty::shm::Snapshot::Impl {
+    Impl()
+        : base(NULL), length(0), dev(0), ino(0), header(NULL), records(NULL), pool(NULL)
+    {
+    }
+    ~Impl()
+    {
+        if (base)
+            munmap(base, length);
+    }
+    fty::shm::SnapshotMetric metric(const SnapshotRecord& record) const;
+    bool expired(const SnapshotRecord& record, time_t now) const
+    {
+        return record.ttl && now - record.time > record.ttl;
+    }
 
-int fty::shm::write_metric(fty_proto_t* metric)
+    void* base;
+    size_t length;
+    dev_t dev;
+    ino_t ino;
+    const SnapshotHeader* header;
+    const SnapshotRecord* records;
+    const char* pool;
+};
+
+fty::shm::SnapshotMetric fty::shm::Snapshot::Impl::metric(const SnapshotRecord& record) const
 {
-    char filename[PATH_MAX];
+    SnapshotMetric metric;
+    metric.family = pool + record.family;
+    metric.type = pool + record.type;
+    metric.asset = pool + record.asset;
+    metric.value = pool + record.value;
+    metric.unit = pool + record.unit;
+    metric.aux = pool + record.aux;
+    metric.aux_count = record.aux_count;
+    metric.ttl = record.ttl;
+    metric.time = record.time;
+    return metric;
+}
 
-    if (prepare_filename(filename, fty_proto_name(metric), strlen(fty_proto_name(metric)), fty_proto_type(metric), strlen(fty_proto_type(metric))) < 0)
-        return -1;
-    return write_metric_data(filename, metric);
+// Check that all the strings of a snapshot mapped at base are in its pool
+static bool valid_snapshot(const void* base, size_t length)
+{
+    const SnapshotHeader* header = static_cast<const SnapshotHeader*>(base);
+
+    if (length < sizeof(SnapshotHeader) || header->magic != SNAPSHOT_MAGIC || !header->pool_size ||
+            (length - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord) < header->count ||
+            length - sizeof(SnapshotHeader) - header->count * sizeof(SnapshotRecord) != header->pool_size)
+        return false;
+    const SnapshotRecord* records = reinterpret_cast<const SnapshotRecord*>(header + 1);
+    const char* pool = reinterpret_cast<const char*>(records + header->count);
+    uint32_t size = header->pool_size;
+    if (pool[size - 1])
+        return false;
+    for (uint32_t i = 0; i < header->count; i++) {
+        const SnapshotRecord& record = records[i];
+        if (record.family >= size || record.type >= size || record.asset >= size || record.value >= size ||
+                record.unit >= size || record.aux > size)
+            return false;
+        uint32_t offset = record.aux;
+        for (uint32_t j = 0; j < 2 * record.aux_count; j++) {
+            if (offset >= size)
+                return false;
+            offset += strlen(pool + offset) + 1;
+        }
+    }
+    return true;
 }
 
-int fty::shm::write_metric(const std::string& asset, const std::string& metric, const std::string& value, const std::string& unit, int ttl)
+fty::shm::Snapshot::Snapshot()
+    : m_impl(new Impl)
 {
-    char filename[PATH_MAX];
-    std::string dummy;
+}
 
-    if (prepare_filename(filename, asset.c_str(), asset.length(), metric.c_str(), metric.length()) < 0)
-        return -1;
-    return write_value(filename, value.c_str(), unit.c_str(), ttl);
+fty::shm::Snapshot::~Snapshot()
+{
 }
 
-int fty::shm::read_metric(const std::string& asset, const std::string& metric, std::string& value)
+int fty::shm::Snapshot::refresh()
 {
-    char filename[PATH_MAX];
-    std::string dummy;
+    std::string path = std::string(shm_dir) + "/" SNAPSHOT_FILE;
+    struct stat st;
+    void* base;
+    int fd;
 
-    if (prepare_filename(filename, asset.c_str(), asset.length(), metric.c_str(), metric.length()) < 0)
+    if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    // Generations are never written in place
+    if (m_impl->base && st.st_dev == m_impl->dev && st.st_ino == m_impl->ino) {
+        close(fd);
+        return 0;
+    }
+    base = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+        if (!st.st_size)
+            errno = EINVAL;
+        return -1;
+    }
+    if (!valid_snapshot(base, st.st_size)) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
         return -1;
-    return read_value(filename, value, dummy, false);
+    }
+    if (m_impl->base)
+        munmap(m_impl->base, m_impl->length);
+    m_impl->base = base;
+    m_impl->length = st.st_size;
+    m_impl->dev = st.st_dev;
+    m_impl->ino = st.st_ino;
+    m_impl->header = static_cast<const SnapshotHeader*>(base);
+    m_impl->records = reinterpret_cast<const SnapshotRecord*>(m_impl->header + 1);
+    m_impl->pool = reinterpret_cast<const char*>(m_impl->records + m_impl->header->count);
+    return 1;
 }
 
-int fty::shm::read_metric(const std::string& asset, const std::string& metric, std::string& value, std::string& unit)
+uint64_t fty::shm::Snapshot::generation() const
 {
-    char filename[PATH_MAX];
+    return m_impl->header ? m_impl->header->generation : 0;
+}
 
-    if (prepare_filename(filename, asset.c_str(), asset.length(), metric.c_str(), metric.length()) < 0)
-        return -1;
-    return read_value(filename, value, unit);
+size_t fty::shm::Snapshot::size() const
+{
+    return m_impl->header ? m_impl->header->count : 0;
 }
 
-/*int fty::shm::find_assets(Assets& assets)
+fty::shm::SnapshotMetric fty::shm::Snapshot::at(size_t i) const
 {
-    DIR* dir;
-    struct dirent* de;
-    std::unordered_set<std::string> seen;
+    return m_impl->metric(m_impl->records[i]);
+}
 
-    if (!(dir = opendir(shm_dir)))
-        return -1;
+bool fty::shm::Snapshot::find(const std::string& family, const std::string& asset, const std::string& type,
+    SnapshotMetric& metric) const
+{
+    const SnapshotRecord* begin = m_impl->records;
+    const SnapshotRecord* end = begin + size();
+    const char* pool = m_impl->pool;
 
-    // TODO: Remember the number of items from last time and reserve it
-    assets.clear();
-    while ((de = readdir(dir))) {
-        char* delim = strchr(de->d_name, ':');
-        if (!delim)
-            // Malformed filename
-            continue;
-        *delim = '\0';
-        if (!seen.insert(de->d_name).second)
-            continue;
-        assets.push_back(de->d_name);
-    }
-    closedir(dir);
-    return 0;
-}*/
+    if (!m_impl->header)
+        return false;
+    auto less = [&](const SnapshotRecord& record) {
+        int cmp = strcmp(pool + record.family, family.c_str());
+        if (!cmp)
+            cmp = strcmp(pool + record.type, type.c_str());
+        if (!cmp)
+            cmp = strcmp(pool + record.asset, asset.c_str());
+        return cmp;
+    };
+    const SnapshotRecord* found = std::lower_bound(begin, end, 0, [&less](const SnapshotRecord& record, int) {
+        return less(record) < 0;
+    });
+    if (found == end || less(*found) || m_impl->expired(*found, time(NULL)))
+        return false;
+    metric = m_impl->metric(*found);
+    return true;
+}
 
-int fty::shm::read_asset_metrics(const std::string& asset, Metrics& metrics)
+int fty::shm::Snapshot::read_metrics(const Query& query, shmMetrics& result) const
 {
-    DIR* dir;
-    struct dirent* de;
-    int err = -1;
+    Matcher matcher;
+    time_t now = time(NULL);
 
-    std::string shm_dirmetrics = shm_dir;
-    shm_dirmetrics.append("/");
-    shm_dirmetrics.append("metric");
-    if (!(dir = opendir(shm_dirmetrics.c_str())))
+    if (!m_impl->header) {
+        errno = ENOENT;
         return -1;
-
-    metrics.clear();
-    while ((de = readdir(dir))) {
-        const char* delim = strchr(de->d_name, SEPARATOR);
-        size_t len = strlen(de->d_name);
-        size_t metric_len = delim - de->d_name;
-        if (std::string(delim+1) != asset)
+    }
+    if (matcher.compile(query) < 0)
+        return -1;
+    for (size_t i = 0; i < size(); i++) {
+        const SnapshotRecord& record = m_impl->records[i];
+        SnapshotMetric metric = m_impl->metric(record);
+        if ((query.family != "*" && query.family != metric.family) || m_impl->expired(record, now) ||
+                !matcher.type.match(metric.type, metric.type + strlen(metric.type)) ||
+                !matcher.asset.match(metric.asset, metric.asset + strlen(metric.asset)))
             continue;
-        Metric metric;
-        char filename[PATH_MAX];
-        sprintf(filename, "%s/%s", shm_dirmetrics.c_str(), de->d_name);
-        if (read_value(filename, metric.value, metric.unit) < 0)
+        bool aux_match = !matcher.has_aux;
+        const char* aux = metric.aux;
+        for (uint32_t j = 0; j < metric.aux_count; j++) {
+            const char* aux_value = aux + strlen(aux) + 1;
+            aux_match |= matcher.aux_key == aux && matcher.aux_value == aux_value;
+            aux = aux_value + strlen(aux_value) + 1;
+        }
+        if (!aux_match)
             continue;
-        err = 0;
-        metrics.emplace(std::string(delim + 1, metric_len), metric);
+        fty_proto_t* proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+        fty_proto_set_name(proto_metric, "%s", metric.asset);
+        fty_proto_set_type(proto_metric, "%s", metric.type);
+        fty_proto_set_value(proto_metric, "%s", metric.value);
+        fty_proto_set_unit(proto_metric, "%s", metric.unit);
+        fty_proto_set_ttl(proto_metric, metric.ttl);
+        fty_proto_set_time(proto_metric, metric.time);
+        aux = metric.aux;
+        for (uint32_t j = 0; j < metric.aux_count; j++) {
+            const char* aux_value = aux + strlen(aux) + 1;
+            fty_proto_aux_insert(proto_metric, aux, "%s", aux_value);
+            aux = aux_value + strlen(aux_value) + 1;
+        }
+        result.add(proto_metric);
     }
-    closedir(dir);
-    return err;
+    return 0;
 }
 
 fty::shm::shmMetrics::~shmMetrics() {
@@ -664,6 +6308,45 @@ void fty::shm::shmMetrics::add(fty_proto_t* metric) {
   m_metricsVector.push_back(metric);
 }
 
+void fty::shm::ColumnarResult::clear()
+{
+    clear_rows();
+    asset_names.clear();
+    type_names.clear();
+    m_assetIds.clear();
+    m_typeIds.clear();
+}
+
+void fty::shm::ColumnarResult::clear_rows()
+{
+    assets.clear();
+    types.clear();
+    values.clear();
+    timestamps.clear();
+}
+
+void fty::shm::ColumnarResult::add(const char* asset, const char* type, size_t type_len, double value, int64_t timestamp)
+{
+    m_key.assign(asset);
+    assets.push_back(intern(m_assetIds, asset_names));
+    m_key.assign(type, type_len);
+    types.push_back(intern(m_typeIds, type_names));
+    values.push_back(value);
+    timestamps.push_back(timestamp);
+}
+
+// Return the id of m_key, adding it to the dictionary if needed
+uint32_t fty::shm::ColumnarResult::intern(std::unordered_map<std::string, uint32_t>& ids, std::vector<std::string>& names)
+{
+    auto it = ids.find(m_key);
+    if (it != ids.end())
+        return it->second;
+    uint32_t id = names.size();
+    ids.emplace(m_key, id);
+    names.push_back(m_key);
+    return id;
+}
+
 void init_default_dir() {
   chdir(DEFAULT_SHM_DIR);
 }
@@ -698,14 +6381,15 @@ void fty_shm_test(bool verbose)
     check_err(fty_shm_set_test_dir("src/selftest-rw"));
     check_err(access("src/selftest-rw", X_OK | W_OK));
     // The buildsystem does not delete this for some reason
-    assert(system("rm -f src/selftest-rw/*") == 0);
+    assert(system("find src/selftest-rw -mindepth 1 -delete") == 0);
+    check_err(mkdir("src/selftest-rw/metric", 0777));
 
     // Check for invalid characters
     assert(fty_shm_write_metric("invalid/asset", metric1, value1, unit1, 0) < 0);
     assert(fty_shm_read_metric("invalid/asset", metric1, &value, NULL) < 0);
     assert(!value);
-    assert(fty_shm_write_metric(asset1, "invalid:metric", value1, unit1, 0) < 0);
-    assert(fty_shm_read_metric(asset1, "invalid:metric", &value, NULL) < 0);
+    assert(fty_shm_write_metric(asset1, "invalid@metric", value1, unit1, 0) < 0);
+    assert(fty_shm_read_metric(asset1, "invalid@metric", &value, NULL) < 0);
     assert(!value);
 
     // Check for too long asset or metric name
@@ -759,12 +6443,12 @@ void fty_shm_test(bool verbose)
     assert(cpp_value.compare(0, 4, "42.0") == 0 || cpp_value.compare(0, 4, "41.9") == 0);
 
     // List assets
-    //check_err(fty_shm_write_metric(asset1, metric2, value1, unit1, 0));
-    //check_err(fty_shm_write_metric(asset2, metric1, value1, unit1, 0));
-    //fty::shm::find_assets(assets);
-    //assert(assets.size() == 2);
-    //assert(std::find(assets.begin(), assets.end(), asset1) != assets.end());
-    //assert(std::find(assets.begin(), assets.end(), asset2) != assets.end());
+    fty::shm::Assets assets;
+    check_err(fty_shm_write_metric(asset1, metric2, value1, unit1, 0));
+    check_err(fty_shm_write_metric(asset2, metric1, value1, unit1, 0));
+    check_err(fty::shm::find_assets(assets));
+    assert(std::find(assets.begin(), assets.end(), asset1) != assets.end());
+    assert(std::find(assets.begin(), assets.end(), asset2) != assets.end());
 
     // Load all metrics for an asset
     fty::shm::Metrics metrics;
@@ -800,8 +6484,942 @@ void fty_shm_test(bool verbose)
     // Garbage collector: asset1 expired and must be deleted, asset2 must stay
     sleep(2);
     check_err(fty_shm_cleanup(verbose));
-    check_err(access("src/selftest-rw/test_asset_2:test_metric_1.metric", F_OK));
-    assert(access("src/selftest-rw/test_asset_1:test_metric_1.metric", F_OK) < 0);
+    check_err(access("src/selftest-rw/metric/test_metric_1@test_asset_2", F_OK));
+    assert(access("src/selftest-rw/metric/test_metric_1@test_asset_1", F_OK) < 0);
+
+    // Columnar read: only numeric metrics are returned and asset ids are
+    // stable across reads
+    check_err(fty::shm::write_metric("col_asset_1", "realpower.default", 10.5, "W", 0));
+    check_err(fty::shm::write_metric("col_asset_2", "realpower.default", 20, "W", 0));
+    check_err(fty::shm::write_metric("col_asset_2", "status.ups", "online", "", 0));
+    fty::shm::ColumnarResult columns;
+    check_err(fty::shm::read_metrics_columnar(fty::shm::Query("metric", "col_asset_.*"), columns));
+    assert(columns.size() == 2);
+    assert(columns.type_names.size() == 1 && columns.type_names[0] == "realpower.default");
+    for (size_t i = 0; i < columns.size(); i++) {
+        const std::string& asset = columns.asset_names[columns.assets[i]];
+        assert(columns.values[i] == (asset == "col_asset_1" ? 10.5 : 20));
+        assert(columns.timestamps[i] > 0);
+    }
+    uint32_t col_id = columns.assets[0];
+    check_err(fty::shm::read_metrics_columnar(fty::shm::Query("metric", "col_asset_.*", "realpower\\..*"), columns));
+    assert(columns.size() == 2 && columns.asset_names.size() == 2);
+    assert(columns.assets[0] == col_id || columns.assets[1] == col_id);
+    // clear() starts over with empty dictionaries
+    columns.clear();
+    assert(columns.size() == 0 && columns.asset_names.empty() && columns.type_names.empty());
+    check_err(fty::shm::read_metrics_columnar(fty::shm::Query("metric", "col_asset_2"), columns));
+    assert(columns.size() == 1 && columns.assets[0] == 0 && columns.asset_names.size() == 1 &&
+        columns.asset_names[0] == "col_asset_2");
+
+    // Aggregation over the same metrics
+    fty::shm::Aggregate total;
+    check_err(fty::shm::aggregate(fty::shm::Query("metric", "col_asset_.*"), total));
+    assert(total.count == 2);
+    assert(total.sum == 30.5 && total.min == 10.5 && total.max == 20);
+    assert(total.avg() == 15.25);
+    check_err(fty::shm::aggregate(fty::shm::Query("metric", "no_such_asset"), total));
+    assert(total.count == 0 && total.sum == 0);
+
+    // Top-k by value, best first
+    check_err(fty::shm::write_metric("col_asset_3", "realpower.default", 15, "W", 0));
+    {
+        fty::shm::shmMetrics top;
+        check_err(fty::shm::top_k(fty::shm::Query("metric", "col_asset_.*"), 2, fty::shm::SORT_DESCENDING, top));
+        assert(top.size() == 2);
+        assert(streq(fty_proto_name(top.get(0)), "col_asset_2"));
+        assert(streq(fty_proto_name(top.get(1)), "col_asset_3"));
+        assert(streq(fty_proto_type(top.get(1)), "realpower.default"));
+    }
+    {
+        fty::shm::shmMetrics bottom;
+        check_err(fty::shm::top_k(fty::shm::Query("metric", "col_asset_.*"), 10, fty::shm::SORT_ASCENDING, bottom));
+        assert(bottom.size() == 3);
+        assert(streq(fty_proto_name(bottom.get(0)), "col_asset_1"));
+    }
+
+    // Incremental scan, driven the way a poller would drive it
+    {
+        fty::shm::shmMetrics scanned;
+        fty::shm::Scanner scanner(fty::shm::Query("metric", "col_asset_.*"));
+        int steps = 0, ret;
+        assert(scanner.fd() >= 0);
+        while ((ret = scanner.step(1, scanned)) > 0)
+            steps++;
+        check_err(ret);
+        assert(steps > 1);
+        assert(scanner.done());
+        assert(scanned.size() == 4);
+        struct pollfd pfd = { scanner.fd(), POLLIN, 0 };
+        assert(poll(&pfd, 1, 0) == 0);
+    }
+
+    // Metrics of an explicit set of assets
+    {
+        fty::shm::AssetsMetrics assets_metrics;
+        check_err(fty::shm::read_assets_metrics({ "col_asset_1", "col_asset_2", "no_such_asset" }, assets_metrics));
+        assert(assets_metrics.size() == 2);
+        assert(assets_metrics["col_asset_1"].size() == 1);
+        assert(assets_metrics["col_asset_2"].size() == 2);
+        assert(assets_metrics["col_asset_2"]["status.ups"].value == "online");
+        assert(assets_metrics["col_asset_2"]["realpower.default"].unit == "W");
+    }
+
+    // Prepared query: value updates are seen through the cached entries,
+    // new and deleted metrics through the directory timestamps
+    {
+        fty::shm::PreparedQuery prepared(fty::shm::Query("metric", "col_asset_.*", "realpower\\..*"));
+        check_err(prepared.aggregate(total));
+        assert(total.count == 3 && total.sum == 45.5);
+        check_err(fty::shm::write_metric("col_asset_3", "realpower.default", 16, "W", 0));
+        check_err(prepared.aggregate(total));
+        assert(total.count == 3 && total.sum == 46.5);
+        check_err(fty::shm::write_metric("col_asset_4", "realpower.default", 1, "W", 0));
+        check_err(prepared.aggregate(total));
+        assert(total.count == 4 && total.sum == 47.5);
+        check_err(unlink("src/selftest-rw/metric/realpower.default@col_asset_4"));
+        fty::shm::shmMetrics prepared_metrics;
+        check_err(prepared.read_metrics(prepared_metrics));
+        assert(prepared_metrics.size() == 3);
+    }
+
+    // Query planning: plain names are read directly, prefixes use the index,
+    // other patterns scan the family
+    {
+        fty::shm::QueryPlan plan;
+        check_err(fty::shm::explain(fty::shm::Query("metric", "col_asset_1", "realpower\\.default"), plan));
+        assert(plan.path == fty::shm::QueryPlan::POINT_READ);
+        assert(plan.actual_cost == 1 && plan.rows == 1);
+        check_err(fty::shm::explain(fty::shm::Query("metric", "col_asset_.*", "realpower\\..*"), plan));
+        assert(plan.path == fty::shm::QueryPlan::INDEX_RANGE);
+        assert(plan.rows == 3);
+        check_err(fty::shm::explain(fty::shm::Query("metric", "col_asset_[12]"), plan));
+        assert(plan.path == fty::shm::QueryPlan::SCAN);
+        assert(plan.rows == 3 && plan.actual_cost > 3);
+        fty::shm::PreparedQuery prepared(fty::shm::Query("metric", "col_asset_1"));
+        check_err(prepared.explain(plan));
+        usleep(30000);
+        check_err(prepared.explain(plan));
+        check_err(prepared.explain(plan));
+        assert(plan.path == fty::shm::QueryPlan::CACHED && plan.rows == 1);
+    }
+
+    // Sorted index: ranges of literal and prefix types and assets, rebuilt
+    // when a metric is created
+    {
+        fty::shm::QueryPlan plan;
+        fty::shm::shmMetrics result;
+        check_err(fty::shm::write_metric("idx_asset_1", "voltage.input.L1", 230, "V", 0));
+        check_err(fty::shm::write_metric("idx_asset_1", "voltage.input.L2", 231, "V", 0));
+        check_err(fty::shm::write_metric("idx_asset_10", "voltage.input.L1", 232, "V", 0));
+        check_err(fty::shm::read_metrics(fty::shm::Query("metric", "idx_asset_1", "voltage\\.input\\..*"), result));
+        assert(result.size() == 2);
+        check_err(fty::shm::explain(fty::shm::Query("metric", "idx_asset_1.*"), plan));
+        assert(plan.path == fty::shm::QueryPlan::INDEX_RANGE);
+        assert(plan.rows == 3 && plan.actual_cost == 3);
+        check_err(fty::shm::explain(fty::shm::Query("metric", "idx_asset_[0-9]*", "voltage\\.input\\.L1"), plan));
+        assert(plan.rows == 2 && plan.actual_cost == 2);
+        check_err(fty::shm::explain(fty::shm::Query("metric", "idx_asset_1", "voltage.*"), plan));
+        assert(plan.rows == 2 && plan.actual_cost == 2);
+        check_err(fty::shm::write_metric("idx_asset_1", "voltage.input.L3", 229, "V", 0));
+        check_err(fty::shm::explain(fty::shm::Query("metric", "idx_asset_1", "voltage.*"), plan));
+        assert(plan.rows == 3);
+    }
+
+    // Aux attribute predicate, with and without the inverted index, which
+    // follows changes of the attributes
+    {
+        fty::shm::QueryPlan plan;
+        fty::shm::shmMetrics result;
+        for (int i = 0; i < 4; i++) {
+            fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+            fty_proto_set_name(metric, "aux_sensor_%d", i);
+            fty_proto_set_type(metric, "temperature");
+            fty_proto_set_value(metric, "%d", 20 + i);
+            fty_proto_set_unit(metric, "C");
+            fty_proto_set_ttl(metric, 0);
+            fty_proto_aux_insert(metric, "port", "%d", i % 2);
+            check_err(fty::shm::write_metric(metric));
+            fty_proto_destroy(&metric);
+        }
+        fty::shm::Query query("metric", "aux_sensor_.*", "temperature");
+        query.aux_key = "port";
+        query.aux_value = "1";
+        check_err(fty::shm::explain(query, plan));
+        assert(plan.path != fty::shm::QueryPlan::AUX_INDEX && plan.rows == 2);
+        check_err(fty::shm::add_aux_index("port"));
+        check_err(fty::shm::read_metrics(query, result));
+        assert(result.size() == 2);
+        assert(strcmp(fty_proto_aux_string(result.get(0), "port", ""), "1") == 0);
+        check_err(fty::shm::explain(query, plan));
+        assert(plan.path == fty::shm::QueryPlan::AUX_INDEX && plan.rows == 2);
+        fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+        fty_proto_set_name(metric, "aux_sensor_1");
+        fty_proto_set_type(metric, "temperature");
+        fty_proto_set_value(metric, "21");
+        fty_proto_set_unit(metric, "C");
+        fty_proto_set_ttl(metric, 0);
+        fty_proto_aux_insert(metric, "port", "2");
+        check_err(fty::shm::write_metric(metric));
+        fty_proto_destroy(&metric);
+        check_err(fty::shm::explain(query, plan));
+        assert(plan.rows == 1 && plan.actual_cost == plan.rows + 2);
+        query.aux_value = "2";
+        check_err(fty::shm::explain(query, plan));
+        assert(plan.rows == 1);
+    }
+
+    // Sharding a family moves its metrics to the shards, where lookups,
+    // queries and the cleanup find them
+    {
+        char filename[PATH_MAX];
+        fty::shm::QueryPlan plan;
+        fty::shm::shmMetrics result;
+        assert(system("rm -rf src/selftest-rw/sharded && mkdir src/selftest-rw/sharded") == 0);
+        for (int i = 0; i < 20; i++) {
+            std::string asset = "shard_asset_" + std::to_string(i);
+            check_err(prepare_filename(filename, asset.c_str(), asset.size(), "voltage", strlen("voltage"), "sharded"));
+            check_err(write_value(filename, std::to_string(i).c_str(), "V", i ? 0 : 1));
+        }
+        assert(fty::shm::shard_family("sharded", 1) < 0 && errno == EINVAL);
+        check_err(fty::shm::shard_family("sharded", 4));
+        assert(fty::shm::shard_family("sharded", 8) < 0 && errno == EEXIST);
+        assert(access("src/selftest-rw/sharded/voltage@shard_asset_1", F_OK) < 0);
+        assert(prepare_filename(filename, "shard_asset_1", strlen("shard_asset_1"), "voltage", strlen("voltage"), "sharded") == 2);
+        check_err(access(filename, F_OK));
+        check_err(fty::shm::read_metrics(fty::shm::Query("sharded", "shard_asset_1.*"), result));
+        assert(result.size() == 11);
+        check_err(fty::shm::explain(fty::shm::Query("sharded", "shard_asset_1", "voltage"), plan));
+        assert(plan.path == fty::shm::QueryPlan::POINT_READ && plan.rows == 1 && plan.actual_cost == 2);
+        fty::shm::Scanner scanner(fty::shm::Query("sharded"));
+        fty::shm::shmMetrics scanned;
+        // shard_asset_0 has expired by then, and is deleted by the cleanup
+        // once it has been for twice its ttl
+        sleep(2);
+        while (scanner.step(5, scanned) > 0)
+            ;
+        assert(scanned.size() == 19);
+        // A process that has not noticed the sharding yet writes to the flat
+        // layout, that copy is newer and read until the cleanup moves it
+        bool migrating;
+        assert(read_fanout("src/selftest-rw/sharded", &migrating) == 4 && migrating);
+        check_err(prepare_filename(filename, "shard_asset_2", strlen("shard_asset_2"), "voltage", strlen("voltage"), "sharded", true));
+        check_err(write_value(filename, "42", "V", 0));
+        fty_proto_t* proto = fty_proto_new(FTY_PROTO_METRIC);
+        check_err(storage()->read_data_metric("sharded", "voltage@shard_asset_2", proto, NULL));
+        assert(!strcmp(fty_proto_value(proto), "42"));
+        sleep(2);
+        check_err(prepare_filename(filename, "shard_asset_0", strlen("shard_asset_0"), "voltage", strlen("voltage"), "sharded"));
+        check_err(access(filename, F_OK));
+        check_err(fty_shm_cleanup(verbose));
+        assert(access(filename, F_OK) < 0 && errno == ENOENT);
+        assert(read_fanout("src/selftest-rw/sharded", &migrating) == 4 && !migrating);
+        assert(access("src/selftest-rw/sharded/voltage@shard_asset_2", F_OK) < 0);
+        check_err(storage()->read_data_metric("sharded", "voltage@shard_asset_2", proto, NULL));
+        assert(!strcmp(fty_proto_value(proto), "42"));
+        fty_proto_destroy(&proto);
+    }
+
+    // The other backends behave like the files
+    {
+        assert(fty::shm::set_backend("none") < 0 && errno == EINVAL);
+        assert(system("rm -rf src/selftest-rw/" SEGMENT_FILE " src/selftest-rw/" PACKED_DIR) == 0);
+        for (const char* backend : { "segment", "packed", "heap" }) {
+            std::string value, unit;
+            fty::shm::shmMetrics result;
+            fty::shm::ColumnarResult columns;
+            fty::shm::QueryPlan plan;
+            check_err(fty::shm::set_backend(backend));
+            assert(!strcmp(fty::shm::backend_name(), backend));
+            for (int i = 0; i < 10; i++)
+                check_err(fty::shm::write_metric("backend_asset_" + std::to_string(i), "load", std::to_string(i), "%", 0));
+            check_err(fty::shm::write_metric("backend_asset_0", "load", "100", "%", 0));
+            check_err(fty::shm::read_metric("backend_asset_0", "load", value, unit));
+            assert(value == "100" && unit == "%");
+            assert(fty::shm::read_metric("backend_asset_10", "load", value) < 0 && errno == ENOENT);
+            assert(fty::shm::write_metric("backend/asset", "load", "1", "%", 0) < 0 && errno == EINVAL);
+            check_err(fty::shm::write_metric("backend_expired", "load", "1", "%", 1));
+
+            fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+            fty_proto_set_name(metric, "backend_asset_3");
+            fty_proto_set_type(metric, "load");
+            fty_proto_set_value(metric, "33");
+            fty_proto_set_unit(metric, "%");
+            fty_proto_set_ttl(metric, 0);
+            fty_proto_aux_insert(metric, "port", "%s", "7");
+            check_err(fty::shm::write_metric(metric));
+            fty_proto_destroy(&metric);
+
+            check_err(fty::shm::explain(fty::shm::Query("metric", "backend_asset_.*", "load"), plan));
+            assert(plan.path == fty::shm::QueryPlan::SCAN && plan.rows == 10);
+            fty::shm::Query query("metric", "backend_asset_.*");
+            query.aux_key = "port";
+            query.aux_value = "7";
+            check_err(fty::shm::read_metrics(query, result));
+            assert(result.size() == 1 && !strcmp(fty_proto_value(result.get(0)), "33"));
+            check_err(fty::shm::read_metrics_columnar(fty::shm::Query("*", "backend_asset_[0-4]"), columns));
+            assert(columns.values.size() == 5);
+            fty::shm::shmMetrics top;
+            check_err(fty::shm::top_k(fty::shm::Query("metric", "backend_asset_.*"), 2, fty::shm::SORT_DESCENDING, top));
+            assert(top.size() == 2 && !strcmp(fty_proto_name(top.get(0)), "backend_asset_0") &&
+                !strcmp(fty_proto_name(top.get(1)), "backend_asset_3"));
+            fty::shm::PreparedQuery prepared(fty::shm::Query("metric", "backend_asset_[5-9]"));
+            fty::shm::Aggregate total;
+            check_err(prepared.aggregate(total));
+            assert(total.count == 5 && total.sum == 35);
+            fty::shm::Scanner scanner(fty::shm::Query("metric", "backend_asset_.*"));
+            fty::shm::shmMetrics scanned;
+            while (scanner.step(5, scanned) > 0)
+                ;
+            assert(scanner.done() && scanned.size() == 10);
+            fty::shm::Metrics metrics;
+            check_err(fty::shm::read_asset_metrics("backend_asset_1", metrics));
+            assert(metrics.size() == 1 && metrics["load"].value == "1");
+            // Nothing reaches the files
+            assert(access("src/selftest-rw/metric/load@backend_asset_1", F_OK) < 0);
+        }
+        // Expired, then deleted by the cleanup once expired for twice its ttl
+        sleep(4);
+        for (const char* backend : { "segment", "packed", "heap" }) {
+            std::string value;
+            check_err(fty::shm::set_backend(backend));
+            assert(fty::shm::read_metric("backend_expired", "load", value) < 0 && errno == ESTALE);
+            check_err(fty_shm_cleanup(verbose));
+            assert(fty::shm::read_metric("backend_expired", "load", value) < 0 && errno == ENOENT);
+            check_err(fty::shm::read_metric("backend_asset_1", "load", value));
+        }
+        check_err(fty::shm::set_backend("file"));
+    }
+
+    // The segment adds tables as needed, reuses the slots of deleted
+    // metrics and takes back the slots of claimers that died
+    {
+        std::string value;
+        check_err(fty::shm::set_backend("segment"));
+        int fd = open("src/selftest-rw/" SEGMENT_FILE, O_RDWR);
+        assert(fd >= 0);
+        size_t map_len = SEGMENT_HEADER_SIZE + SEGMENT_SLOTS * sizeof(SegmentIndexEntry);
+        void* base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        assert(base != MAP_FAILED);
+        close(fd);
+        SegmentHeader* header = static_cast<SegmentHeader*>(base);
+        SegmentIndexEntry* index = reinterpret_cast<SegmentIndexEntry*>(static_cast<char*>(base) + SEGMENT_HEADER_SIZE);
+        const int count = SEGMENT_SLOTS + SEGMENT_SLOTS / 16;
+        for (int round = 0; round < 3; round++) {
+            std::string asset = "grow_asset_" + std::to_string(round) + "_";
+            for (int i = 0; i < count; i++)
+                check_err(fty::shm::write_metric(asset + std::to_string(i), "load", std::to_string(i), "%", 0));
+            check_err(fty::shm::read_metric(asset + "0", "load", value));
+            assert(value == "0");
+            check_err(fty::shm::read_metric(asset + std::to_string(count - 1), "load", value));
+            assert(value == std::to_string(count - 1));
+            // Without reuse, the third round would not fit in two tables
+            assert(header->tables.load() == 2);
+            for (int i = 0; i < count; i++)
+                check_err(storage()->remove("metric", ("load@" + asset + std::to_string(i)).c_str()));
+            assert(fty::shm::read_metric(asset + "0", "load", value) < 0 && errno == ENOENT);
+        }
+        std::string key = "metric/load@claimed_asset";
+        SegmentIndexEntry& entry = index[fnv1a(key.data(), key.size()) % SEGMENT_SLOTS];
+        uint32_t state = entry.state.load();
+        assert(state == SLOT_FREE || state == SLOT_DELETED);
+        entry.state.store(SLOT_CLAIMED);
+        assert(fty::shm::read_metric("claimed_asset", "load", value) < 0 && errno == ENOENT);
+        check_err(fty::shm::write_metric("claimed_asset", "load", "1", "%", 0));
+        assert(entry.state.load() == SLOT_USED);
+        check_err(fty::shm::read_metric("claimed_asset", "load", value));
+        assert(value == "1");
+        munmap(base, map_len);
+        check_err(fty::shm::set_backend("file"));
+    }
+
+    // The read cache returns a value until it changes, and still expires it
+    {
+        std::string value, unit;
+        fty::shm::set_read_cache(16);
+        for (const char* backend : { "file", "segment" }) {
+            check_err(fty::shm::set_backend(backend));
+            check_err(fty::shm::write_metric("cache_asset", "load", "1", "%", 1));
+            // Changes of files written this recently could go unnoticed
+            usleep(30000);
+            fty::shm::ReadCacheStats stats = fty::shm::read_cache_stats();
+            check_err(fty::shm::read_metric("cache_asset", "load", value, unit));
+            check_err(fty::shm::read_metric("cache_asset", "load", value, unit));
+            assert(value == "1" && unit == "%");
+            assert(fty::shm::read_cache_stats().hits == stats.hits + 1);
+            assert(fty::shm::read_cache_stats().misses == stats.misses + 1);
+            check_err(fty::shm::write_metric("cache_asset", "load", "2", "%", 1));
+            check_err(fty::shm::read_metric("cache_asset", "load", value));
+            assert(value == "2");
+        }
+        // The ttl of an unchanged value is checked by the cache
+        fty::shm::ReadCacheStats stats = fty::shm::read_cache_stats();
+        sleep(2);
+        assert(fty::shm::read_metric("cache_asset", "load", value) < 0 && errno == ESTALE);
+        assert(fty::shm::read_cache_stats().hits == stats.hits + 1);
+        check_err(fty::shm::set_backend("file"));
+        // Only a share of the open files are taken by the cache, the other
+        // files are checked by their path
+        struct rlimit limit, low;
+        check_err(getrlimit(RLIMIT_NOFILE, &limit));
+        low = limit;
+        low.rlim_cur = 128;
+        check_err(setrlimit(RLIMIT_NOFILE, &low));
+        fty::shm::set_read_cache(1000);
+        for (int i = 0; i < 300; i++)
+            check_err(fty::shm::write_metric("cache_asset_" + std::to_string(i), "load", "1", "%", 0));
+        usleep(30000);
+        for (int i = 0; i < 300; i++)
+            check_err(fty::shm::read_metric("cache_asset_" + std::to_string(i), "load", value));
+        int fd = open("/dev/null", O_RDONLY);
+        assert(fd >= 0);
+        close(fd);
+        check_err(fty::shm::write_metric("cache_asset_299", "load", "2", "%", 0));
+        check_err(fty::shm::read_metric("cache_asset_299", "load", value));
+        assert(value == "2");
+        fty::shm::set_read_cache(0);
+        check_err(setrlimit(RLIMIT_NOFILE, &limit));
+    }
+
+    // Write suppression only refreshes the time of unchanged values
+    {
+        std::string value, unit, filename = std::string(shm_dir) + "/metric/load@quiet_asset";
+        struct timespec old_times[2] = { { time(NULL) - 10, 0 }, { time(NULL) - 10, 0 } };
+        fty::shm::set_write_suppression(true);
+        for (const char* backend : { "file", "segment", "packed", "heap" }) {
+            check_err(fty::shm::set_backend(backend));
+            check_err(fty::shm::write_metric("quiet_asset", "load", "1", "%", 5));
+            if (!strcmp(backend, "file"))
+                check_err(utimensat(AT_FDCWD, filename.c_str(), old_times, 0));
+            fty::shm::WriteSuppressionStats stats = fty::shm::write_suppression_stats();
+            check_err(fty::shm::write_metric("quiet_asset", "load", "1", "%", 5));
+            assert(fty::shm::write_suppression_stats().suppressed == stats.suppressed + 1);
+            check_err(fty::shm::read_metric("quiet_asset", "load", value, unit));
+            assert(value == "1" && unit == "%");
+            // A different ttl is a change
+            check_err(fty::shm::write_metric("quiet_asset", "load", "1", "%", 6));
+            check_err(fty::shm::write_metric("quiet_asset", "load", "2", "%", 6));
+            assert(fty::shm::write_suppression_stats().suppressed == stats.suppressed + 1);
+            assert(fty::shm::write_suppression_stats().written == stats.written + 2);
+            check_err(fty::shm::read_metric("quiet_asset", "load", value));
+            assert(value == "2");
+        }
+        check_err(fty::shm::set_backend("file"));
+        fty::shm::set_write_suppression(false);
+    }
+
+    // The write-behind writer keeps the last write of a metric and flushes
+    // on its own and when destroyed
+    {
+        std::string value;
+        {
+            fty::shm::WriteBehind writer(20);
+            assert(writer.write_metric("behind_asset", "bad@metric", "1", "V", 0) < 0 && errno == EINVAL);
+            for (int i = 0; i < 100; i++)
+                check_err(writer.write_metric("behind_asset", "voltage", std::to_string(i), "V", 0));
+            check_err(writer.write_metric("behind_asset", "current", "5", "A", 0));
+            for (int i = 0; i < 200 && writer.stats().depth; i++)
+                usleep(10000);
+            fty::shm::WriteBehindStats stats = writer.stats();
+            assert(stats.depth == 0 && stats.queued == 101);
+            assert(stats.written + stats.coalesced == 101 && stats.written >= 2 && !stats.failed);
+            assert(stats.max_lag_ns >= stats.lag_ns);
+            check_err(fty::shm::read_metric("behind_asset", "voltage", value));
+            assert(value == "99");
+            check_err(writer.write_metric("behind_asset", "voltage", "100", "V", 0));
+        }
+        check_err(fty::shm::read_metric("behind_asset", "voltage", value));
+        assert(value == "100");
+    }
+
+    // The snapshot has all live metrics and follows their changes
+    {
+        fty::shm::SnapshotMetric metric;
+        fty::shm::shmMetrics result;
+        fty::shm::Snapshot snapshot;
+        fty::shm::SnapshotPublisher publisher;
+        check_err(fty::shm::write_metric("snap_asset", "voltage", "230", "V", 0));
+        // Several metrics share the aux key
+        const char* aux_metrics[][3] = {
+            { "snap_asset", "current", "1" }, { "snap_asset", "temperature", "2" }, { "snap_asset_2", "current", "3" }
+        };
+        for (const auto& aux_metric : aux_metrics) {
+            fty_proto_t* proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+            fty_proto_set_name(proto_metric, "%s", aux_metric[0]);
+            fty_proto_set_type(proto_metric, "%s", aux_metric[1]);
+            fty_proto_set_value(proto_metric, "5");
+            fty_proto_set_unit(proto_metric, "A");
+            fty_proto_set_ttl(proto_metric, 0);
+            fty_proto_aux_insert(proto_metric, "port", "%s", aux_metric[2]);
+            check_err(fty::shm::write_metric(proto_metric));
+            fty_proto_destroy(&proto_metric);
+        }
+        check_err(publisher.publish());
+        assert(snapshot.refresh() == 1 && snapshot.generation() == publisher.generation());
+        assert(snapshot.find("metric", "snap_asset", "voltage", metric));
+        // The units are as read_metrics() returns them
+        assert(strcmp(metric.value, "230") == 0 && metric.unit[0] == 'V' && metric.aux_count == 0);
+        assert(snapshot.find("metric", "snap_asset", "current", metric));
+        assert(metric.aux_count == 1 && strcmp(metric.aux, "port") == 0 && strcmp(metric.aux + 5, "1") == 0);
+        for (const auto& aux_metric : aux_metrics) {
+            assert(snapshot.find("metric", aux_metric[0], aux_metric[1], metric));
+            assert(metric.aux_count == 1 && strcmp(metric.aux, "port") == 0 && strcmp(metric.aux + 5, aux_metric[2]) == 0);
+        }
+        assert(!snapshot.find("metric", "snap_asset", "power", metric));
+        // Sorted by family, type and asset
+        for (size_t i = 1; i < snapshot.size(); i++) {
+            fty::shm::SnapshotMetric prev = snapshot.at(i - 1), next = snapshot.at(i);
+            int cmp = strcmp(prev.family, next.family);
+            if (!cmp)
+                cmp = strcmp(prev.type, next.type);
+            if (!cmp)
+                cmp = strcmp(prev.asset, next.asset);
+            assert(cmp < 0);
+        }
+        fty::shm::Query query("metric", "snap_asset", ".*");
+        query.aux_key = "port";
+        query.aux_value = "1";
+        check_err(snapshot.read_metrics(query, result));
+        assert(result.size() == 1 && strcmp(fty_proto_type(result.get(0)), "current") == 0);
+        assert(strcmp(fty_proto_aux_string(result.get(0), "port", ""), "1") == 0);
+
+        // Only the changes are read again
+        check_err(fty::shm::write_metric("snap_asset", "voltage", "231", "V", 0));
+        check_err(fty::shm::write_metric("snap_asset", "power", "1000", "W", 0));
+        struct pollfd pfd = { publisher.fd(), POLLIN, 0 };
+        assert(poll(&pfd, 1, 1000) == 1);
+        check_err(publisher.publish());
+        assert(snapshot.refresh() == 1 && snapshot.generation() == publisher.generation());
+        assert(snapshot.find("metric", "snap_asset", "voltage", metric) && strcmp(metric.value, "231") == 0);
+        assert(snapshot.find("metric", "snap_asset", "power", metric));
+        // Without changes, there is no new generation
+        uint64_t generation = publisher.generation();
+        check_err(publisher.publish());
+        assert(publisher.generation() == generation && snapshot.refresh() == 0);
+        check_err(unlink((std::string(shm_dir) + "/metric/power@snap_asset").c_str()));
+        assert(poll(&pfd, 1, 1000) == 1);
+        check_err(publisher.publish());
+        assert(snapshot.refresh() == 1 && !snapshot.find("metric", "snap_asset", "power", metric));
+    }
+
+    // Consistent reads check every metric after reading them all
+    {
+        fty::shm::ConsistentReadStats stats;
+        for (const char* backend : { "file", "segment" }) {
+            fty::shm::shmMetrics result;
+            check_err(fty::shm::set_backend(backend));
+            for (int i = 1; i <= 3; i++)
+                check_err(fty::shm::write_metric("balance_asset", "realpower.input.L" + std::to_string(i), "100", "W", 0));
+            check_err(fty::shm::write_metric("balance_asset", "realpower.input", "300", "W", 0));
+            usleep(30000);
+            fty::shm::Query query("metric", "balance_asset", "realpower\\.input.*");
+            check_err(fty::shm::read_metrics_consistent(query, result, &stats));
+            assert(result.size() == 4 && stats.rounds == 1 && stats.reads == 4 && stats.rereads == 0);
+            // A file written this recently is compared with what was read
+            fty::shm::shmMetrics result2;
+            check_err(fty::shm::write_metric("balance_asset", "realpower.input", "301", "W", 0));
+            check_err(fty::shm::read_metrics_consistent(query, result2, &stats));
+            assert(result2.size() == 4 && stats.reads == 4);
+            if (!strcmp(backend, "file"))
+                assert(stats.compares == 1);
+        }
+        check_err(fty::shm::set_backend("file"));
+    }
+
+    // The catalog counts the metrics by family, asset and type, and follows
+    // their creation and deletion
+    {
+        fty::shm::CatalogCounts counts;
+        check_err(fty::shm::write_metric("catalog_asset_1", "catalog.voltage", "230", "V", 0));
+        check_err(fty::shm::write_metric("catalog_asset_1", "catalog.current", "1", "A", 0));
+        check_err(fty::shm::write_metric("catalog_asset_2", "catalog.voltage", "231", "V", 0));
+        check_err(fty::shm::find_assets("metric", counts));
+        assert(counts["catalog_asset_1"] == 2 && counts["catalog_asset_2"] == 1);
+        check_err(fty::shm::list_types("*", counts));
+        assert(counts["catalog.voltage"] == 2 && counts["catalog.current"] == 1);
+        check_err(fty::shm::list_families(counts));
+        assert(counts.count("metric") && counts["metric"] >= 3);
+        size_t metrics = counts["metric"];
+        // Once the directory has settled, the catalog is not built again
+        usleep(30000);
+        check_err(fty::shm::list_types("metric", counts));
+        check_err(unlink((std::string(shm_dir) + "/metric/catalog.current@catalog_asset_1").c_str()));
+        check_err(fty::shm::list_types("metric", counts));
+        assert(!counts.count("catalog.current") && counts["catalog.voltage"] == 2);
+        check_err(fty::shm::list_families(counts));
+        assert(counts["metric"] == metrics - 1);
+        assert(fty::shm::list_types("no_such_family", counts) < 0 && errno == ENOENT);
+        // The planner knows the size of a family with a settled catalog
+        fty::shm::QueryPlan plan;
+        usleep(30000);
+        check_err(fty::shm::list_families(counts));
+        check_err(fty::shm::explain(fty::shm::Query("metric", "catalog_asset_[12]", "catalog[.]voltage"), plan));
+        assert(plan.path == fty::shm::QueryPlan::SCAN && plan.estimated_cost == counts["metric"]);
+    }
+
+    // Values longer than the record follow it whole, and torn reads of them
+    // are retried
+    {
+        std::string long_value, value, unit;
+        for (int i = 0; long_value.size() < 9000; i++)
+            long_value += std::to_string(i) + ",";
+        for (const char* backend : { "file", "heap" }) {
+            fty::shm::shmMetrics result;
+            check_err(fty::shm::set_backend(backend));
+            check_err(fty::shm::write_metric("long_asset", "inventory", long_value, "json", 0));
+            check_err(fty::shm::read_metric("long_asset", "inventory", value, unit));
+            assert(value == long_value && unit == "json");
+            check_err(fty::shm::read_metrics(fty::shm::Query("metric", "long_asset", "inventory"), result));
+            assert(result.size() == 1 && fty_proto_value(result.get(0)) == long_value);
+            // Back to a value that fits in the record
+            check_err(fty::shm::write_metric("long_asset", "inventory", std::string(Record::inline_value_len, 'x'), "json", 0));
+            check_err(fty::shm::read_metric("long_asset", "inventory", value));
+            assert(value == std::string(Record::inline_value_len, 'x'));
+        }
+        check_err(fty::shm::set_backend("file"));
+        std::string filename = std::string(shm_dir) + "/metric/inventory@long_asset";
+        struct stat st;
+        check_err(stat(filename.c_str(), &st));
+        assert(st.st_size == Record::record_len);
+        assert(fty::shm::write_metric("long_asset", "inventory", std::string(VALUE_MAX_LEN + 1, 'x'), "", 0) < 0 &&
+            errno == EINVAL);
+        // A corrupt value never checks out
+        check_err(fty::shm::write_metric("long_asset", "inventory", long_value, "json", 0));
+        int fd = open(filename.c_str(), O_WRONLY);
+        assert(fd >= 0 && pwrite(fd, "?", 1, Record::record_len + sizeof(LongTrailer) + 5000) == 1);
+        close(fd);
+        assert(fty::shm::read_metric("long_asset", "inventory", value) < 0 && errno == EAGAIN);
+        // A line based record with a trailer of a long value after its first
+        // record_len bytes is read as written
+        {
+            fty::shm::shmMetrics result;
+            LongTrailer trailer = { LONG_MAGIC, 200, 0, 0 };
+            std::string record = "0000000000\njson\n" + std::string(Record::record_len - 16, 'z');
+            record.append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+            std::string lookalike = std::string(shm_dir) + "/metric/lookalike@long_asset";
+            int lfd = open(lookalike.c_str(), O_CREAT | O_WRONLY, 0666);
+            assert(lfd >= 0 && write(lfd, record.data(), record.size()) == ssize_t(record.size()));
+            close(lfd);
+            check_err(fty::shm::read_metrics(fty::shm::Query("metric", "long_asset", "lookalike"), result));
+            assert(result.size() == 1 && fty_proto_value(result.get(0)) == std::string(Record::record_len - 16, 'z') + "lng");
+            check_err(unlink(lookalike.c_str()));
+        }
+        // Readers see either value whole while a writer alternates them
+        std::string other(long_value.size() * 2, 'y');
+        std::atomic<bool> done(false);
+        std::thread writer([&]() {
+            for (int i = 0; !done; i++)
+                fty::shm::write_metric("long_asset", "inventory", i % 2 ? other : long_value, "json", 0);
+        });
+        for (int i = 0; i < 200; i++) {
+            if (fty::shm::read_metric("long_asset", "inventory", value) == 0)
+                assert(value == long_value || value == other);
+            else
+                assert(errno == EAGAIN);
+        }
+        done = true;
+        writer.join();
+        check_err(fty::shm::set_backend("segment"));
+        assert(fty::shm::write_metric("long_asset", "inventory", long_value, "json", 0) < 0 && errno == EMSGSIZE);
+        check_err(fty::shm::set_backend("file"));
+    }
+
+    // Long units are kept in the dictionary and all units are interned
+    {
+        std::string value, unit;
+        const char *unit1, *unit2;
+        fty::shm::shmMetrics result;
+        std::string units = std::string(shm_dir) + "/" UNITS_FILE;
+        unlink(units.c_str());
+        check_err(fty::shm::write_metric("unit_asset", "energy", "12", "kilowatt-hours", 0));
+        check_err(fty::shm::write_metric("unit_asset", "energy.total", "120", "kilowatt-hours", 0));
+        check_err(fty::shm::write_metric("unit_asset", "count", "3", "#1", 0));
+        check_err(fty::shm::write_metric("unit_asset", "voltage", "230", "V", 0));
+        check_err(fty::shm::read_metric("unit_asset", "energy", value, unit));
+        assert(value == "12" && unit == "kilowatt-hours");
+        check_err(fty::shm::read_metric("unit_asset", "energy.total", value, unit1));
+        check_err(fty::shm::read_metric("unit_asset", "energy", value, unit2));
+        assert(unit1 == unit2 && unit1 == fty::shm::intern_unit("kilowatt-hours"));
+        check_err(fty::shm::read_metric("unit_asset", "count", value, unit1));
+        assert(!strcmp(unit1, "#1"));
+        check_err(fty::shm::read_metric("unit_asset", "voltage", value, unit1));
+        assert(unit1 == fty::shm::intern_unit("V"));
+        // Through the cache of each thread
+        assert(resolve_unit("V         ", Record::unit_width) == unit1);
+        std::thread([&] { assert(resolve_unit("V         ", Record::unit_width) == unit1); }).join();
+        check_err(fty::shm::read_metrics(fty::shm::Query("metric", "unit_asset", "energy"), result));
+        assert(result.size() == 1 && !strcmp(fty_proto_unit(result.get(0)), "kilowatt-hours"));
+        // One line per unit
+        FILE* file = fopen(units.c_str(), "r");
+        char line[64];
+        assert(file && fgets(line, sizeof(line), file) && !strcmp(line, "kilowatt-hours\n"));
+        assert(fgets(line, sizeof(line), file) && !strcmp(line, "#1\n") && !fgets(line, sizeof(line), file));
+        fclose(file);
+        // A new dictionary is read from its start
+        file = fopen((units + ".new").c_str(), "w");
+        assert(file && fputs("megawatt-hours\n", file) >= 0);
+        fclose(file);
+        check_err(rename((units + ".new").c_str(), units.c_str()));
+        check_err(fty::shm::read_metric("unit_asset", "energy", value, unit));
+        assert(unit == "megawatt-hours");
+        unlink(units.c_str());
+        check_err(fty::shm::write_metric("unit_asset", "power", "3", "volt-amperes", 0));
+        check_err(fty::shm::read_metric("unit_asset", "power", value, unit));
+        assert(unit == "volt-amperes");
+        assert(fty::shm::write_metric("unit_asset", "energy", "12", std::string(UNIT_MAX_LEN + 1, 'u'), 0) < 0 &&
+            errno == EINVAL);
+    }
+
+    // Records hold the time of their write, which spares the fstat()
+    {
+        std::string value, unit;
+        int64_t time_ns, before = now_ns();
+        check_err(fty::shm::write_metric("time_asset", "voltage", "230", "V", 0));
+        check_err(fty::shm::read_metric("time_asset", "voltage", value, unit, time_ns));
+        assert(value == "230" && unit == "V" && time_ns >= before && time_ns <= now_ns());
+        std::string filename = std::string(shm_dir) + "/metric/voltage@time_asset";
+        char buf[Record::record_len + 1];
+        FILE* file = fopen(filename.c_str(), "r");
+        assert(file && fread(buf, 1, sizeof(buf), file) == Record::record_len && record_time(buf, Record::record_len) == time_ns);
+        fclose(file);
+        fty::shm::shmMetrics result;
+        check_err(fty::shm::read_metrics(fty::shm::Query("metric", "time_asset", "voltage"), result));
+        assert(result.size() == 1 && fty_proto_time(result.get(0)) == uint64_t(time_ns / 1000000000));
+        // Values around the length that still fits with the time
+        for (size_t len : { Record::inline_value_len, Record::inline_value_len + 1, Record::payload_len - 1, Record::payload_len }) {
+            check_err(fty::shm::write_metric("time_asset", "serial", std::string(len, 's'), "", 0));
+            check_err(fty::shm::read_metric("time_asset", "serial", value, unit, time_ns));
+            assert(value == std::string(len, 's') && time_ns >= before);
+        }
+        // Whole metrics keep their aux attributes
+        fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+        fty_proto_set_name(metric, "time_asset");
+        fty_proto_set_type(metric, "current");
+        fty_proto_set_value(metric, "5");
+        fty_proto_set_unit(metric, "A");
+        fty_proto_aux_insert(metric, "phase", "L1");
+        check_err(fty::shm::write_metric(metric));
+        fty_proto_destroy(&metric);
+        fty::shm::shmMetrics aux_result;
+        check_err(fty::shm::read_metrics(fty::shm::Query("metric", "time_asset", "current"), aux_result));
+        assert(aux_result.size() == 1 && !strcmp(fty_proto_value(aux_result.get(0)), "5"));
+        assert(zhash_size(fty_proto_aux(aux_result.get(0))) == 1 &&
+            !strcmp(fty_proto_aux_string(aux_result.get(0), "phase", ""), "L1"));
+        // Records of older writers fall back to the modification time
+        file = fopen(filename.c_str(), "w");
+        assert(file);
+        memset(buf, 0, sizeof(buf));
+        sprintf(buf, TTL_FMT UNIT_FMT "231", 0, "V");
+        fwrite(buf, 1, Record::record_len, file);
+        fclose(file);
+        struct timespec times[2] = { { 1500000000, 5 }, { 1500000000, 5 } };
+        check_err(utimensat(AT_FDCWD, filename.c_str(), times, 0));
+        check_err(fty::shm::read_metric("time_asset", "voltage", value, unit, time_ns));
+        assert(value == "231" && time_ns == 1500000000000000005LL);
+    }
+
+    // The packed backend keeps the metrics of an asset in one file of slots
+    {
+        std::string value, unit, filename = std::string(shm_dir) + "/" PACKED_DIR "/metric/packed_asset";
+        fty::shm::Metrics metrics;
+        fty::shm::AssetsMetrics assets;
+        struct stat st;
+        check_err(fty::shm::set_backend("packed"));
+        for (int i = 0; i < 20; i++)
+            check_err(fty::shm::write_metric("packed_asset", "load." + std::to_string(i), std::to_string(i), "%", 0));
+        check_err(fty::shm::write_metric("packed_asset", "load.3", "33", "%", 0));
+        check_err(fty::shm::write_metric("packed_other", "load.0", "7", "W", 0));
+        check_err(stat(filename.c_str(), &st));
+        assert(st.st_size == 20 * PACKED_SLOT_SIZE);
+        check_err(fty::shm::read_metric("packed_asset", "load.3", value, unit));
+        assert(value == "33" && unit == "%");
+        check_err(fty::shm::read_asset_metrics("packed_asset", metrics));
+        assert(metrics.size() == 20 && metrics["load.3"].value == "33" && metrics["load.19"].value == "19");
+        check_err(fty::shm::read_assets_metrics({ "packed_asset", "packed_other", "no_such_asset" }, assets));
+        assert(assets.size() == 2 && assets["packed_other"]["load.0"].unit == "W");
+        // A deleted metric keeps its slot for its next write
+        check_err(fty::shm::write_metric("packed_asset", "load.5", "5", "%", 1));
+        sleep(4);
+        check_err(fty_shm_cleanup(verbose));
+        assert(fty::shm::read_metric("packed_asset", "load.5", value) < 0 && errno == ENOENT);
+        check_err(fty::shm::read_asset_metrics("packed_asset", metrics));
+        assert(metrics.size() == 19);
+        check_err(fty::shm::write_metric("packed_asset", "load.5", "55", "%", 0));
+        check_err(stat(filename.c_str(), &st));
+        assert(st.st_size == 20 * PACKED_SLOT_SIZE);
+        // Records that do not fit the slot
+        assert(fty::shm::write_metric("packed_asset", "inventory", std::string(Record::inline_value_len + 1, 'x'), "", 0) < 0 &&
+            errno == EMSGSIZE);
+        // Slots remembered by this process survive the file being recreated
+        check_err(unlink(filename.c_str()));
+        check_err(fty::shm::write_metric("packed_asset", "load.7", "7", "%", 0));
+        check_err(fty::shm::read_metric("packed_asset", "load.7", value));
+        assert(value == "7");
+        assert(fty::shm::read_metric("packed_asset", "load.3", value) < 0 && errno == ENOENT);
+        check_err(fty::shm::set_backend("file"));
+    }
+
+    // NUT variables are stored under their fty metric type and unit
+    {
+        std::string value, unit;
+        for (size_t i = 0; i < NUT_MAPPINGS; i++)
+            assert(find_nut_mapping(nut_mappings[i].nut) == &nut_mappings[i]);
+        assert(!find_nut_mapping("device.model") && !find_nut_mapping("ups.loa") && !find_nut_mapping(""));
+        // Variables of the same type give way to one another
+        for (size_t i = 0; i < NUT_MAPPINGS; i++) {
+            for (size_t j = i + 1; j < NUT_MAPPINGS; j++) {
+                const NutMapping &a = nut_mappings[i], &b = nut_mappings[j];
+                if (strcmp(a.type, b.type) == 0)
+                    assert((a.preferred && strcmp(a.preferred, b.nut) == 0) ||
+                        (b.preferred && strcmp(b.preferred, a.nut) == 0));
+            }
+        }
+        check_err(fty::shm::write_nut_metric("nut_ups", "ups.realpower", "1200", 0));
+        check_err(fty::shm::read_metric("nut_ups", "realpower.default", value, unit));
+        assert(value == "1200" && unit == "W");
+        check_err(fty_shm_write_nut_metric("nut_ups", "ups.vendorid", "0463", 0));
+        check_err(fty::shm::read_metric("nut_ups", "ups.vendorid", value, unit));
+        assert(value == "0463" && unit.empty());
+        std::map<std::string, std::string> inventory = {
+            { "battery.charge", "100" }, { "input.L2-N.voltage", "231.5" }, { "output.L3.power", "900" },
+            { "device.model", "Eaton 9PX" }, { "ups.serial", "G123" } };
+        check_err(fty::shm::write_nut_metrics("nut_ups_3ph", inventory, 60));
+        fty::shm::Metrics metrics;
+        check_err(fty::shm::read_asset_metrics("nut_ups_3ph", metrics));
+        assert(metrics.size() == 3 && metrics["charge.battery"].unit == "%" &&
+            metrics["voltage.input.L2-N"].value == "231.5" && metrics["power.output.L3"].unit == "VA");
+        std::map<std::string, std::string> both = {
+            { "ambient.temperature", "24" }, { "ups.temperature", "38" },
+            { "input.voltage", "400" }, { "input.L1-N.voltage", "230" } };
+        check_err(fty::shm::write_nut_metrics("nut_ups_both", both, 60));
+        check_err(fty::shm::read_metric("nut_ups_both", "temperature.default", value));
+        assert(value == "24");
+        check_err(fty::shm::read_metric("nut_ups_both", "temperature.internal", value));
+        assert(value == "38");
+        check_err(fty::shm::read_metric("nut_ups_both", "voltage.input.L1-N", value));
+        assert(value == "230");
+        both.erase("input.L1-N.voltage");
+        check_err(fty::shm::write_nut_metrics("nut_ups_both", both, 60));
+        check_err(fty::shm::read_metric("nut_ups_both", "voltage.input.L1-N", value));
+        assert(value == "400");
+        inventory["ups.load"] = "5";
+        assert(fty::shm::write_nut_metrics("nut/ups", inventory, 60) < 0 && errno == EINVAL);
+    }
+
+    // Metrics written with their frame return it as written, the others an
+    // encoded one, and the readers of the text do not see it
+    {
+        std::string phase(100, 'L');
+        fty::shm::set_store_frames(true);
+        for (const char* backend : { "file", "heap", "packed" }) {
+            fty::shm::Frames frames;
+            fty::shm::shmMetrics result, filtered;
+            check_err(fty::shm::set_backend(backend));
+            fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+            fty_proto_set_name(metric, "frame_asset");
+            fty_proto_set_type(metric, "power");
+            fty_proto_set_value(metric, "%s", "1500");
+            fty_proto_set_unit(metric, "W");
+            fty_proto_set_ttl(metric, 60);
+            fty_proto_set_time(metric, 1234);
+            fty_proto_aux_insert(metric, "phase", "%s", phase.c_str());
+            fty_proto_t* copy = fty_proto_dup(metric);
+            zmsg_t* msg = fty_proto_encode(&copy);
+            std::string expected(reinterpret_cast<const char*>(zframe_data(zmsg_first(msg))),
+                zframe_size(zmsg_first(msg)));
+            zmsg_destroy(&msg);
+            check_err(fty::shm::write_metric(metric));
+            fty_proto_destroy(&metric);
+            check_err(fty::shm::write_metric("frame_asset", "voltage", "230", "V", 0));
+            check_err(fty::shm::read_metric_frames(fty::shm::Query("metric", "frame_asset", "power"), frames));
+            // The packed slots only have room for the text
+            if (strcmp(backend, "packed"))
+                assert(frames.size() == 1 && frames[0] == expected);
+            else
+                assert(frames.size() == 1 && frames[0] != expected && frames[0].find(phase) != std::string::npos);
+            check_err(fty::shm::read_metrics(fty::shm::Query("metric", "frame_asset", "power"), result));
+            assert(result.size() == 1 && !strcmp(fty_proto_value(result.get(0)), "1500"));
+            assert(zhash_size(fty_proto_aux(result.get(0))) == 1 &&
+                fty_proto_aux_string(result.get(0), "phase", "") == phase);
+            fty::shm::Query query("metric", "frame_asset");
+            query.aux_key = "phase";
+            query.aux_value = phase;
+            check_err(fty::shm::read_metrics(query, filtered));
+            assert(filtered.size() == 1);
+            // Encoded from the record of a value
+            check_err(fty::shm::read_metric_frames(fty::shm::Query("metric", "frame_asset", "voltage"), frames));
+            assert(frames.size() == 1 && frames[0].find("230") != std::string::npos);
+            check_err(fty::shm::read_metric_frames(fty::shm::Query("metric", "frame_asset"), frames));
+            assert(frames.size() == 2);
+        }
+        fty::shm::set_store_frames(false);
+        check_err(fty::shm::set_backend("file"));
+    }
+
+    // The record layout writes the header of the printf() formats, and
+    // other geometries encode and decode the same way
+    {
+        char buf[Record::record_len + 1], expected[Record::header_len + 1];
+        for (int ttl : { 0, 7, 300, 2147483647 }) {
+            for (const char* unit : { "", "V", "%", "kWh", "0123456789" }) {
+                check_err(Record::encode_header(buf, ttl, unit, strlen(unit)));
+                sprintf(expected, TTL_FMT UNIT_FMT, ttl, unit);
+                assert(!memcmp(buf, expected, Record::header_len));
+            }
+        }
+        assert(Record::encode_header(buf, 0, "01234567890", 11) < 0 && errno == EINVAL);
+
+        typedef RecordLayout<64, 4> Small;
+        static_assert(Small::header_len == 16 && Small::payload_len == 48 && Small::inline_value_len == 37,
+            "unexpected geometry");
+        char small[Small::record_len + 1];
+        time_t ttl;
+        check_err(Small::encode_header(small, 60, "W", 1));
+        Small::encode_payload(small, "1234.5", 6, 1500000000000000005LL);
+        small[Small::record_len] = '\0';
+        assert(!memcmp(small, "0000000060\nW   \n1234.5", 22));
+        check_err(Small::decode_ttl(small, ttl));
+        assert(ttl == 60 && !strcmp(Small::payload(small), "1234.5"));
+        assert(Small::time(small) == 1500000000000000005LL);
+        small[3] = ' ';
+        assert(Small::decode_ttl(small, ttl) < 0 && errno == ERANGE);
+    }
+
+    // Name scanning of the directory reader, with the separator and the end
+    // of the name on either side of the 16 byte chunks
+    {
+        char name_buf[64 + 16];
+        for (size_t len = 0; len < 64; len++) {
+            for (size_t at = 0; at <= len; at += 5) {
+                memset(name_buf, 'x', sizeof(name_buf));
+                name_buf[len] = '\0';
+                name_buf[len + 1] = SEPARATOR;
+                if (at < len)
+                    name_buf[at] = SEPARATOR;
+                const char* delim;
+                assert(scan_name(name_buf, delim) == len);
+                assert(delim == (at < len ? name_buf + at : NULL));
+            }
+        }
+    }
+
+    // Number parser fast path and strtod() fallback
+    const char* numbers[] = { "0", "-12.5", "230", "0.000001", "12345678901234567", "1e3",
+        "123456789012345678901234", "3.14159265358979", "42.000000\n" };
+    for (const char* number : numbers) {
+        double parsed;
+        assert(parse_value(number, number + strlen(number), parsed));
+        assert(parsed == strtod(number, NULL));
+    }
+    double parsed;
+    assert(!parse_value("12a", "12a" + 3, parsed));
+    assert(!parse_value("", "", parsed));
+    assert(!parse_value("-", "-" + 1, parsed));
+    assert(parse_value("inf", "inf" + 3, parsed) && parsed == HUGE_VAL);
+    assert(parse_value("-Infinity", "-Infinity" + 9, parsed) && parsed == -HUGE_VAL);
+    assert(parse_value("nan\n", "nan\n" + 4, parsed) && parsed != parsed);
+    assert(!parse_value("info", "info" + 4, parsed));
+    assert(!parse_value("online", "online" + 6, parsed));
 
     // Check that we are not leaking file descriptors
     DIR* dir;
@@ -28,6 +28,7 @@
 
 #include <getopt.h>
 #include <iostream>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -39,22 +40,27 @@ static const char help_text[]
       "  -v, --verbose         show verbose output\n"
       "  -s, --single-pass     do a single iteration and exit\n"
       "  -d, --directory=DIR   set a custom storage directory for testing\n"
+      "  -S, --shard=FAMILY:N  move the metrics of FAMILY to N subdirectories\n"
+      "                        and exit\n"
       "  -h, --help            display this help text and exit\n";
 
 int main(int argc, char* argv[])
 {
     bool verbose = false, single = false;
+    std::string shard;
 
     static struct option long_opts[] = {
         { "help", no_argument, 0, 'h' },
         { "verbose", no_argument, 0, 'v' },
         { "single-pass", no_argument, 0, 's' },
-        { "directory", required_argument, 0, 'd' }
+        { "directory", required_argument, 0, 'd' },
+        { "shard", required_argument, 0, 'S' },
+        { 0, 0, 0, 0 }
     };
 
     int c = 0;
     while (c >= 0) {
-        c = getopt_long(argc, argv, "hvsd:", long_opts, 0);
+        c = getopt_long(argc, argv, "hvsd:S:", long_opts, 0);
 
         switch (c) {
         case 'v':
@@ -69,6 +75,9 @@ int main(int argc, char* argv[])
         case 'd':
             fty_shm_set_test_dir(optarg);
             break;
+        case 'S':
+            shard = optarg;
+            break;
         case '?':
             std::cerr << help_text;
             return 1;
@@ -78,6 +87,22 @@ int main(int argc, char* argv[])
         }
     }
     //  Insert main code here
+    if (!shard.empty()) {
+        size_t colon = shard.rfind(':');
+        if (colon == std::string::npos) {
+            std::cerr << help_text;
+            return 1;
+        }
+        std::string family = shard.substr(0, colon);
+        unsigned fanout = strtoul(shard.c_str() + colon + 1, NULL, 10);
+        if (verbose)
+            std::cout << "Sharding " << family << " into " << fanout << " directories" << std::endl;
+        if (fty::shm::shard_family(family, fanout) < 0) {
+            std::cerr << "Sharding " << family << " failed: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        return 0;
+    }
     if (verbose)
         std::cout << "fty_shm_cleanup - Garbage collector for fty-shm" << std::endl;
 